@@ -66,18 +66,20 @@ typedef Image::Buffer<bool> MaskBufferType;
 
 
 
+// Each call processes all voxels along the inner axis of the loop as a single batch
 class Processor
 {
   public:
     Processor (InputBufferType::voxel_type& DWI_vox,
         OutputBufferType::voxel_type& FOD_vox,
         copy_ptr<MaskBufferType::voxel_type>& mask_vox,
-        const DWI::CSDeconv<value_type>::Shared& shared) :
+        const DWI::CSDeconv<value_type>::Shared& shared,
+        size_t inner_axis) :
       dwi (DWI_vox),
       fod (FOD_vox),
       mask (mask_vox),
       sdeconv (shared),
-      data (shared.dwis.size()) {
+      inner_axis (inner_axis) {
         if (mask)
           Image::check_dimensions (*mask, dwi, 0, 3);
       }
@@ -85,19 +87,20 @@ class Processor
 
 
     void operator () (const Image::Iterator& pos) {
-      if (!load_data (pos))
+      load_data (pos);
+      if (positions.empty())
         return;
 
-      sdeconv.set (data);
+      sdeconv (data);
 
-      size_t n;
-      for (n = 0; n < sdeconv.shared.niter; n++)
-        if (sdeconv.iterate())
-          break;
-
-      if (n >= sdeconv.shared.niter)
-        INFO ("voxel [ " + str (pos[0]) + " " + str (pos[1]) + " " + str (pos[2]) +
-            " ] did not reach full convergence");
+      for (size_t n = 0; n < positions.size(); ++n) {
+        if (!sdeconv.is_converged (n)) {
+          Image::voxel_assign (dwi, pos);
+          dwi[inner_axis] = positions[n];
+          INFO ("voxel [ " + str (dwi[0]) + " " + str (dwi[1]) + " " + str (dwi[2]) +
+              " ] did not reach full convergence");
+        }
+      }
 
       write_back (pos);
     }
@@ -108,38 +111,55 @@ class Processor
     InputBufferType::voxel_type dwi;
     OutputBufferType::voxel_type fod;
     copy_ptr<MaskBufferType::voxel_type> mask;
-    DWI::CSDeconv<value_type> sdeconv;
-    Math::Vector<value_type> data;
+    DWI::CSDeconvBatch<value_type> sdeconv;
+    const size_t inner_axis;
+    Math::Matrix<value_type> data;
+    std::vector<ssize_t> positions;
 
 
 
-    bool load_data (const Image::Iterator& pos) {
-      if (mask) {
-        Image::voxel_assign (*mask, pos);
-        if (!mask->value())
-          return false;
-      }
+    void load_data (const Image::Iterator& pos) {
+      const size_t num_dwis = sdeconv.shared.dwis.size();
+      data.allocate (dwi.dim (inner_axis), num_dwis);
+      positions.clear();
 
       Image::voxel_assign (dwi, pos);
+      if (mask)
+        Image::voxel_assign (*mask, pos);
 
-      for (size_t n = 0; n < sdeconv.shared.dwis.size(); n++) {
-        dwi[3] = sdeconv.shared.dwis[n];
-        data[n] = dwi.value();
-        if (!std::isfinite (data[n]))
-          return false;
-        if (data[n] < 0.0)
-          data[n] = 0.0;
+      for (ssize_t i = 0; i < dwi.dim (inner_axis); ++i) {
+        if (mask) {
+          (*mask)[inner_axis] = i;
+          if (!mask->value())
+            continue;
+        }
+        dwi[inner_axis] = i;
+        bool valid = true;
+        for (size_t n = 0; n < num_dwis; n++) {
+          dwi[3] = sdeconv.shared.dwis[n];
+          value_type value = dwi.value();
+          if (!std::isfinite (value)) {
+            valid = false;
+            break;
+          }
+          data (positions.size(), n) = value < 0.0 ? 0.0 : value;
+        }
+        if (valid)
+          positions.push_back (i);
       }
 
-      return true;
+      data.resize (positions.size(), num_dwis);
     }
 
 
 
     void write_back (const Image::Iterator& pos) {
       Image::voxel_assign (fod, pos);
-      for (fod[3] = 0; fod[3] < fod.dim (3); ++fod[3])
-        fod.value() = sdeconv.FOD() [fod[3]];
+      for (size_t n = 0; n < positions.size(); ++n) {
+        fod[inner_axis] = positions[n];
+        for (fod[3] = 0; fod[3] < fod.dim (3); ++fod[3])
+          fod.value() = sdeconv.FODs() (n, fod[3]);
+      }
     }
 
 };
@@ -177,8 +197,8 @@ void run ()
   auto dwi_vox = dwi_buffer.voxel();
   auto FOD_vox = FOD_buffer.voxel();
 
-  Processor processor (dwi_vox, FOD_vox, mask_vox, shared);
   Image::ThreadedLoop loop ("performing constrained spherical deconvolution...", dwi_vox, 0, 3);
-  loop.run (processor);
+  Processor processor (dwi_vox, FOD_vox, mask_vox, shared, loop.inner_axes()[0]);
+  loop.run_outer (processor);
 }
 
@@ -20,6 +20,9 @@
 
 */
 
+#include <algorithm>
+#include <numeric>
+
 #include "command.h"
 #include "args.h"
 #include "exception.h"
@@ -190,7 +193,11 @@ void run ()
   }
   shared.lmax = lmax;
 
-  Image::BufferPreload<float> dwi (H, Image::Stride::contiguous_along_axis (3));
+  // Only the voxels within the initial mask can ever be selected; their DWI signals are
+  //   loaded once, and all subsequent processing operates on these rather than the image
+  const PackedSignals data (H, mask, shared.dwis);
+  if (!data.size())
+    throw Exception ("Cannot estimate response function; no voxels within mask contain valid DWI data");
   DWI::Directions::Set directions (1281);
 
   Math::Vector<float> response (lmax/2+1);
@@ -200,21 +207,16 @@ void run ()
     // Initialise response function
     // Use lmax = 2, get the DWI intensity mean and standard deviation within the mask and
     //   use these as the first two coefficients
-    auto v_dwi = dwi.voxel();
+    const Math::Matrix<float>& signals (data.get_signals());
     double sum = 0.0, sq_sum = 0.0;
-    size_t count = 0;
-    Image::LoopInOrder loop (dwi, "initialising response function... ", 0, 3);
-    for (auto l = loop (v_dwi, v_mask); l; ++l) {
-      if (v_mask.value()) {
-        for (size_t volume_index = 0; volume_index != shared.dwis.size(); ++volume_index) {
-          v_dwi[3] = shared.dwis[volume_index];
-          const float value = v_dwi.value();
-          sum += value;
-          sq_sum += Math::pow2 (value);
-          ++count;
-        }
+    for (size_t row = 0; row != signals.rows(); ++row) {
+      for (size_t volume_index = 0; volume_index != signals.columns(); ++volume_index) {
+        const float value = signals (row, volume_index);
+        sum += value;
+        sq_sum += Math::pow2 (value);
       }
     }
+    const size_t count = signals.rows() * signals.columns();
     response[0] = sum / double (count);
     response[1] = - 0.5 * std::sqrt ((sq_sum / double(count)) - Math::pow2 (response[0]));
     // Account for scaling in SH basis
@@ -245,6 +247,11 @@ void run ()
   size_t total_iter = 0;
   bool first_pass = true;
   size_t prev_sf_count = 0;
+
+  // Candidate voxels are identified by their rows within the packed data
+  std::vector<size_t> all_voxels (data.size());
+  std::iota (all_voxels.begin(), all_voxels.end(), 0);
+  std::vector<size_t> candidates (all_voxels);
   {
     bool iterate = true;
     size_t iter = 0;
@@ -262,23 +269,18 @@ void run ()
       ++progress;
 
       if (reset_mask) {
-        if (mask_path.size()) {
-          Image::Buffer<bool> in (mask_path);
-          auto v_in = in.voxel();
-          Image::copy (v_in, v_mask, 0, 3);
-        } else {
-          for (auto l = Image::LoopInOrder(v_mask) (v_mask); l; ++l)
-            v_mask.value() = true;
-        }
+        candidates = all_voxels;
         ++progress;
       }
 
       std::vector<FODSegResult> seg_results;
       {
-        FODCalcAndSeg processor (dwi, mask, shared, directions, lmax, seg_results);
-        Image::ThreadedLoop loop (mask, 0, 3);
-        loop.run (processor);
+        CandidateSource source (candidates);
+        FODCalcAndSeg processor (data, shared, directions, lmax, seg_results);
+        Thread::run_queue (source, CandidateBlock(), Thread::multi (processor));
       }
+      // Restore a consistent ordering of voxels, regardless of thread scheduling
+      std::sort (seg_results.begin(), seg_results.end(), [] (const FODSegResult& a, const FODSegResult& b) { return a.get_index() < b.get_index(); });
 
       ++progress;
 
@@ -288,10 +290,10 @@ void run ()
       ++progress;
 
       Response output (lmax);
-      mask.zero();
+      candidates.clear();
       {
-        SFSelector selector (seg_results, thresholds, mask);
-        ResponseEstimator estimator (dwi, shared, lmax, output);
+        SFSelector selector (seg_results, thresholds, candidates);
+        ResponseEstimator estimator (data, shared, lmax, output);
         Thread::run_queue (selector, FODSegResult(), Thread::multi (estimator));
       }
       if (!output.get_count())
@@ -346,8 +348,12 @@ void run ()
   response.save (argument[1]);
 
   opt = get_options ("sf");
-  if (opt.size())
+  if (opt.size()) {
+    mask.zero();
+    for (std::vector<size_t>::const_iterator i = candidates.begin(); i != candidates.end(); ++i)
+      Image::Nav::set_value_at_pos (v_mask, data.get_vox (*i), true);
     v_mask.save (std::string (opt[0][0]));
+  }
 
 }
 
@@ -34,8 +34,10 @@
 #include "math/sech.h"
 #include "math/least_squares.h"
 #include "math/gradient_descent.h"
+#include "dwi/bootstrap.h"
 #include "dwi/gradient.h"
 #include "dwi/tensor.h"
+#include "dwi/tensor_fit.h"
 
 #include "math/check_gradient.h"
 
@@ -45,7 +47,7 @@ using namespace MR;
 using namespace App;
 
 
-const char* method_choices[] = { "loglinear", "nonlinear", "sech", "rician", NULL };
+const char* method_choices[] = { "loglinear", "nonlinear", "sech", "rician", "wls", NULL };
 
 void usage ()
 {
@@ -56,7 +58,9 @@ void usage ()
       "loglinear: standard log-linear least-squares fit."
       "nonlinear: non-linear least-squares fit, with positivity constraint on diagonal elements of tensor."
       "sech: non-linear fit assuming a sech() noise model, with positivity constraint on diagonal elements of tensor. This method has improved robustness to outliers."
-      "rician: non-linear fit assuming a Rician noise model, with positivity constraint on diagonal elements of tensor.";
+      "rician: non-linear fit assuming a Rician noise model, with positivity constraint on diagonal elements of tensor."
+      "wls: iteratively reweighted log-linear least-squares fit, with weights given by the squared predicted signal."
+      "The non-linear methods are initialised using the log-linear fit, unless the -wls_init option is provided.";
 
   ARGUMENTS
   + Argument ("dwi", "the input diffusion-weighted image.").type_image_in ()
@@ -70,7 +74,7 @@ void usage ()
 
     + Option ("method",
       "select method used to perform the fitting (Valid choices are: loglinear, "
-      "nonlinear, sech, rician. Default: non-linear)")
+      "nonlinear, sech, rician, wls. Default: non-linear)")
     + Argument ("name").type_choice (method_choices)
 
     + Option ("regularisation",
@@ -78,6 +82,29 @@ void usage ()
       "tensor elements (default = 5000). This only applies to the non-linear methods.")
     + Argument ("term").type_float (0.0, 5000.0, 1e12)
 
+    + Option ("iter",
+      "the number of iterations of the weighted least-squares fit (default = 2). "
+      "This applies to the wls method, and to the initialisation of the non-linear methods "
+      "if the -wls_init option is provided.")
+    + Argument ("number").type_integer (1, 2, 100)
+
+    + Option ("wls_init",
+      "initialise the non-linear methods using the weighted least-squares fit, rather than "
+      "the log-linear fit. This generally reduces the number of iterations required, but "
+      "may change the solution found.")
+
+    + Option ("bootstrap_fa",
+      "estimate a 95% confidence interval for the fractional anisotropy using the "
+      "wild bootstrap. The leverage-corrected residuals of the log-linear fit are "
+      "resampled to generate the specified number of realisations of each voxel, each "
+      "of which is fitted using the wls method (irrespective of the method selected for "
+      "the tensor output). The 2.5th and 97.5th percentiles of the FA across realisations "
+      "are written to the image provided, as two volumes. Measurements that the tensor "
+      "model fits exactly (e.g. a single b=0 volume) contribute no variability, so the "
+      "intervals are only reliable if several b=0 volumes are available.")
+    + Argument ("number").type_integer (2, 100, 100000)
+    + Argument ("image").type_image_out ()
+
     + DWI::GradImportOptions();
 
 
@@ -91,6 +118,10 @@ typedef Image::Buffer<value_type> OutputBufferType;
 typedef Image::Buffer<bool> MaskBufferType;
 
 
+// Maximum number of bootstrap realisations of a row of voxels generated & fitted at a time
+#define BOOTSTRAP_REALISATIONS_PER_BLOCK 64
+
+
 class Cost
 {
   public:
@@ -245,18 +276,27 @@ class Processor
         InputBufferType::voxel_type& dwi_vox, 
         OutputBufferType::voxel_type& dt_vox,
         copy_ptr<MaskBufferType::voxel_type>& mask_vox,
+        copy_ptr<OutputBufferType::voxel_type>& fa_ci_vox,
         const Math::Matrix<cost_value_type>& bmatrix,
         const Math::Matrix<cost_value_type>& inverse_bmatrix,
         int fitting_method, 
         const cost_value_type regularisation_term,
+        const size_t wls_iterations,
+        const bool wls_initialisation,
+        const size_t num_bootstrap,
         ssize_t inner_axis,
         ssize_t dwi_axis = 3) :
       dwi (dwi_vox),
       dt (dt_vox),
       mask (mask_vox),
+      fa_ci (fa_ci_vox),
       cost (bmatrix, fitting_method, regularisation_term),
       binv (inverse_bmatrix),
+      wls (bmatrix, wls_iterations),
+      bootstrap (bmatrix),
+      num_bootstrap (num_bootstrap),
       method (fitting_method),
+      wls_init (wls_initialisation),
       reg_norm (regularisation_term),
       row_axis (inner_axis),
       sig_axis (dwi_axis) { 
@@ -271,10 +311,17 @@ class Processor
       // compute tensors via log-linear least-squares:
       Math::mult (tensors, cost_value_type(0.0), cost_value_type(1.0), CblasNoTrans, logsignals, CblasTrans, binv);
 
-      if (method > 0) 
+      if (method == 4 || (method > 0 && wls_init))
+        wls (logsignals, tensors);
+      if (method > 0 && method < 4)
         solve_nonlinear();
 
       write_back ();
+
+      if (fa_ci) {
+        bootstrap_fa();
+        write_back_fa_ci();
+      }
     }
 
 
@@ -282,12 +329,20 @@ class Processor
     InputBufferType::voxel_type dwi;
     OutputBufferType::voxel_type dt;
     copy_ptr<MaskBufferType::voxel_type> mask;
-    Math::Matrix<cost_value_type> signals, logsignals, tensors;
+    copy_ptr<OutputBufferType::voxel_type> fa_ci;
+    Math::Matrix<cost_value_type> signals, logsignals, tensors, realisations, realisation_tensors;
     Cost cost;
 
     const Math::Matrix<cost_value_type>& binv;
+    DWI::WLSTensorFit<cost_value_type> wls;
+    DWI::BootstrapBlock<cost_value_type> bootstrap;
+    const size_t num_bootstrap;
+    Math::RNG rng;
+    std::vector<std::vector<cost_value_type> > fa_samples;
+    Math::Matrix<cost_value_type> fa_limits;
 
     const int method;
+    const bool wls_init;
     const cost_value_type reg_norm;
     const size_t row_axis, sig_axis;
 
@@ -295,6 +350,8 @@ class Processor
     bool load_data (const Image::Iterator& pos) {
       Image::voxel_assign (dwi, pos);
       Image::voxel_assign (dt, pos);
+      if (fa_ci)
+        Image::voxel_assign (*fa_ci, pos);
 
       size_t nvox = dwi.dim (row_axis);
       if (mask) {
@@ -345,6 +402,50 @@ class Processor
     }
 
 
+    // the FA of each realisation is computed from its wls fit, in blocks of realisations
+    //   to bound the memory required for long rows:
+    void bootstrap_fa () {
+      const size_t nvox = logsignals.rows();
+      bootstrap.set (logsignals);
+      fa_samples.resize (nvox);
+      for (size_t v = 0; v < nvox; ++v)
+        fa_samples[v].clear();
+
+      for (size_t done = 0; done < num_bootstrap; done += BOOTSTRAP_REALISATIONS_PER_BLOCK) {
+        const size_t count = std::min (size_t (BOOTSTRAP_REALISATIONS_PER_BLOCK), num_bootstrap - done);
+        bootstrap (realisations, count, rng);
+        Math::mult (realisation_tensors, cost_value_type(1.0), CblasNoTrans, realisations, CblasTrans, binv);
+        wls (realisations, realisation_tensors);
+        for (size_t r = 0; r < count; ++r)
+          for (size_t v = 0; v < nvox; ++v)
+            fa_samples[v].push_back (DWI::tensor2FA (&realisation_tensors (r*nvox + v, 0)));
+      }
+
+      fa_limits.allocate (nvox, 2);
+      for (size_t v = 0; v < nvox; ++v) {
+        std::vector<cost_value_type>& fa (fa_samples[v]);
+        std::sort (fa.begin(), fa.end());
+        fa_limits (v,0) = fa[std::lround (0.025 * (fa.size()-1))];
+        fa_limits (v,1) = fa[std::lround (0.975 * (fa.size()-1))];
+      }
+    }
+
+
+
+    void write_back_fa_ci () {
+      size_t N = 0;
+      for ((*fa_ci)[row_axis] = 0; (*fa_ci)[row_axis] < fa_ci->dim(row_axis); ++(*fa_ci)[row_axis]) {
+        if (mask) {
+          (*mask)[row_axis] = (*fa_ci)[row_axis];
+          if (!mask->value()) continue;
+        }
+        for ((*fa_ci)[3] = 0; (*fa_ci)[3] < 2; ++(*fa_ci)[3])
+          fa_ci->value() = fa_limits (N, (*fa_ci)[3]);
+        ++N;
+      }
+    }
+
+
     void solve_nonlinear () {
       for (size_t i = 0; i < signals.rows(); ++i) {
         const Math::Vector<cost_value_type> signal (signals.row(i));
@@ -404,6 +505,29 @@ void run()
   cost_value_type regularisation = 5000.0;
   if (opt.size()) regularisation = opt[0][0];
 
+  opt = get_options ("iter");
+  size_t wls_iterations = 2;
+  if (opt.size()) wls_iterations = opt[0][0];
+  const bool wls_init = get_options ("wls_init").size();
+  if (wls_init && (method == 0 || method == 4))
+    WARN ("option -wls_init only applies to the non-linear methods; ignored");
+
+  opt = get_options ("bootstrap_fa");
+  size_t num_bootstrap = 0;
+  std::string fa_ci_path;
+  if (opt.size()) {
+    num_bootstrap = opt[0][0];
+    fa_ci_path = str (opt[0][1]);
+    DWI::BootstrapBlock<cost_value_type> bootstrap (bmatrix);
+    for (size_t i = 0; i < bmatrix.rows(); ++i) {
+      if (bootstrap.is_exact (i)) {
+        WARN ("some measurements are fitted exactly by the tensor model (e.g. a single b=0 volume); "
+              "the FA confidence intervals will not reflect their noise, and will therefore be too narrow");
+        break;
+      }
+    }
+  }
+
   opt = get_options ("mask");
   std::unique_ptr<MaskBufferType> mask_buffer;
   copy_ptr<MaskBufferType::voxel_type> mask_vox;
@@ -422,11 +546,21 @@ void run()
 
   OutputBufferType dt_buffer (argument[1], dt_header);
 
+  std::unique_ptr<OutputBufferType> fa_ci_buffer;
+  copy_ptr<OutputBufferType::voxel_type> fa_ci_vox;
+  if (num_bootstrap) {
+    Image::Header fa_ci_header (dt_header);
+    fa_ci_header.dim (3) = 2;
+    fa_ci_header.DW_scheme().clear();
+    fa_ci_buffer.reset (new OutputBufferType (fa_ci_path, fa_ci_header));
+    fa_ci_vox.reset (new OutputBufferType::voxel_type (*fa_ci_buffer));
+  }
+
   InputBufferType::voxel_type dwi_vox (dwi_buffer);
   OutputBufferType::voxel_type dt_vox (dt_buffer);
 
   Image::ThreadedLoop loop ("estimating tensor components...", dwi_vox, 0, 3);
-  Processor processor (dwi_vox, dt_vox, mask_vox, bmatrix, binv, method, regularisation, loop.inner_axes()[0], dwi_axis);
+  Processor processor (dwi_vox, dt_vox, mask_vox, fa_ci_vox, bmatrix, binv, method, regularisation, wls_iterations, wls_init, num_bootstrap, loop.inner_axes()[0], dwi_axis);
 
   loop.run_outer (processor);
 }
@@ -0,0 +1,372 @@
+/*
+    Copyright 2008 Brain Research Institute, Melbourne, Australia
+
+    Written by David Raffelt, 23/07/11.
+
+    This file is part of MRtrix.
+
+    MRtrix is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    MRtrix is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with MRtrix.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "command.h"
+#include "progressbar.h"
+#include "file/path.h"
+#include "image/buffer_sparse.h"
+#include "image/buffer_scratch.h"
+#include "image/loop.h"
+#include "image/voxel.h"
+#include "image/sparse/fixel_metric.h"
+#include "image/sparse/voxel.h"
+#include "math/stats/permutation.h"
+#include "math/stats/glm.h"
+#include "dwi/tractography/file.h"
+#include "dwi/tractography/properties.h"
+#include "dwi/tractography/mapping/loader.h"
+#include "dwi/tractography/mapping/mapper.h"
+#include "dwi/tractography/mapping/mapping.h"
+#include "stats/cfe.h"
+#include "stats/permtest.h"
+#include "stats/subject_data.h"
+
+
+using namespace MR;
+using namespace App;
+
+using Image::Sparse::FixelMetric;
+
+
+void usage ()
+{
+  AUTHOR = "David Raffelt (david.raffelt@florey.edu.au)";
+
+  DESCRIPTION
+  + "Fixel-based analysis using connectivity-based fixel enhancement and non-parametric permutation testing.";
+
+  ARGUMENTS
+  + Argument ("input", "a text file listing the file names of the input fixel images, one file per line").type_file_in()
+
+  + Argument ("template", "the fixel mask used to define fixels of interest. This can be generated by "
+                          "thresholding the group average AFD fixel image.").type_image_in()
+
+  + Argument ("design", "the design matrix, rows should correspond with images in the input image text file").type_file_in()
+
+  + Argument ("contrast", "the contrast matrix, only specify one contrast as it will automatically compute the opposite contrast.").type_file_in()
+
+  + Argument ("tracks", "the tracks used to determine fixel-fixel connectivity").type_file_in()
+
+  + Argument ("output", "the filename prefix for all output.").type_text();
+
+
+  OPTIONS
+  + Option ("negative", "automatically test the negative (opposite) contrast. By computing the opposite contrast simultaneously "
+                        "the computation time is reduced.")
+
+  + Option ("nperms", "the number of permutations (default = 5000).")
+  +   Argument ("num").type_integer (1, 5000, 100000)
+
+  + Option ("cfe_dh", "the height increment used in the CFE integration (default = 0.1)")
+  +   Argument ("value").type_float (0.001, 0.1, 100000)
+
+  + Option ("cfe_e", "CFE extent parameter (default = 2)")
+  +   Argument ("value").type_float (0.001, 2.0, 100000)
+
+  + Option ("cfe_h", "CFE height parameter (default = 3)")
+  +   Argument ("value").type_float (0.001, 3.0, 100000)
+
+  + Option ("connectivity", "a threshold to define the required fraction of shared connections to be included in the "
+                            "neighbourhood (default: 0.01)")
+  +   Argument ("threshold").type_float (0.001, 0.01, 1.0)
+
+  + Option ("angle", "the max angle threshold for computing inter-subject fixel correspondence, and for assigning "
+                     "streamline tangents to fixels (Default: 30 degrees)")
+  +   Argument ("value").type_float (0.001, 30, 90)
+
+  + Option ("quantise", "store the fixel-fixel connectivity weights as 16-bit integers rather than floating-point values, "
+                        "halving the memory required at the expense of precision.")
+
+  + Option ("connectivity_file", "store the normalised fixel-fixel connectivity matrix in the file provided. If this file already "
+                                 "exists, the matrix is loaded from it rather than being computed from the tracks; it must "
+                                 "have been generated from the same template fixel image, and with the same -connectivity, "
+                                 "-angle and -quantise settings.")
+  +   Argument ("file").type_text();
+
+}
+
+
+typedef Stats::CFE::value_type value_type;
+
+
+
+// Assign the value of the subject fixel in the same voxel with the closest direction to each template fixel
+class SubjectLoader {
+  public:
+    SubjectLoader (const std::vector<std::string>& subjects, const Image::Header& template_header,
+                   Image::BufferScratch<int32_t>& fixel_indexer,
+                   const std::vector<Point<value_type> >& fixel_directions, const value_type angular_threshold_dp) :
+      subjects (subjects), template_header (template_header), fixel_indexer (fixel_indexer),
+      fixel_directions (fixel_directions), angular_threshold_dp (angular_threshold_dp) { }
+
+    void operator() (size_t subject, std::vector<value_type>& values) const {
+      Image::Header input_header (subjects[subject]);
+      Image::check_dimensions (input_header, template_header, 0, 3);
+      Image::BufferSparse<FixelMetric> input_data (input_header);
+      auto input_vox = input_data.voxel();
+      auto indexer = fixel_indexer.voxel();
+      Image::Loop loop (0, 3);
+      for (auto l = loop (input_vox, indexer); l; ++l) {
+        indexer[3] = 0;
+        const int32_t first_index = indexer.value();
+        if (first_index < 0)
+          continue;
+        indexer[3] = 1;
+        const int32_t last_index = first_index + indexer.value();
+        for (int32_t t = first_index; t != last_index; ++t) {
+          value_type largest_dp = 0.0;
+          int32_t closest = -1;
+          for (size_t f = 0; f != input_vox.value().size(); ++f) {
+            Point<value_type> dir (input_vox.value()[f].dir);
+            dir.normalise();
+            const value_type dp = std::abs (dir.dot (fixel_directions[t]));
+            if (dp > largest_dp) {
+              largest_dp = dp;
+              closest = f;
+            }
+          }
+          if (closest >= 0 && largest_dp > angular_threshold_dp)
+            values[t] = input_vox.value()[closest].value;
+        }
+      }
+    }
+
+  private:
+    const std::vector<std::string>& subjects;
+    const Image::Header& template_header;
+    Image::BufferScratch<int32_t>& fixel_indexer;
+    const std::vector<Point<value_type> >& fixel_directions;
+    const value_type angular_threshold_dp;
+};
+
+
+
+void write_fixel_output (const std::string& path, const Image::Header& template_header,
+                         Image::BufferScratch<int32_t>& fixel_indexer, const std::vector<value_type>& data)
+{
+  Image::BufferSparse<FixelMetric> template_data (template_header);
+  auto template_vox = template_data.voxel();
+  Image::BufferSparse<FixelMetric> output_data (path, template_header);
+  auto output_vox = output_data.voxel();
+  auto indexer = fixel_indexer.voxel();
+  Image::LoopInOrder loop (template_vox, "writing \"" + path + "\"...", 0, 3);
+  for (auto l = loop (template_vox, output_vox, indexer); l; ++l) {
+    output_vox.value().set_size (template_vox.value().size());
+    indexer[3] = 0;
+    const int32_t first_index = indexer.value();
+    for (size_t f = 0; f != template_vox.value().size(); ++f) {
+      output_vox.value()[f] = template_vox.value()[f];
+      output_vox.value()[f].value = data[first_index + f];
+    }
+  }
+}
+
+
+
+void run() {
+
+  Options opt = get_options ("cfe_dh");
+  value_type cfe_dh = 0.1;
+  if (opt.size())
+    cfe_dh = opt[0][0];
+
+  opt = get_options ("cfe_h");
+  value_type cfe_H = 3.0;
+  if (opt.size())
+    cfe_H = opt[0][0];
+
+  opt = get_options ("cfe_e");
+  value_type cfe_E = 2.0;
+  if (opt.size())
+    cfe_E = opt[0][0];
+
+  opt = get_options ("nperms");
+  int num_perms = 5000;
+  if (opt.size())
+    num_perms = opt[0][0];
+
+  opt = get_options ("connectivity");
+  value_type connectivity_threshold = 0.01;
+  if (opt.size())
+    connectivity_threshold = opt[0][0];
+
+  opt = get_options ("angle");
+  value_type angular_threshold = 30.0;
+  if (opt.size())
+    angular_threshold = opt[0][0];
+  const value_type angular_threshold_dp = cos (angular_threshold * (M_PI/180.0));
+
+  const bool compute_negative_contrast = get_options ("negative").size();
+
+  // Read filenames
+  std::vector<std::string> subjects;
+  {
+    std::string folder = Path::dirname (argument[0]);
+    std::ifstream ifs (argument[0].c_str());
+    std::string temp;
+    while (getline (ifs, temp))
+      subjects.push_back (Path::join (folder, temp));
+  }
+
+  // Load design matrix:
+  Math::Matrix<value_type> design;
+  design.load (argument[2]);
+  if (design.rows() != subjects.size())
+    throw Exception ("number of subjects does not match number of rows in design matrix");
+
+  // Load contrast matrix:
+  Math::Matrix<value_type> contrast;
+  contrast.load (argument[3]);
+  if (contrast.columns() > design.columns())
+    throw Exception ("too many contrasts for design matrix");
+  contrast.resize (contrast.rows(), design.columns());
+
+  // Index the template fixels: volume 0 of the indexer holds the index of the first fixel
+  //   in each voxel (-1 if there are none), and volume 1 the number of fixels in the voxel
+  Image::Header template_header (argument[1]);
+  Image::Header index_header (template_header);
+  index_header.set_ndim (4);
+  index_header.dim (3) = 2;
+  Image::BufferScratch<int32_t> fixel_indexer (index_header);
+  std::vector<Point<value_type> > fixel_directions;
+  {
+    Image::BufferSparse<FixelMetric> template_data (template_header);
+    auto template_vox = template_data.voxel();
+    auto indexer = fixel_indexer.voxel();
+    Image::LoopInOrder loop (template_vox, "indexing template fixels...", 0, 3);
+    for (auto l = loop (template_vox, indexer); l; ++l) {
+      indexer[3] = 0;
+      indexer.value() = template_vox.value().size() ? int32_t (fixel_directions.size()) : -1;
+      indexer[3] = 1;
+      indexer.value() = template_vox.value().size();
+      for (size_t f = 0; f != template_vox.value().size(); ++f) {
+        Point<value_type> dir (template_vox.value()[f].dir);
+        dir.normalise();
+        fixel_directions.push_back (dir);
+      }
+    }
+  }
+  const size_t num_fixels = fixel_directions.size();
+  CONSOLE ("number of fixels: " + str(num_fixels));
+
+  // Compute the fixel-fixel connectivity, or load it from a previous run; the parameters
+  //   used to compute the matrix are stored in the file, and must match those requested
+  const bool quantise = get_options ("quantise").size();
+  Stats::CFE::ConnectivityMatrix::Properties connectivity_properties;
+  connectivity_properties["connectivity_threshold"] = str (connectivity_threshold);
+  connectivity_properties["angular_threshold"] = str (angular_threshold);
+  Stats::CFE::ConnectivityMatrix connectivity_matrix;
+  opt = get_options ("connectivity_file");
+  const std::string connectivity_path = opt.size() ? std::string (opt[0][0]) : std::string();
+  if (connectivity_path.size() && Path::exists (connectivity_path)) {
+    connectivity_matrix.load (connectivity_path);
+    if (connectivity_matrix.size() != num_fixels)
+      throw Exception ("fixel connectivity file \"" + connectivity_path + "\" does not match the template fixel image");
+    for (Stats::CFE::ConnectivityMatrix::Properties::const_iterator i = connectivity_properties.begin(); i != connectivity_properties.end(); ++i) {
+      Stats::CFE::ConnectivityMatrix::Properties::const_iterator stored = connectivity_matrix.properties().find (i->first);
+      if (stored == connectivity_matrix.properties().end() || stored->second != i->second)
+        throw Exception ("fixel connectivity file \"" + connectivity_path + "\" was computed with " + i->first + " "
+                         + (stored == connectivity_matrix.properties().end() ? std::string ("unknown") : stored->second)
+                         + " rather than " + i->second);
+    }
+    if (connectivity_matrix.is_quantised() != quantise)
+      throw Exception ("fixel connectivity file \"" + connectivity_path + "\" was computed " + (quantise ? "without" : "with")
+                       + " the -quantise option");
+  } else {
+    std::vector<uint16_t> fixel_TDI (num_fixels, 0);
+    Stats::CFE::ConnectivityBuilder connectivity_builder (num_fixels);
+    {
+      DWI::Tractography::Properties properties;
+      DWI::Tractography::Reader<value_type> track_file (argument[4], properties);
+      const size_t num_tracks = properties.find ("count") == properties.end() ? 0 : to<size_t> (properties["count"]);
+      DWI::Tractography::Mapping::TrackLoader loader (track_file, num_tracks, "pre-computing fixel-fixel connectivity...");
+      DWI::Tractography::Mapping::TrackMapperBase mapper (template_header);
+      mapper.set_upsample_ratio (DWI::Tractography::Mapping::determine_upsample_ratio (template_header, std::string (argument[4]), 0.1));
+      mapper.set_use_precise_mapping (true);
+      // A single processor is used, since the fixel track density is not updated atomically
+      Stats::CFE::TrackProcessor tract_processor (fixel_indexer, fixel_directions, fixel_TDI, connectivity_builder, angular_threshold);
+      Thread::run_queue (loader, DWI::Tractography::Streamline<float>(), Thread::multi (mapper),
+                         DWI::Tractography::Mapping::SetVoxelDir(), tract_processor);
+    }
+    connectivity_builder.finalise (connectivity_matrix);
+    connectivity_matrix.normalise (fixel_TDI, connectivity_threshold);
+    if (quantise)
+      connectivity_matrix.quantise();
+    connectivity_matrix.properties() = connectivity_properties;
+    if (connectivity_path.size())
+      connectivity_matrix.save (connectivity_path);
+  }
+
+  Stats::SubjectData<value_type> data (num_fixels, subjects);
+  data.load (SubjectLoader (subjects, template_header, fixel_indexer, fixel_directions, angular_threshold_dp));
+
+  Math::Vector<value_type> perm_distribution (num_perms);
+  std::shared_ptr<Math::Vector<value_type> > perm_distribution_neg;
+  std::vector<value_type> cfe_output (num_fixels, 0.0);
+  std::shared_ptr<std::vector<value_type> > cfe_output_neg;
+  std::vector<value_type> tvalue_output (num_fixels, 0.0);
+  std::shared_ptr<std::vector<double> > empirical_cfe_statistic;
+  std::vector<value_type> uncorrected_pvalue (num_fixels, 0.0);
+  std::shared_ptr<std::vector<value_type> > uncorrected_pvalue_neg;
+
+  if (compute_negative_contrast) {
+    perm_distribution_neg.reset (new Math::Vector<value_type> (num_perms));
+    cfe_output_neg.reset (new std::vector<value_type> (num_fixels, 0.0));
+    uncorrected_pvalue_neg.reset (new std::vector<value_type> (num_fixels, 0.0));
+  }
+
+  { // Do permutation testing:
+    Math::Stats::GLMTTest glm (data.matrix(), design, contrast);
+    Stats::CFE::Enhancer cfe_integrator (connectivity_matrix, cfe_dh, cfe_E, cfe_H);
+
+    // The permutations are already run in parallel, but the default permutation is not
+    {
+      Stats::CFE::Enhancer threaded_cfe_integrator (connectivity_matrix, cfe_dh, cfe_E, cfe_H, Thread::number_of_threads());
+      Stats::PermTest::precompute_default_permutation (glm, threaded_cfe_integrator, empirical_cfe_statistic,
+                                                       cfe_output, cfe_output_neg, tvalue_output);
+    }
+
+    Stats::PermTest::run_permutations (glm, cfe_integrator, num_perms, empirical_cfe_statistic,
+                                       cfe_output, cfe_output_neg,
+                                       perm_distribution, perm_distribution_neg,
+                                       uncorrected_pvalue, uncorrected_pvalue_neg,
+                                       GLM_PERMUTATION_BATCH_SIZE);
+  }
+
+  const std::string prefix (argument[5]);
+
+  perm_distribution.save (prefix + "perm_dist.txt");
+  std::vector<value_type> pvalue_output (num_fixels, 0.0);
+  Math::Stats::statistic2pvalue (perm_distribution, cfe_output, pvalue_output);
+  write_fixel_output (prefix + "cfe.msf", template_header, fixel_indexer, cfe_output);
+  write_fixel_output (prefix + "tvalue.msf", template_header, fixel_indexer, tvalue_output);
+  write_fixel_output (prefix + "fwe_pvalue.msf", template_header, fixel_indexer, pvalue_output);
+  write_fixel_output (prefix + "uncorrected_pvalue.msf", template_header, fixel_indexer, uncorrected_pvalue);
+
+  if (compute_negative_contrast) {
+    (*perm_distribution_neg).save (prefix + "perm_dist_neg.txt");
+    std::vector<value_type> pvalue_output_neg (num_fixels, 0.0);
+    Math::Stats::statistic2pvalue (*perm_distribution_neg, *cfe_output_neg, pvalue_output_neg);
+    write_fixel_output (prefix + "cfe_neg.msf", template_header, fixel_indexer, *cfe_output_neg);
+    write_fixel_output (prefix + "fwe_pvalue_neg.msf", template_header, fixel_indexer, pvalue_output_neg);
+    write_fixel_output (prefix + "uncorrected_pvalue_neg.msf", template_header, fixel_indexer, *uncorrected_pvalue_neg);
+  }
+}
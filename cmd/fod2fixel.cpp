@@ -252,7 +252,8 @@ void run ()
   Segmenter fmls (dirs, Math::SH::LforN (H.dim(3)));
   load_fmls_thresholds (fmls);
 
-  Thread::run_queue (writer, SH_coefs(), Thread::multi (fmls), FOD_lobes(), receiver);
+  FOD_lobes_block_receiver<Segmented_FOD_receiver> block_receiver (receiver);
+  Thread::run_queue (writer, SH_coefs_block(), Thread::multi (fmls), FOD_lobes_block(), block_receiver);
 
 }
 
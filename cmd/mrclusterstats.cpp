@@ -33,6 +33,8 @@
 #include "stats/tfce.h"
 #include "stats/cluster.h"
 #include "stats/permtest.h"
+#include "stats/shard.h"
+#include "stats/subject_data.h"
 
 
 using namespace MR;
@@ -94,7 +96,40 @@ void usage ()
   + Option ("nonstationary", "perform non-stationarity correction (currently only implemented with tfce)")
 
   + Option ("nperms_nonstationary", "the number of permutations used when precomputing the empirical statistic image for nonstationary correction (Default: 5000)")
-  +   Argument ("num").type_integer (1, 5000, 100000);
+  +   Argument ("num").type_integer (1, 5000, 100000)
+
+  + Option ("shard", "only run permutations first to last-1 of the full set of permutations, and write the partial results "
+                     "to the file provided instead of generating the output images. If this file already exists, processing "
+                     "resumes from the last checkpoint stored within it. The complete set of shards can then be combined "
+                     "using the -merge option. The seed of the permutation sequence must be provided using the -seed "
+                     "option, and must be the same for all shards.")
+  +   Argument ("first").type_integer (0, 0, std::numeric_limits<int>::max())
+  +   Argument ("last").type_integer (1, 1, std::numeric_limits<int>::max())
+  +   Argument ("file").type_text()
+
+  + Option ("merge", "generate the output images by combining the results of permutation shards produced using the -shard "
+                     "option, rather than running the permutations. The shards must have been generated from the same inputs "
+                     "and options, and must together cover all permutations (as set by the -nperms option); this option "
+                     "should be specified once for each shard.").allow_multiple()
+  +   Argument ("file").type_file_in()
+
+  + Option ("seed", "the seed of the permutation sequence when running a permutation shard (required with the -shard option); "
+                    "shards generated using different seeds cannot be merged.")
+  +   Argument ("value").type_integer (0, 0, std::numeric_limits<int>::max())
+
+  + Option ("sequential", "stop permutation testing early, once the FWE-corrected p-value of every voxel is determined to lie "
+                          "above or below the significance level alpha with the confidence given. The number of permutations "
+                          "provided by the -nperms option is then the maximum number run. Note that the uncorrected p-values "
+                          "are not considered when stopping, and are estimated from the permutations actually run; their "
+                          "precision is therefore limited if testing stops early.")
+  +   Argument ("alpha").type_float (1.0e-6, 0.05, 1.0)
+  +   Argument ("confidence").type_float (0.5, 0.99, 1.0)
+
+  + Option ("datafile", "store the masked subject data in the file provided, which is memory-mapped rather than held in RAM. "
+                        "If this file already exists and was generated from the same subject images and mask, its contents "
+                        "are reused rather than loading the subject images again; the design and contrast matrices may differ. "
+                        "Any change to the size or modification time of a subject image causes the contents to be regenerated.")
+  +   Argument ("file").type_text();
 
 }
 
@@ -102,6 +137,72 @@ void usage ()
 typedef Stats::TFCE::value_type value_type;
 
 
+
+// Extract the values of the mask voxels from the image of a single subject
+class SubjectLoader {
+  public:
+    SubjectLoader (const std::vector<std::string>& subjects, const Image::Header& mask_header, const Image::Filter::Connector& connector) :
+      subjects (subjects), mask_header (mask_header), connector (connector) { }
+
+    void operator() (size_t subject, std::vector<value_type>& values) const {
+      Image::BufferPreload<value_type> input_buffer (subjects[subject], Image::Stride::contiguous_along_axis (3));
+      Image::check_dimensions (input_buffer, mask_header, 0, 3);
+      auto input_vox = input_buffer.voxel();
+      for (size_t index = 0; index < connector.size(); ++index) {
+        input_vox[0] = connector.position (index, 0);
+        input_vox[1] = connector.position (index, 1);
+        input_vox[2] = connector.position (index, 2);
+        values[index] = input_vox.value();
+      }
+    }
+
+  private:
+    const std::vector<std::string>& subjects;
+    const Image::Header& mask_header;
+    const Image::Filter::Connector& connector;
+};
+
+
+
+// Identify the inputs to the analysis, such that permutation shards from different analyses cannot be combined
+uint64_t analysis_hash (const Math::Matrix<value_type>& design, const Math::Matrix<value_type>& contrast,
+                        const std::vector<value_type>& enhancer_parameters,
+                        const std::vector<value_type>& default_output, const std::shared_ptr<std::vector<value_type> >& default_output_neg)
+{
+  Stats::PermTest::AnalysisHash hash;
+  hash.add (design);
+  hash.add (contrast);
+  hash.add (enhancer_parameters);
+  hash.add (default_output);
+  if (default_output_neg)
+    hash.add (*default_output_neg);
+  return hash.value();
+}
+
+
+
+template <class StatsType, class EnhancementType>
+void process_shard (const StatsType& glm, const EnhancementType& enhancer,
+                    const size_t first, const size_t last, const std::string& path, const uint64_t seed, const uint64_t analysis, const bool negative,
+                    const std::vector<value_type>& default_output, const std::shared_ptr<std::vector<value_type> >& default_output_neg)
+{
+  std::unique_ptr<Stats::PermTest::Shard> shard;
+  if (Path::exists (path)) {
+    shard.reset (new Stats::PermTest::Shard (path));
+    if (!shard->matches (glm.num_elements(), first, last, seed, analysis, negative))
+      throw Exception ("existing permutation shard file \"" + path + "\" does not match the requested analysis");
+  } else {
+    shard.reset (new Stats::PermTest::Shard (glm.num_elements(), first, last, seed, analysis, negative));
+  }
+  if (shard->is_complete()) {
+    INFO ("permutation shard \"" + path + "\" is already complete");
+    return;
+  }
+  std::shared_ptr<std::vector<double> > empirical_statistic;
+  Stats::PermTest::run_shard (glm, enhancer, *shard, path, empirical_statistic, default_output, default_output_neg, GLM_PERMUTATION_BATCH_SIZE);
+}
+
+
 void run() {
 
   Options opt = get_options ("threshold");
@@ -139,6 +240,48 @@ void run() {
 
   bool do_nonstationary_adjustment = get_options ("nonstationary").size();
 
+  opt = get_options ("shard");
+  const bool run_shard = opt.size();
+  size_t shard_first = 0, shard_last = 0;
+  std::string shard_path;
+  if (run_shard) {
+    shard_first = int(opt[0][0]);
+    shard_last = int(opt[0][1]);
+    shard_path = std::string (opt[0][2]);
+    if (shard_last <= shard_first)
+      throw Exception ("last permutation of shard must be greater than the first");
+    if (shard_last > size_t (num_perms))
+      throw Exception ("last permutation of shard exceeds the number of permutations (" + str(num_perms) + ")");
+  }
+
+  opt = get_options ("merge");
+  std::vector<std::string> merge_paths;
+  for (size_t i = 0; i != opt.size(); ++i)
+    merge_paths.push_back (opt[i][0]);
+
+  if (run_shard && merge_paths.size())
+    throw Exception ("options -shard and -merge are mutually exclusive");
+
+  opt = get_options ("seed");
+  const uint64_t permutation_seed = opt.size() ? uint64_t (int (opt[0][0])) : 0;
+  if (run_shard && !opt.size())
+    throw Exception ("the -seed option must be provided when running a permutation shard");
+  if (!run_shard && opt.size())
+    throw Exception ("the -seed option can only be used with the -shard option");
+
+  if ((run_shard || merge_paths.size()) && do_nonstationary_adjustment)
+    throw Exception ("nonstationary adjustment cannot be used with permutation shards, since the empirical statistic would differ between shards");
+
+  opt = get_options ("sequential");
+  const bool run_sequential = opt.size();
+  value_type sequential_alpha = 0.05, sequential_confidence = 0.99;
+  if (run_sequential) {
+    sequential_alpha = opt[0][0];
+    sequential_confidence = opt[0][1];
+    if (run_shard || merge_paths.size())
+      throw Exception ("sequential permutation testing cannot be used with permutation shards");
+  }
+
   // Read filenames
   std::vector<std::string> subjects;
   {
@@ -170,57 +313,23 @@ void run() {
   auto mask_vox = mask_data.voxel();
 
   Image::Filter::Connector connector (do_26_connectivity);
-  std::vector<std::vector<int> > mask_indices = connector.precompute_adjacency (mask_vox);
-
-  const size_t num_vox = mask_indices.size();
-  Math::Matrix<value_type> data (num_vox, subjects.size());
-
-
-  {
-    // Load images
-    ProgressBar progress("loading images...", subjects.size());
-    for (size_t subject = 0; subject < subjects.size(); subject++) {
-      LogLevelLatch log_level (0);
-      Image::BufferPreload<value_type> input_buffer (subjects[subject], Image::Stride::contiguous_along_axis (3));
-      Image::check_dimensions (input_buffer, mask_vox, 0, 3);
-      auto input_vox = input_buffer.voxel();
-      int index = 0;
-      std::vector<std::vector<int> >::iterator it;
-      for (it = mask_indices.begin(); it != mask_indices.end(); ++it) {
-        input_vox[0] = (*it)[0];
-        input_vox[1] = (*it)[1];
-        input_vox[2] = (*it)[2];
-        data (index++, subject) = input_vox.value();
-      }
-      progress++;
+  connector.precompute_adjacency (mask_vox);
+
+  const size_t num_vox = connector.size();
+  std::unique_ptr<Stats::SubjectData<value_type> > data;
+  opt = get_options ("datafile");
+  if (opt.size()) {
+    // Identify the set of mask voxels, such that a data file generated using a different mask is not reused
+    uint64_t layout_hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < num_vox; ++i) {
+      for (size_t dim = 0; dim < 3; ++dim)
+        layout_hash = (layout_hash ^ uint64_t (connector.position (i, dim))) * 1099511628211ULL;
     }
+    data.reset (new Stats::SubjectData<value_type> (num_vox, subjects, opt[0][0], layout_hash));
+  } else {
+    data.reset (new Stats::SubjectData<value_type> (num_vox, subjects));
   }
-
-  header.datatype() = DataType::Float32;
-  Image::Header output_header (header);
-  output_header.comments().push_back("num permutations = " + str(num_perms));
-  output_header.comments().push_back("tfce_dh = " + str(tfce_dh));
-  output_header.comments().push_back("tfce_e = " + str(tfce_E));
-  output_header.comments().push_back("tfce_h = " + str(tfce_H));
-  output_header.comments().push_back("26 connectivity = " + str(do_26_connectivity));
-  output_header.comments().push_back("nonstationary adjustment = " + str(do_nonstationary_adjustment));
-
-  std::string prefix (argument[4]);
-
-  std::string cluster_name (prefix);
-  if (std::isfinite (cluster_forming_threshold))
-     cluster_name.append ("clusters.mif");
-  else
-    cluster_name.append ("tfce.mif");
-
-  Image::Buffer<value_type> cluster_data (cluster_name, output_header);
-  Image::Buffer<value_type> tvalue_data (prefix + "tvalue.mif", output_header);
-  Image::Buffer<value_type> fwe_pvalue_data (prefix + "fwe_pvalue.mif", output_header);
-  Image::Buffer<value_type> uncorrected_pvalue_data (prefix + "uncorrected_pvalue.mif", output_header);
-  std::shared_ptr<Image::Buffer<value_type> > cluster_data_neg;
-  std::shared_ptr<Image::Buffer<value_type> > fwe_pvalue_data_neg;
-  std::shared_ptr<Image::Buffer<value_type> > uncorrected_pvalue_data_neg;
-
+  data->load (SubjectLoader (subjects, header, connector));
 
   Math::Vector<value_type> perm_distribution (num_perms);
   std::shared_ptr<Math::Vector<value_type> > perm_distribution_neg;
@@ -231,24 +340,15 @@ void run() {
   std::vector<value_type> uncorrected_pvalue (num_vox, 0.0);
   std::shared_ptr<std::vector<value_type> > uncorrected_pvalue_neg;
 
-
   bool compute_negative_contrast = get_options("negative").size() ? true : false;
   if (compute_negative_contrast) {
-    std::string cluster_neg_name (prefix);
-    if (std::isfinite (cluster_forming_threshold))
-       cluster_neg_name.append ("clusters_neg.mif");
-    else
-      cluster_neg_name.append ("tfce_neg.mif");
-    cluster_data_neg.reset (new Image::Buffer<value_type> (cluster_neg_name, output_header));
     perm_distribution_neg.reset (new Math::Vector<value_type> (num_perms));
     default_cluster_output_neg.reset (new std::vector<value_type> (num_vox, 0.0));
-    fwe_pvalue_data_neg.reset (new Image::Buffer<value_type> (prefix + "fwe_pvalue_neg.mif", output_header));
     uncorrected_pvalue_neg.reset (new std::vector<value_type> (num_vox, 0.0));
-    uncorrected_pvalue_data_neg.reset (new Image::Buffer<value_type> (prefix + "uncorrected_pvalue_neg.mif", output_header));
   }
 
   { // Do permutation testing:
-    Math::Stats::GLMTTest glm (data, design, contrast);
+    Math::Stats::GLMTTest glm (data->matrix(), design, contrast);
 
     // Suprathreshold clustering
     if (std::isfinite (cluster_forming_threshold)) {
@@ -258,13 +358,31 @@ void run() {
 
       Stats::PermTest::precompute_default_permutation (glm, cluster_size_test, empirical_tfce_statistic,
                                                        default_cluster_output, default_cluster_output_neg, tvalue_output);
+      const uint64_t analysis = analysis_hash (design, contrast, std::vector<value_type> (1, cluster_forming_threshold),
+                                               default_cluster_output, default_cluster_output_neg);
 
+      if (run_shard) {
+        process_shard (glm, cluster_size_test, shard_first, shard_last, shard_path, permutation_seed, analysis, compute_negative_contrast,
+                       default_cluster_output, default_cluster_output_neg);
+        return;
+      }
 
-
-      Stats::PermTest::run_permutations (glm, cluster_size_test, num_perms, empirical_tfce_statistic,
-                                         default_cluster_output, default_cluster_output_neg,
-                                         perm_distribution, perm_distribution_neg,
-                                         uncorrected_pvalue, uncorrected_pvalue_neg);
+      if (merge_paths.size())
+        Stats::PermTest::merge_shards (merge_paths, num_vox, num_perms, analysis, compute_negative_contrast,
+                                       perm_distribution, perm_distribution_neg,
+                                       uncorrected_pvalue, uncorrected_pvalue_neg);
+      else if (run_sequential)
+        Stats::PermTest::run_permutations_sequential (glm, cluster_size_test, num_perms, sequential_alpha, sequential_confidence,
+                                                      empirical_tfce_statistic, default_cluster_output, default_cluster_output_neg,
+                                                      perm_distribution, perm_distribution_neg,
+                                                      uncorrected_pvalue, uncorrected_pvalue_neg,
+                                                      GLM_PERMUTATION_BATCH_SIZE);
+      else
+        Stats::PermTest::run_permutations (glm, cluster_size_test, num_perms, empirical_tfce_statistic,
+                                           default_cluster_output, default_cluster_output_neg,
+                                           perm_distribution, perm_distribution_neg,
+                                           uncorrected_pvalue, uncorrected_pvalue_neg,
+                                           GLM_PERMUTATION_BATCH_SIZE);
     // TFCE
     } else {
       Stats::TFCE::Enhancer tfce_integrator (connector, tfce_dh, tfce_E, tfce_H);
@@ -275,15 +393,72 @@ void run() {
 
       Stats::PermTest::precompute_default_permutation (glm, tfce_integrator, empirical_tfce_statistic,
                                                        default_cluster_output, default_cluster_output_neg, tvalue_output);
+      const value_type tfce_parameters[] = { tfce_dh, tfce_E, tfce_H };
+      const uint64_t analysis = analysis_hash (design, contrast, std::vector<value_type> (tfce_parameters, tfce_parameters + 3),
+                                               default_cluster_output, default_cluster_output_neg);
+
+      if (run_shard) {
+        process_shard (glm, tfce_integrator, shard_first, shard_last, shard_path, permutation_seed, analysis, compute_negative_contrast,
+                       default_cluster_output, default_cluster_output_neg);
+        return;
+      }
 
-
-      Stats::PermTest::run_permutations (glm, tfce_integrator, num_perms, empirical_tfce_statistic,
-                                         default_cluster_output, default_cluster_output_neg,
-                                         perm_distribution, perm_distribution_neg,
-                                         uncorrected_pvalue, uncorrected_pvalue_neg);
+      if (merge_paths.size())
+        Stats::PermTest::merge_shards (merge_paths, num_vox, num_perms, analysis, compute_negative_contrast,
+                                       perm_distribution, perm_distribution_neg,
+                                       uncorrected_pvalue, uncorrected_pvalue_neg);
+      else if (run_sequential)
+        Stats::PermTest::run_permutations_sequential (glm, tfce_integrator, num_perms, sequential_alpha, sequential_confidence,
+                                                      empirical_tfce_statistic, default_cluster_output, default_cluster_output_neg,
+                                                      perm_distribution, perm_distribution_neg,
+                                                      uncorrected_pvalue, uncorrected_pvalue_neg,
+                                                      GLM_PERMUTATION_BATCH_SIZE);
+      else
+        Stats::PermTest::run_permutations (glm, tfce_integrator, num_perms, empirical_tfce_statistic,
+                                           default_cluster_output, default_cluster_output_neg,
+                                           perm_distribution, perm_distribution_neg,
+                                           uncorrected_pvalue, uncorrected_pvalue_neg,
+                                           GLM_PERMUTATION_BATCH_SIZE);
     }
   }
 
+  header.datatype() = DataType::Float32;
+  Image::Header output_header (header);
+  output_header.comments().push_back("num permutations = " + str(perm_distribution.size()));
+  output_header.comments().push_back("tfce_dh = " + str(tfce_dh));
+  output_header.comments().push_back("tfce_e = " + str(tfce_E));
+  output_header.comments().push_back("tfce_h = " + str(tfce_H));
+  output_header.comments().push_back("26 connectivity = " + str(do_26_connectivity));
+  output_header.comments().push_back("nonstationary adjustment = " + str(do_nonstationary_adjustment));
+
+  std::string prefix (argument[4]);
+
+  std::string cluster_name (prefix);
+  if (std::isfinite (cluster_forming_threshold))
+     cluster_name.append ("clusters.mif");
+  else
+    cluster_name.append ("tfce.mif");
+
+  Image::Buffer<value_type> cluster_data (cluster_name, output_header);
+  Image::Buffer<value_type> tvalue_data (prefix + "tvalue.mif", output_header);
+  Image::Buffer<value_type> fwe_pvalue_data (prefix + "fwe_pvalue.mif", output_header);
+  Image::Buffer<value_type> uncorrected_pvalue_data (prefix + "uncorrected_pvalue.mif", output_header);
+  std::shared_ptr<Image::Buffer<value_type> > cluster_data_neg;
+  std::shared_ptr<Image::Buffer<value_type> > fwe_pvalue_data_neg;
+  std::shared_ptr<Image::Buffer<value_type> > uncorrected_pvalue_data_neg;
+
+
+  if (compute_negative_contrast) {
+    std::string cluster_neg_name (prefix);
+    if (std::isfinite (cluster_forming_threshold))
+       cluster_neg_name.append ("clusters_neg.mif");
+    else
+      cluster_neg_name.append ("tfce_neg.mif");
+    cluster_data_neg.reset (new Image::Buffer<value_type> (cluster_neg_name, output_header));
+    fwe_pvalue_data_neg.reset (new Image::Buffer<value_type> (prefix + "fwe_pvalue_neg.mif", output_header));
+    uncorrected_pvalue_data_neg.reset (new Image::Buffer<value_type> (prefix + "uncorrected_pvalue_neg.mif", output_header));
+  }
+
   perm_distribution.save (prefix + "perm_dist.txt");
 
   std::vector<value_type> pvalue_output (num_vox, 0.0);
@@ -296,7 +471,7 @@ void run() {
     ProgressBar progress ("generating output...");
     for (size_t i = 0; i < num_vox; i++) {
       for (size_t dim = 0; dim < cluster_voxel.ndim(); dim++)
-        tvalue_voxel[dim] = cluster_voxel[dim] = fwe_pvalue_voxel[dim] = uncorrected_pvalue_voxel[dim] = mask_indices[i][dim];
+        tvalue_voxel[dim] = cluster_voxel[dim] = fwe_pvalue_voxel[dim] = uncorrected_pvalue_voxel[dim] = connector.position (i, dim);
       tvalue_voxel.value() = tvalue_output[i];
       cluster_voxel.value() = default_cluster_output[i];
       fwe_pvalue_voxel.value() = pvalue_output[i];
@@ -315,7 +490,7 @@ void run() {
       ProgressBar progress ("generating negative contrast output...");
       for (size_t i = 0; i < num_vox; i++) {
         for (size_t dim = 0; dim < cluster_voxel.ndim(); dim++)
-          cluster_voxel_neg[dim] = fwe_pvalue_voxel_neg[dim] = uncorrected_pvalue_voxel_neg[dim] = mask_indices[i][dim];
+          cluster_voxel_neg[dim] = fwe_pvalue_voxel_neg[dim] = uncorrected_pvalue_voxel_neg[dim] = connector.position (i, dim);
         cluster_voxel_neg.value() = (*default_cluster_output_neg)[i];
         fwe_pvalue_voxel_neg.value() = pvalue_output_neg[i];
         uncorrected_pvalue_voxel_neg.value() = (*uncorrected_pvalue_neg)[i];
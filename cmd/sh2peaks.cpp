@@ -28,17 +28,25 @@
 #include "image/loop.h"
 #include "image/buffer.h"
 #include "image/voxel.h"
+#include "dwi/directions/set.h"
 
 
 #define DOT_THRESHOLD 0.99
 
+// Number of directions in the grid over which the SH amplitudes are evaluated to locate candidate peaks
+#define PEAK_SEARCH_GRID_SIZE 321
+
 using namespace MR;
 using namespace App;
 
 void usage ()
 {
   DESCRIPTION
-    + "extract the peaks of a spherical harmonic function at each voxel, by commencing a Newton search along a set of specified directions";
+    + "extract the peaks of a spherical harmonic function at each voxel, by commencing a Newton search along a set of specified directions"
+
+    + "By default, the amplitudes of the SH function are first evaluated over a dense grid of directions, "
+      "and a Newton search is commenced only from each local maximum on this grid. If the -seeds option is "
+      "provided, a Newton search is instead commenced from every one of the directions specified.";
 
   ARGUMENTS
   + Argument ("SH", "the input image of SH coefficients.")
@@ -71,7 +79,8 @@ void usage ()
 
   + Option ("seeds",
             "specify a set of directions from which to start the multiple restarts of "
-            "the optimisation (by default, the built-in 60 direction set is used)")
+            "the optimisation, rather than starting from the local maxima of the amplitudes "
+            "over a dense grid of directions")
   + Argument ("file").type_file_in()
 
   + Option ("mask",
@@ -170,6 +179,8 @@ class Processor
   public:
     Processor (Image::Buffer<value_type>& dirs_data,
                Math::Matrix<value_type>& directions,
+               const DWI::Directions::Set* grid,
+               const Math::Matrix<value_type>& grid_transform,
                int lmax,
                int npeaks,
                std::vector<Direction> true_peaks,
@@ -177,6 +188,8 @@ class Processor
                Image::Buffer<value_type>* ipeaks_data) :
       dirs_vox (dirs_data),
       dirs (directions),
+      grid (grid),
+      grid_transform (grid_transform),
       lmax (lmax),
       npeaks (npeaks),
       true_peaks (true_peaks),
@@ -198,8 +211,16 @@ class Processor
 
       std::vector<Direction> all_peaks;
 
-      for (size_t i = 0; i < dirs.rows(); i++) {
-        Direction p (dirs (i,0), dirs (i,1));
+      if (grid)
+        get_candidates (item);
+
+      const size_t num_starts = grid ? candidates.size() : dirs.rows();
+      for (size_t i = 0; i < num_starts; i++) {
+        Direction p;
+        if (grid)
+          p = candidates[i];
+        else
+          p = Direction (dirs (i,0), dirs (i,1));
         p.a = Math::SH::get_peak (item.data.ptr(), lmax, p.v);
         if (std::isfinite (p.a)) {
           for (size_t j = 0; j < all_peaks.size(); j++) {
@@ -269,12 +290,40 @@ class Processor
   private:
     Image::Buffer<value_type>::voxel_type dirs_vox;
     Math::Matrix<value_type> dirs;
+    const DWI::Directions::Set* grid;
+    const Math::Matrix<value_type>& grid_transform;
+    Math::Vector<value_type> amplitudes;
+    std::vector<Direction> candidates;
     int lmax, npeaks;
     std::vector<Direction> true_peaks;
     value_type threshold;
     std::vector<Direction> peaks_out;
     copy_ptr<Image::Buffer<value_type>::voxel_type> ipeaks_vox;
 
+    // Evaluate the amplitudes over the grid using a single matrix-vector product, and
+    //   retain the local maxima as starting points for the Newton search, largest first
+    void get_candidates (const Item& item) {
+      Math::mult (amplitudes, grid_transform, item.data);
+      candidates.clear();
+      for (size_t i = 0; i != grid->size(); ++i) {
+        const std::vector<DWI::Directions::dir_t>& neighbours (grid->get_adj_dirs (i));
+        bool is_maximum = true;
+        for (std::vector<DWI::Directions::dir_t>::const_iterator n = neighbours.begin(); n != neighbours.end(); ++n) {
+          if (amplitudes[*n] > amplitudes[i]) {
+            is_maximum = false;
+            break;
+          }
+        }
+        if (is_maximum) {
+          Direction p;
+          p.a = amplitudes[i];
+          p.v = grid->get_dir (i);
+          candidates.push_back (p);
+        }
+      }
+      std::sort (candidates.begin(), candidates.end());
+    }
+
     bool check_input (const Item& item) {
       if (ipeaks_vox) {
         (*ipeaks_vox)[0] = item.pos[0];
@@ -300,10 +349,6 @@ class Processor
 
 
 
-extern value_type default_directions [];
-
-
-
 void run ()
 {
   Image::Buffer<value_type> SH_data (argument[0]);
@@ -315,16 +360,26 @@ void run ()
   if (opt.size())
     mask_data.reset (new Image::Buffer<bool> (opt[0][0]));
 
+  const int lmax = Math::SH::LforN (SH_data.dim (3));
+
   opt = get_options ("seeds");
-  Math::Matrix<value_type> dirs;
-  if (opt.size())
+  Math::Matrix<value_type> dirs, grid_transform;
+  std::unique_ptr<DWI::Directions::Set> grid;
+  if (opt.size()) {
     dirs.load (opt[0][0]);
+    if (dirs.columns() != 2)
+      throw Exception ("expecting 2 columns for search directions matrix");
+  }
   else {
-    dirs.allocate (60,2);
-    dirs = Math::Matrix<value_type> (default_directions, 60, 2);
+    grid.reset (new DWI::Directions::Set (PEAK_SEARCH_GRID_SIZE));
+    Math::Matrix<value_type> az_el (grid->size(), 2);
+    for (size_t i = 0; i != grid->size(); ++i) {
+      const Point<float>& d (grid->get_dir (i));
+      az_el (i,0) = std::atan2 (d[1], d[0]);
+      az_el (i,1) = std::acos (d[2]);
+    }
+    Math::SH::init_transform (grid_transform, az_el, lmax);
   }
-  if (dirs.columns() != 2)
-    throw Exception ("expecting 2 columns for search directions matrix");
 
   opt = get_options ("num");
   int npeaks = opt.size() ? opt[0][0] : 3;
@@ -361,73 +416,9 @@ void run ()
   Image::Buffer<value_type> peaks_data (argument[1], header);
 
   DataLoader loader (SH_data, mask_data.get());
-  Processor processor (peaks_data, dirs, Math::SH::LforN (SH_data.dim (3)),
+  Processor processor (peaks_data, dirs, grid.get(), grid_transform, lmax,
       npeaks, true_peaks, threshold, ipeaks_data.get());
 
   Thread::run_queue (loader, Item(), Thread::multi (processor));
 }
 
-
-value_type default_directions [] = {
-  0, 0,
-  -3.14159, 1.3254,
-  -2.58185, 1.50789,
-  2.23616, 1.46585,
-  0.035637, 0.411961,
-  2.65836, 0.913741,
-  0.780743, 1.23955,
-  -0.240253, 1.58088,
-  -0.955334, 1.08447,
-  1.12534, 1.78765,
-  1.12689, 1.30126,
-  0.88512, 1.55615,
-  2.08019, 1.16222,
-  0.191423, 1.06076,
-  1.29453, 0.707568,
-  2.794, 1.24245,
-  2.02138, 0.337172,
-  1.59186, 1.30164,
-  -2.83601, 0.910221,
-  0.569095, 0.96362,
-  3.05336, 1.00206,
-  2.4406, 1.19129,
-  0.437969, 1.30795,
-  0.247623, 0.728643,
-  -0.193887, 1.0467,
-  -1.34638, 1.14233,
-  1.35977, 1.54693,
-  1.82433, 0.660035,
-  -0.766769, 1.3685,
-  -2.02757, 1.02063,
-  -0.78071, 0.667313,
-  -1.47543, 1.45516,
-  -1.10765, 1.38916,
-  -1.65789, 0.871848,
-  1.89902, 1.44647,
-  3.08122, 0.336433,
-  -2.35317, 1.25244,
-  2.54757, 0.586206,
-  -2.14697, 0.338323,
-  3.10764, 0.670594,
-  1.75238, 0.991972,
-  -1.21593, 0.82585,
-  -0.259942, 0.71572,
-  -1.51829, 0.549286,
-  2.22968, 0.851973,
-  0.979108, 0.954864,
-  1.36274, 1.04186,
-  -0.0104792, 1.33716,
-  -0.891568, 0.33526,
-  -2.0635, 0.68273,
-  -2.41353, 0.917031,
-  2.57199, 1.50166,
-  0.965936, 0.33624,
-  0.763244, 0.657346,
-  -2.61583, 0.606725,
-  -0.429332, 1.30226,
-  -2.91118, 1.56901,
-  -2.79822, 1.24559,
-  -1.70453, 1.20406,
-  -0.582782, 0.975235
-};
-
@@ -109,6 +109,7 @@ void run ()
   sifter.perform_FOD_segmentation (in_dwi);
   sifter.scale_FDs_by_GM();
 
+  sifter.set_out_of_core (get_options ("out_of_core").size());
   sifter.map_streamlines (argument[0]);
 
   if (out_debug)
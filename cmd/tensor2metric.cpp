@@ -21,14 +21,11 @@
 */
 
 #include "command.h"
-#include "progressbar.h"
+#include "memory.h"
 #include "image/buffer.h"
+#include "image/threaded_loop.h"
 #include "image/voxel.h"
-#include "math/matrix.h"
-#include "math/eigen.h"
 #include "dwi/tensor.h"
-#include "image/value.h"
-#include "image/position.h"
 
 
 using namespace MR;
@@ -62,7 +59,7 @@ void usage ()
             "specify the desired eigenvalue/eigenvector(s). Note that several eigenvalues "
             "can be specified as a number sequence. For example, '1,3' specifies the "
             "major (1) and minor (3) eigenvalues/eigenvectors (default = 1).")
-  + Argument ("image")
+  + Argument ("sequence").type_sequence_int()
 
   + Option ("vector",
             "compute the selected eigenvector(s) of the diffusion tensor.")
@@ -84,187 +81,134 @@ void usage ()
 
 
 typedef float value_type;
+typedef Image::Buffer<value_type> BufferType;
+typedef BufferType::voxel_type VoxelType;
 
-class ImagePair
-{
-  public:
-    typedef ::value_type value_type;
-
-    ImagePair (const Image::Header& header, const std::string& name, size_t nvols) :
-      data (name, param (header, nvols)), 
-      vox (data) { }
-
-    ImagePair (const std::string& name) : 
-      data (name), 
-      vox (data) { }
-
-    Image::Buffer<value_type> data;
-    Image::Buffer<value_type>::voxel_type vox;
 
-    static Image::Header param (const Image::Header& header, size_t nvols) {
-      Image::Header ret (header);
-      ret.datatype() = DataType::Float32;
-      if (nvols) ret.dim(3) = nvols;
-      else ret.set_ndim (3);
-      return ret;
-    }
-};
-
-class ImagePairPtr : public std::unique_ptr<ImagePair>
-{
-  public:
-    ImagePairPtr (ImagePair* pair) : std::unique_ptr<ImagePair> (pair) { }
-
-    typedef ImagePair::value_type value_type;
-
-    Image::Position<ImagePairPtr> operator[] (size_t axis) {
-      return Image::Position<ImagePairPtr> (*this, axis);
-    }
-    Image::Value<ImagePairPtr> value () {
-      return Image::Value<ImagePairPtr> (*this);
-    }
-
-    value_type get_value () {
-      if (! (*this)) return 0;
-      return (*this)->vox.value();
-    }
-    void set_value (value_type val) {
-      if (! (*this)) return;
-      (*this)->vox.value() = val;
-    }
 
-    ssize_t get_pos (size_t axis) {
-      if (! (*this)) return 0;
-      return (*this)->vox[axis];
-    }
-    void set_pos (size_t axis, ssize_t pos) {
-      if (! (*this)) return;
-      (*this)->vox[axis] = pos;
-    }
-    void move_pos (size_t axis, ssize_t inc) {
-      if (! (*this)) return;
-      (*this)->vox[axis] += inc;
-    }
-    size_t ndim() {
-      return (*this)->vox.ndim();
-    }
-};
-
-
-// FOR NEW THREADING API:
-/*
-template <class Iterator>
+// Compute all requested metrics for a row of voxels at a time, such that
+//   each tensor is read and decomposed only once
 class Processor
 {
   public:
-    Processor (Iterator& nextvoxel, Image::Header& dt_header) :
-      next (nextvoxel), dt (dt_header), modulate (1) { }
-
-    typedef ImagePair::value_type value_type;
-
-    void set_modulation (int mod) {
-      modulate = mod;
-    }
+    Processor (const VoxelType& dt,
+               const std::unique_ptr<BufferType>& mask,
+               const std::unique_ptr<BufferType>& adc,
+               const std::unique_ptr<BufferType>& fa,
+               const std::unique_ptr<BufferType>& eval,
+               const std::unique_ptr<BufferType>& evec,
+               const std::vector<int>& vals,
+               const int modulate,
+               const size_t inner_axis) :
+      dt (dt),
+      mask (mask ? new VoxelType (*mask) : nullptr),
+      adc (adc ? new VoxelType (*adc) : nullptr),
+      fa (fa ? new VoxelType (*fa) : nullptr),
+      eval (eval ? new VoxelType (*eval) : nullptr),
+      evec (evec ? new VoxelType (*evec) : nullptr),
+      vals (vals),
+      modulate (modulate),
+      inner_axis (inner_axis) { }
+
+    void operator() (const Image::Iterator& pos)
+    {
+      assign (pos);
+      for (ssize_t i = 0; i < dt.dim (inner_axis); ++i) {
+        set_inner (i);
+        if (mask && mask->value() < 0.5) {
+          set_zero();
+          continue;
+        }
 
-    void set_values (const std::vector<int> values) {
-      vals = values;
-      for (size_t i = 0; i < vals.size(); i++)
-        vals[i] = 3-vals[i];
-    }
+        value_type el[6], ev[3], V[9];
+        for (dt[3] = 0; dt[3] < 6; ++dt[3])
+          el[dt[3]] = dt.value();
+
+        if (adc) adc->value() = DWI::tensor2ADC (el);
+        value_type faval = NAN;
+        if (fa || modulate == 1) faval = DWI::tensor2FA (el);
+        if (fa) fa->value() = faval;
+
+        if (eval || evec) {
+          DWI::tensor2eig (el, ev, evec ? V : nullptr);
+
+          if (evec) {
+            if (modulate == 0) faval = 1.0;
+            (*evec)[3] = 0;
+            for (size_t n = 0; n < vals.size(); n++) {
+              if (modulate == 2) faval = ev[vals[n]];
+              for (size_t k = 0; k < 3; ++k) {
+                evec->value() = faval * V[3*k+vals[n]];
+                ++(*evec)[3];
+              }
+            }
+          }
 
-    void compute_FA (const std::string& name) {
-      fa_header.reset (new Image::Header (dt.header()));
-      fa_header->set_ndim (3);
-      fa_header->set_datatype (DataType::Float32);
-      fa_header->create (name);
-      fa = new Image::Voxel<value_type> (*fa_header);
+          if (eval) {
+            for ((*eval)[3] = 0; (*eval)[3] < (int) vals.size(); ++(*eval)[3])
+              eval->value() = ev[vals[(*eval)[3]]];
+          }
+        }
+      }
     }
 
-    void compute_ADC (const std::string& name) {
-      adc_header.reset (new Image::Header (dt.header()));
-      adc_header->set_ndim (3);
-      adc_header->set_datatype (DataType::Float32);
-      adc_header->create (name);
-      adc = new Image::Voxel<value_type> (*adc_header);
+  private:
+    VoxelType dt;
+    copy_ptr<VoxelType> mask, adc, fa, eval, evec;
+    const std::vector<int> vals;
+    const int modulate;
+    const size_t inner_axis;
+
+    void assign (const Image::Iterator& pos)
+    {
+      Image::voxel_assign (dt, pos, 0, 3);
+      if (mask) Image::voxel_assign (*mask, pos, 0, 3);
+      if (adc) Image::voxel_assign (*adc, pos, 0, 3);
+      if (fa) Image::voxel_assign (*fa, pos, 0, 3);
+      if (eval) Image::voxel_assign (*eval, pos, 0, 3);
+      if (evec) Image::voxel_assign (*evec, pos, 0, 3);
     }
 
-    void compute_EVALS (const std::string& name) {
-      eval_header.reset (new Image::Header (dt.header()));
-      eval_header->set_ndim (4);
-      eval_header->set_dim (3, vals.size());
-      eval_header->set_datatype (DataType::Float32);
-      eval_header->create (name);
-      eval = new Image::Voxel<value_type> (*eval_header);
+    // output image data are not initialised, so voxels outside the mask must be written explicitly
+    void set_zero ()
+    {
+      if (adc) adc->value() = 0.0;
+      if (fa) fa->value() = 0.0;
+      if (eval)
+        for ((*eval)[3] = 0; (*eval)[3] < eval->dim(3); ++(*eval)[3])
+          eval->value() = 0.0;
+      if (evec)
+        for ((*evec)[3] = 0; (*evec)[3] < evec->dim(3); ++(*evec)[3])
+          evec->value() = 0.0;
     }
 
-    void compute_EVEC (const std::string& name) {
-      evec_header.reset (new Image::Header (dt.header()));
-      evec_header->set_ndim (4);
-      evec_header->set_dim (3, 3*vals.size());
-      evec_header->set_datatype (DataType::Float32);
-      evec_header->create (name);
-      evec = new Image::Voxel<value_type> (*evec_header);
+    void set_inner (const ssize_t i)
+    {
+      dt[inner_axis] = i;
+      if (mask) (*mask)[inner_axis] = i;
+      if (adc) (*adc)[inner_axis] = i;
+      if (fa) (*fa)[inner_axis] = i;
+      if (eval) (*eval)[inner_axis] = i;
+      if (evec) (*evec)[inner_axis] = i;
     }
+};
 
-    void init () {
-      if (! (adc || fa || eval || evec))
-        throw Exception ("no output metric specified - aborting");
 
-      if (evec)
-        eigv = new Math::Eigen::SymmV<double> (3);
-      else
-        eig = new Math::Eigen::Symm<double> (3);
-    }
 
-    void execute () {
-      while (next (dt)) {
-      }
-    }
-
-  private:
-    Iterator& next;
-    Image::Voxel<value_type> dt;
-    std::shared_ptr<Image::Header> fa_header, adc_header, evec_header, eval_header;
-    std::unique_ptr<Image::Voxel<value_type> > fa, adc, evec, eval;
-    std::unique_ptr<Math::Eigen::Symm<double> > eig;
-    std::unique_ptr<Math::Eigen::SymmV<double> > eigv;
-    std::vector<int> vals;
-    int modulate;
-};
-*/
-// TO HERE
-
-inline void set_zero (size_t axis, 
-    std::unique_ptr<ImagePair>& i0, 
-    std::unique_ptr<ImagePair>& i1, 
-    std::unique_ptr<ImagePair>& i2, 
-    std::unique_ptr<ImagePair>& i3, 
-    std::unique_ptr<ImagePair>& i4)
+Image::Header output_header (const Image::Header& header, size_t nvols)
 {
-  if (i0) i0->vox[axis] = 0;
-  if (i1) i1->vox[axis] = 0;
-  if (i2) i2->vox[axis] = 0;
-  if (i3) i3->vox[axis] = 0;
-  if (i4) i4->vox[axis] = 0;
+  Image::Header ret (header);
+  ret.datatype() = DataType::Float32;
+  if (nvols) ret.dim(3) = nvols;
+  else ret.set_ndim (3);
+  return ret;
 }
 
-inline void increment (size_t axis, 
-    std::unique_ptr<ImagePair>& i0, 
-    std::unique_ptr<ImagePair>& i1, 
-    std::unique_ptr<ImagePair>& i2, 
-    std::unique_ptr<ImagePair>& i3, 
-    std::unique_ptr<ImagePair>& i4)
-{
-  if (i0) ++i0->vox[axis];
-  if (i1) ++i1->vox[axis];
-  if (i2) ++i2->vox[axis];
-  if (i3) ++i3->vox[axis];
-  if (i4) ++i4->vox[axis];
-}
+
 
 void run ()
 {
-  Image::Buffer<value_type> dt_data (argument[0]);
+  BufferType dt_data (argument[0]);
 
   if (dt_data.ndim() != 4)
     throw Exception ("base image should contain 4 dimensions");
@@ -287,28 +231,28 @@ void run ()
         throw Exception ("eigenvalue/eigenvector number is out of bounds");
   }
 
-  std::unique_ptr<ImagePair> adc, fa, eval, evec, mask;
+  std::unique_ptr<BufferType> adc, fa, eval, evec, mask;
 
   opt = get_options ("vector");
   if (opt.size())
-    evec.reset (new ImagePair (dt_data, opt[0][0], 3*vals.size()));
+    evec.reset (new BufferType (opt[0][0], output_header (dt_data, 3*vals.size())));
 
   opt = get_options ("value");
   if (opt.size())
-    eval.reset (new ImagePair (dt_data, opt[0][0], vals.size()));
+    eval.reset (new BufferType (opt[0][0], output_header (dt_data, vals.size())));
 
   opt = get_options ("adc");
   if (opt.size())
-    adc.reset (new ImagePair (dt_data, opt[0][0], 0));
+    adc.reset (new BufferType (opt[0][0], output_header (dt_data, 0)));
 
   opt = get_options ("fa");
   if (opt.size()) 
-    fa.reset (new ImagePair (dt_data, opt[0][0], 0));
+    fa.reset (new BufferType (opt[0][0], output_header (dt_data, 0)));
 
   opt = get_options ("mask");
   if (opt.size()) {
-    mask.reset (new ImagePair (opt[0][0]));
-    Image::check_dimensions (mask->data, dt_data, 0, 3);
+    mask.reset (new BufferType (opt[0][0]));
+    Image::check_dimensions (*mask, dt_data, 0, 3);
   }
 
   int modulate = 1;
@@ -320,86 +264,12 @@ void run ()
     throw Exception ("no output metric specified - aborting");
 
 
+  // eigenvalues are sorted in ascending order:
   for (size_t i = 0; i < vals.size(); i++)
     vals[i] = 3-vals[i];
 
-
-  Math::Matrix<double> V (3,3), M (3,3);
-  Math::Vector<double> ev (3);
-  float el[6], faval = NAN;
-
-  std::unique_ptr<Math::Eigen::Symm<double> > eig;
-  std::unique_ptr<Math::Eigen::SymmV<double> > eigv;
-  if (evec)
-    eigv.reset (new Math::Eigen::SymmV<double> (3));
-  else
-    eig.reset (new Math::Eigen::Symm<double> (3));
-
   auto dt = dt_data.voxel();
-
-  ProgressBar progress ("computing tensor metrics...", Image::voxel_count (dt, 0, 3));
-
-  for (dt[2] = 0; dt[2] < dt.dim (2); dt[2]++) {
-    set_zero (1, mask, fa, adc, eval, evec);
-
-    for (dt[1] = 0; dt[1] < dt.dim (1); dt[1]++) {
-      set_zero (0, mask, fa, adc, eval, evec);
-
-      for (dt[0] = 0; dt[0] < dt.dim (0); dt[0]++) {
-
-        bool skip = false;
-        if (mask) if (mask->vox.value() < 0.5) skip = true;
-
-        if (!skip) {
-
-          for (dt[3] = 0; dt[3] < dt.dim (3); dt[3]++)
-            el[dt[3]] = dt.value();
-
-          if (adc) adc->vox.value() = DWI::tensor2ADC (el);
-          if (fa || modulate == 1) faval = DWI::tensor2FA (el);
-          if (fa) fa->vox.value() = faval;
-
-          if (eval || evec) {
-            M (0,0) = el[0];
-            M (1,1) = el[1];
-            M (2,2) = el[2];
-            M (0,1) = M (1,0) = el[3];
-            M (0,2) = M (2,0) = el[4];
-            M (1,2) = M (2,1) = el[5];
-
-            if (evec) {
-              (*eigv) (ev, M, V);
-              Math::Eigen::sort (ev, V);
-              if (modulate == 0) faval = 1.0;
-              evec->vox[3] = 0;
-              for (size_t i = 0; i < vals.size(); i++) {
-                if (modulate == 2) faval = ev[vals[i]];
-                evec->vox.value() = faval*V (0,vals[i]);
-                ++evec->vox[3];
-                evec->vox.value() = faval*V (1,vals[i]);
-                ++evec->vox[3];
-                evec->vox.value() = faval*V (2,vals[i]);
-                ++evec->vox[3];
-              }
-            }
-            else {
-              (*eig) (ev, M);
-              Math::Eigen::sort (ev);
-            }
-
-            if (eval) {
-              for (eval->vox[3] = 0; eval->vox[3] < (int) vals.size(); ++eval->vox[3])
-                eval->vox.value() = ev[vals[eval->vox[3]]];
-            }
-          }
-        }
-
-        ++progress;
-        increment (0, mask, fa, adc, eval, evec);
-      }
-      increment (1, mask, fa, adc, eval, evec);
-    }
-    increment (2, mask, fa, adc, eval, evec);
-  }
+  Image::ThreadedLoop loop ("computing tensor metrics...", dt, 0, 3);
+  Processor processor (dt, mask, adc, fa, eval, evec, vals, modulate, loop.inner_axes()[0]);
+  loop.run_outer (processor);
 }
-
@@ -24,6 +24,7 @@
 #define __image_filter_connected_h__
 
 #include "memory.h"
+#include "thread.h"
 #include "image/buffer_scratch.h"
 #include "image/info.h"
 #include "image/loop.h"
@@ -34,9 +35,13 @@
 
 #include "math/matrix.h"
 
-#include <stack>
+#include <atomic>
 #include <iostream>
 
+
+// Number of nodes processed at a time by each thread during connected components labelling
+#define CONNECTOR_NODE_BLOCK_SIZE 4096
+
 namespace MR
 {
   namespace Image
@@ -61,35 +66,32 @@ namespace MR
       }
 
 
+      /*! Connected components labelling over a precomputed voxel adjacency.
+       *
+       * The mask voxel positions and their adjacency are stored in compressed
+       * sparse row form: the neighbours of node \a i are held in a single array,
+       * between adjacency_offsets[i] and adjacency_offsets[i+1]. Components are
+       * labelled using union-find, with each component rooted at its lowest node
+       * index; labels are therefore assigned in order of the first node in each
+       * component. The union pass may be split across multiple threads within a
+       * single call; use a single thread (the default) when the connector is
+       * already being run in parallel, e.g. across permutations. */
       class Connector {
 
         public:
-          Connector (bool do_26_connectivity) :
+          Connector (bool do_26_connectivity, size_t num_threads = 1) :
             do_26_connectivity (do_26_connectivity),
-            dim_to_ignore (4, false) {
+            dim_to_ignore (4, false),
+            num_threads (num_threads),
+            mask_ndim (0) {
               dim_to_ignore[3] = true;
           }
 
 
           // Perform connected components on the mask.
-          const std::vector<std::vector<int> >& run (std::vector<cluster>& clusters,
-                                                     std::vector<uint32_t>& labels) const {
-            labels.resize (adjacent_indices.size(), 0);
-            uint32_t current_label = 1;
-            for (uint32_t i = 0; i < labels.size(); i++) {
-              // this node has not been already clustered
-              if (labels[i] == 0) {
-                cluster cluster;
-                cluster.label = current_label;
-                cluster.size = 0;
-                depth_first_search (i, cluster, labels);
-                clusters.push_back (cluster);
-                current_label++;
-              }
-            }
-            if (clusters.size() > std::numeric_limits<uint32_t>::max())
-              throw Exception ("The number of clusters is larger than can be labelled with an unsigned 32bit integer.");
-            return mask_indices;
+          void run (std::vector<cluster>& clusters,
+                    std::vector<uint32_t>& labels) const {
+            label (clusters, labels, nullptr, 0.0);
           }
 
 
@@ -98,21 +100,7 @@ namespace MR
                     std::vector<uint32_t>& labels,
                     const std::vector<float>& data,
                     const float threshold) const {
-            labels.resize (adjacent_indices.size(), 0);
-            uint32_t current_label = 1;
-            for (uint32_t i = 0; i < labels.size(); i++) {
-              // this node has not been already clustered and is above threshold
-              if (labels[i] == 0 && data[i] > threshold) {
-                cluster cluster;
-                cluster.label = current_label;
-                cluster.size = 0;
-                depth_first_search (i, cluster, labels, data, threshold);
-                clusters.push_back (cluster);
-                current_label++;
-              }
-            }
-            if (clusters.size() > std::numeric_limits<uint32_t>::max())
-              throw Exception ("The number of clusters is larger than can be labelled with an unsigned 32bit integer.");
+            label (clusters, labels, &data, threshold);
           }
 
 
@@ -122,27 +110,34 @@ namespace MR
             }
           }
 
+          void set_num_threads (size_t value) {
+            num_threads = value;
+          }
+
 
           template <class MaskVoxelType>
-          const std::vector<std::vector<int> >& precompute_adjacency (MaskVoxelType& mask) {
+          void precompute_adjacency (MaskVoxelType& mask) {
 
             Image::BufferScratch<uint32_t> index_data (mask);
             auto index_image = index_data.voxel();
 
-            // 1st pass, store mask image indices and their index in the array
+            // 1st pass, store mask image positions and their index in the array
+            mask_ndim = mask.ndim();
+            mask_positions.clear();
             Image::LoopInOrder loop (mask);
             for (auto l = loop (mask, index_image); l; ++l) {
               if (mask.value() >= 0.5) {
-                // For each voxel, store the index within mask_indices for 2nd pass
-                index_image.value() = mask_indices.size();
-                std::vector<int> index (mask.ndim());
-                for (size_t dim = 0; dim < mask.ndim(); dim++)
-                  index[dim] = mask[dim];
-                mask_indices.push_back (index);
+                // For each voxel, store the node index for 2nd pass
+                index_image.value() = size();
+                for (size_t dim = 0; dim < mask_ndim; dim++)
+                  mask_positions.push_back (mask[dim]);
               } else {
                 index_image.value() = 0;
               }
             }
+            if (size() > std::numeric_limits<uint32_t>::max())
+              throw Exception ("The number of voxels in the mask is larger than can be indexed with an unsigned 32bit integer.");
+
             // Here we pre-compute the offsets for our neighbours in 4D space
             std::vector< std::vector<int> > neighbour_offsets;
             std::vector<int> offset (4);
@@ -162,101 +157,150 @@ namespace MR
             }
             // 2nd pass, define adjacency
             MaskVoxelType mask_neigh (mask);
-            for (std::vector<std::vector<int> >::const_iterator it = mask_indices.begin(); it != mask_indices.end(); ++it) {
-              std::vector<uint32_t> neighbour_indices;
+            adjacency_offsets.assign (1, 0);
+            adjacency.clear();
+            for (size_t node = 0; node < size(); ++node) {
               for (std::vector< std::vector<int> >::const_iterator offset = neighbour_offsets.begin(); offset != neighbour_offsets.end(); ++offset) {
-                for (size_t dim = 0; dim < mask.ndim(); dim++)
-                  mask_neigh[dim] = (*it)[dim] + (*offset)[dim];
+                for (size_t dim = 0; dim < mask_ndim; dim++)
+                  mask_neigh[dim] = position (node, dim) + (*offset)[dim];
                 if (Image::Nav::within_bounds (mask_neigh)) {
                   if (mask_neigh.value() >= 0.5)
-                    neighbour_indices.push_back (Image::Nav::get_value_at_pos (index_image, mask_neigh));
+                    adjacency.push_back (Image::Nav::get_value_at_pos (index_image, mask_neigh));
                 }
               }
-              adjacent_indices.push_back (neighbour_indices);
+              adjacency_offsets.push_back (adjacency.size());
             }
-
-            return mask_indices;
           }
 
 
-          bool next_neighbour (uint32_t& node, std::vector<uint32_t>& labels) const {
-            for (size_t n = 0; n < adjacent_indices[node].size(); n++) {
-              if (labels[adjacent_indices[node][n]] == 0) {
-                node = adjacent_indices[node][n];
-                return true;
-              }
-            }
-            return false;
+          //! the number of voxels (nodes) in the mask
+          size_t size () const { return mask_ndim ? mask_positions.size() / mask_ndim : 0; }
+
+          //! the image position of node \a node along axis \a axis
+          int position (size_t node, size_t axis) const { return mask_positions[node * mask_ndim + axis]; }
+
+          //! set the position of \a vox to that of node \a node
+          template <class VoxelType>
+          void set_position (size_t node, VoxelType& vox) const {
+            for (size_t dim = 0; dim < mask_ndim; ++dim)
+              vox[dim] = position (node, dim);
           }
 
+          const uint32_t* neighbours_begin (size_t node) const { return adjacency.data() + adjacency_offsets[node]; }
+          const uint32_t* neighbours_end (size_t node) const { return adjacency.data() + adjacency_offsets[node+1]; }
+
+
+          bool do_26_connectivity;
+          std::vector<bool> dim_to_ignore;
 
-          bool next_neighbour (uint32_t& node,
-                               std::vector<uint32_t>& labels,
-                               const std::vector<float>& data,
-                               const float threshold) const {
-            for (size_t n = 0; n < adjacent_indices[node].size(); n++) {
-              if (labels[adjacent_indices[node][n]] == 0 && data[adjacent_indices[node][n]] > threshold) {
-                node = adjacent_indices[node][n];
-                return true;
+        protected:
+          size_t num_threads, mask_ndim;
+          std::vector<int> mask_positions;
+          std::vector<size_t> adjacency_offsets;
+          std::vector<uint32_t> adjacency;
+
+
+          // Union adjacent nodes, linking the root with the higher index to that with the lower
+          //   index; the parent of each node is updated atomically such that multiple
+          //   threads can process different nodes concurrently
+          class Linker {
+            public:
+              Linker (const Connector& connector, std::vector<std::atomic<uint32_t> >& parent,
+                      const std::vector<float>* data, const float threshold) :
+                connector (connector), parent (parent), data (data), threshold (threshold),
+                next_node (std::make_shared<std::atomic<size_t> > (0)) { }
+
+              void execute () {
+                const size_t num_nodes = connector.size();
+                size_t start;
+                while ((start = next_node->fetch_add (CONNECTOR_NODE_BLOCK_SIZE)) < num_nodes) {
+                  const size_t end = std::min (start + CONNECTOR_NODE_BLOCK_SIZE, num_nodes);
+                  for (size_t node = start; node != end; ++node) {
+                    if (data && !((*data)[node] > threshold))
+                      continue;
+                    // the adjacency is symmetric, so each edge need only be processed once
+                    for (const uint32_t* n = connector.neighbours_begin (node); n != connector.neighbours_end (node); ++n) {
+                      if (*n < node && (!data || (*data)[*n] > threshold))
+                        unite (node, *n);
+                    }
+                  }
+                }
               }
-            }
-            return false;
-          }
 
+              static uint32_t find (std::vector<std::atomic<uint32_t> >& parent, uint32_t node) {
+                uint32_t p = parent[node].load (std::memory_order_relaxed);
+                while (p != node) {
+                  // path halving
+                  uint32_t grandparent = parent[p].load (std::memory_order_relaxed);
+                  if (grandparent != p)
+                    parent[node].compare_exchange_weak (p, grandparent, std::memory_order_relaxed);
+                  node = grandparent;
+                  p = parent[node].load (std::memory_order_relaxed);
+                }
+                return node;
+              }
 
-          // use a non-recursive depth first search to agglomerate adjacent voxels
-          void depth_first_search (uint32_t root,
-                                   cluster& cluster,
-                                   std::vector<uint32_t>& labels) const {
-            uint32_t node = root;
-            std::stack<uint32_t> stack;
-            while (true) {
-              labels[node] = cluster.label;
-              stack.push (node);
-              cluster.size++;
-              if (next_neighbour (node, labels)) {
-                continue;
-              } else {
-                do {
-                  if (stack.top() == root)
+            private:
+              const Connector& connector;
+              std::vector<std::atomic<uint32_t> >& parent;
+              const std::vector<float>* data;
+              const float threshold;
+              std::shared_ptr<std::atomic<size_t> > next_node;
+
+              void unite (uint32_t a, uint32_t b) {
+                while (true) {
+                  a = find (parent, a);
+                  b = find (parent, b);
+                  if (a == b)
+                    return;
+                  if (a < b)
+                    std::swap (a, b);
+                  uint32_t expected = a;
+                  if (parent[a].compare_exchange_strong (expected, b, std::memory_order_acq_rel))
                     return;
-                  stack.pop();
-                  node = stack.top();
-                } while (!next_neighbour (node, labels));
+                }
               }
-            }
-          }
-
-          // use a non-recursive depth first search to agglomerate adjacent voxels
-          void depth_first_search (uint32_t root,
-                                   cluster& cluster,
-                                   std::vector<uint32_t>& labels,
-                                   const std::vector<float>& data,
-                                   const float threshold) const {
-            uint32_t node = root;
-            std::stack<uint32_t> stack;
-            while (true) {
-              labels[node] = cluster.label;
-              stack.push (node);
-              cluster.size++;
-              if (next_neighbour (node, labels, data, threshold)) {
+          };
+
+
+          void label (std::vector<cluster>& clusters,
+                      std::vector<uint32_t>& labels,
+                      const std::vector<float>* data,
+                      const float threshold) const {
+            const size_t num_nodes = size();
+            clusters.clear();
+            std::vector<std::atomic<uint32_t> > parent (num_nodes);
+            for (uint32_t i = 0; i < num_nodes; ++i)
+              parent[i].store (i, std::memory_order_relaxed);
+
+            Linker linker (*this, parent, data, threshold);
+            if (num_threads > 1)
+              Thread::run (Thread::multi (linker, num_threads), "connected components");
+            else
+              linker.execute();
+
+            // Each component is rooted at its lowest index, so its root is labelled before any other node within it
+            labels.resize (num_nodes);
+            for (uint32_t i = 0; i < num_nodes; ++i) {
+              if (data && !((*data)[i] > threshold)) {
+                labels[i] = 0;
                 continue;
+              }
+              const uint32_t root = Linker::find (parent, i);
+              if (root == i) {
+                if (clusters.size() == std::numeric_limits<uint32_t>::max())
+                  throw Exception ("The number of clusters is larger than can be labelled with an unsigned 32bit integer.");
+                cluster cluster;
+                cluster.label = clusters.size() + 1;
+                cluster.size = 0;
+                clusters.push_back (cluster);
+                labels[i] = cluster.label;
               } else {
-                do {
-                  if (stack.top() == root)
-                    return;
-                  stack.pop();
-                  node = stack.top();
-                } while (!next_neighbour (node, labels, data, threshold));
+                labels[i] = labels[root];
               }
+              clusters[labels[i] - 1].size++;
             }
           }
-
-
-          bool do_26_connectivity;
-          std::vector<bool> dim_to_ignore;
-          std::vector<std::vector<int> > mask_indices;
-          std::vector<std::vector<uint32_t> > adjacent_indices;
       };
 
 
@@ -308,7 +352,7 @@ namespace MR
         void operator() (InputVoxelType& in, OutputVoxelType& out) {
 
 
-          Connector connector (do_26_connectivity);
+          Connector connector (do_26_connectivity, Thread::number_of_threads());
 
           if (dim_to_ignore.size())
             connector.set_dim_to_ignore (dim_to_ignore);
@@ -323,7 +367,7 @@ namespace MR
 
           std::vector<cluster> clusters;
           std::vector<uint32_t> labels;
-          std::vector<std::vector<int> > mask_indices = connector.run (clusters, labels);
+          connector.run (clusters, labels);
 
           if (progress)
             ++(*progress);
@@ -339,8 +383,8 @@ namespace MR
           for (auto l = loop (out); l; ++l) 
             out.value() = 0;
 
-          for (uint32_t i = 0; i < mask_indices.size(); i++) {
-            Image::Nav::set_pos (out, mask_indices[i]);
+          for (uint32_t i = 0; i < connector.size(); i++) {
+            connector.set_position (i, out);
             if (largest_only) {
               if (label_lookup[labels[i] - 1] == 1)
                 out.value() = 1;
@@ -27,6 +27,8 @@
 # warning using non-orthonormal SH basis
 #endif
 
+#include <type_traits>
+
 #include "point.h"
 #include "math/legendre.h"
 #include "math/versor.h"
@@ -36,6 +38,20 @@
 #define MAX_DIR_CHANGE 0.2
 #define ANGLE_TOLERANCE 1e-4
 
+// Execute STATEMENT with LMAX defined as a compile-time constant for the commonly used
+// harmonic orders, such that the loops over l & m can be unrolled by the compiler; any
+// other value of lmax_value is passed through as a run-time value.
+#define SH_DISPATCH_LMAX(lmax_value, LMAX, STATEMENT) \
+  switch (lmax_value) { \
+    case 2:  { const std::integral_constant<int,2>  LMAX = {}; STATEMENT; break; } \
+    case 4:  { const std::integral_constant<int,4>  LMAX = {}; STATEMENT; break; } \
+    case 6:  { const std::integral_constant<int,6>  LMAX = {}; STATEMENT; break; } \
+    case 8:  { const std::integral_constant<int,8>  LMAX = {}; STATEMENT; break; } \
+    case 10: { const std::integral_constant<int,10> LMAX = {}; STATEMENT; break; } \
+    case 12: { const std::integral_constant<int,12> LMAX = {}; STATEMENT; break; } \
+    default: { const int LMAX = lmax_value; STATEMENT; break; } \
+  }
+
 namespace MR
 {
   namespace Math
@@ -56,25 +72,25 @@ namespace MR
       extern const char* encoding_description;
 
       //! the number of (even-degree) coefficients for the given value of \a lmax
-      inline size_t NforL (int lmax)
+      constexpr inline size_t NforL (int lmax)
       {
         return (lmax+1) * (lmax+2) /2;
       }
 
       //! compute the index for coefficient (l,m)
-      inline size_t index (int l, int m)
+      constexpr inline size_t index (int l, int m)
       {
         return l* (l+1) /2 + m;
       }
 
       //! same as NforL(), but consider only non-negative orders \e m
-      inline size_t NforL_mpos (int lmax)
+      constexpr inline size_t NforL_mpos (int lmax)
       {
         return (lmax/2+1) * (lmax/2+1);
       }
       
       //! same as index(), but consider only non-negative orders \e m
-      inline size_t index_mpos (int l, int m)
+      constexpr inline size_t index_mpos (int l, int m)
       {
         return l*l/4 + m;
       }
@@ -207,30 +223,41 @@ namespace MR
 
 
         
-      template <typename ValueType, typename CoefType>
-        inline ValueType value (const CoefType& coefs, ValueType cos_elevation, ValueType cos_azimuth, ValueType sin_azimuth, int lmax)
-        {
-          ValueType amplitude = 0.0;
-          VLA_MAX (AL, ValueType, lmax+1, 64);
-          Legendre::Plm_sph (AL, lmax, 0, ValueType (cos_elevation));
-          for (int l = 0; l <= lmax; l+=2) 
-            amplitude += AL[l] * coefs[index (l,0)];
-          ValueType c0 (1.0), s0 (0.0);
-          for (int m = 1; m <= lmax; m++) {
-            Legendre::Plm_sph (AL, lmax, m, ValueType (cos_elevation));
-            ValueType c = c0 * cos_azimuth - s0 * sin_azimuth;  // std::cos(m*azimuth)
-            ValueType s = s0 * cos_azimuth + c0 * sin_azimuth;  // std::sin(m*azimuth)
-            for (int l = ( (m&1) ? m+1 : m); l <= lmax; l+=2) {
+      //! \cond skip
+      namespace
+      {
+        template <typename ValueType, typename CoefType, class LmaxType>
+          inline ValueType value_impl (const CoefType& coefs, ValueType cos_elevation, ValueType cos_azimuth, ValueType sin_azimuth, const LmaxType lmax)
+          {
+            ValueType amplitude = 0.0;
+            VLA_MAX (AL, ValueType, lmax+1, 64);
+            Legendre::Plm_sph (AL, lmax, 0, ValueType (cos_elevation));
+            for (int l = 0; l <= lmax; l+=2) 
+              amplitude += AL[l] * coefs[index (l,0)];
+            ValueType c0 (1.0), s0 (0.0);
+            for (int m = 1; m <= lmax; m++) {
+              Legendre::Plm_sph (AL, lmax, m, ValueType (cos_elevation));
+              ValueType c = c0 * cos_azimuth - s0 * sin_azimuth;  // std::cos(m*azimuth)
+              ValueType s = s0 * cos_azimuth + c0 * sin_azimuth;  // std::sin(m*azimuth)
+              for (int l = ( (m&1) ? m+1 : m); l <= lmax; l+=2) {
 #ifndef USE_NON_ORTHONORMAL_SH_BASIS
-              amplitude += AL[l] * Math::sqrt2 * (c * coefs[index (l,m)] + s * coefs[index (l,-m)]);
+                amplitude += AL[l] * Math::sqrt2 * (c * coefs[index (l,m)] + s * coefs[index (l,-m)]);
 #else
-              amplitude += AL[l] * (c * coefs[index (l,m)] + s * coefs[index (l,-m)]);
+                amplitude += AL[l] * (c * coefs[index (l,m)] + s * coefs[index (l,-m)]);
 #endif
+              }
+              c0 = c;
+              s0 = s;
             }
-            c0 = c;
-            s0 = s;
+            return amplitude;
           }
-          return amplitude;
+      }
+      //! \endcond
+
+      template <typename ValueType, typename CoefType>
+        inline ValueType value (const CoefType& coefs, ValueType cos_elevation, ValueType cos_azimuth, ValueType sin_azimuth, int lmax)
+        {
+          SH_DISPATCH_LMAX (lmax, LMAX, return value_impl (coefs, cos_elevation, cos_azimuth, sin_azimuth, LMAX));
         }
 
       template <typename ValueType, typename CoefType>
@@ -258,34 +285,45 @@ namespace MR
         }
 
 
-      template <typename ValueType>
-        inline Vector<ValueType>& delta (Vector<ValueType>& delta_vec, const Point<ValueType>& unit_dir, int lmax)
-        {
-          delta_vec.allocate (NforL (lmax));
-          ValueType rxy = std::sqrt ( pow2(unit_dir[1]) + pow2(unit_dir[0]) );
-          ValueType cp = (rxy) ? unit_dir[0]/rxy : 1.0;
-          ValueType sp = (rxy) ? unit_dir[1]/rxy : 0.0;
-          VLA_MAX (AL, ValueType, lmax+1, 64);
-          Legendre::Plm_sph (AL, lmax, 0, ValueType (unit_dir[2]));
-          for (int l = 0; l <= lmax; l+=2)
-            delta_vec[index (l,0)] = AL[l];
-          ValueType c0 (1.0), s0 (0.0);
-          for (int m = 1; m <= lmax; m++) {
-            Legendre::Plm_sph (AL, lmax, m, ValueType (unit_dir[2]));
-            ValueType c = c0 * cp - s0 * sp;
-            ValueType s = s0 * cp + c0 * sp;
-            for (int l = ( (m&1) ? m+1 : m); l <= lmax; l+=2) {
+      //! \cond skip
+      namespace
+      {
+        template <typename ValueType, class LmaxType>
+          inline void delta_impl (Vector<ValueType>& delta_vec, const Point<ValueType>& unit_dir, const LmaxType lmax)
+          {
+            ValueType rxy = std::sqrt ( pow2(unit_dir[1]) + pow2(unit_dir[0]) );
+            ValueType cp = (rxy) ? unit_dir[0]/rxy : 1.0;
+            ValueType sp = (rxy) ? unit_dir[1]/rxy : 0.0;
+            VLA_MAX (AL, ValueType, lmax+1, 64);
+            Legendre::Plm_sph (AL, lmax, 0, ValueType (unit_dir[2]));
+            for (int l = 0; l <= lmax; l+=2)
+              delta_vec[index (l,0)] = AL[l];
+            ValueType c0 (1.0), s0 (0.0);
+            for (int m = 1; m <= lmax; m++) {
+              Legendre::Plm_sph (AL, lmax, m, ValueType (unit_dir[2]));
+              ValueType c = c0 * cp - s0 * sp;
+              ValueType s = s0 * cp + c0 * sp;
+              for (int l = ( (m&1) ? m+1 : m); l <= lmax; l+=2) {
 #ifndef USE_NON_ORTHONORMAL_SH_BASIS
-              delta_vec[index (l,m)]  = AL[l] * Math::sqrt2 * c;
-              delta_vec[index (l,-m)] = AL[l] * Math::sqrt2 * s;
+                delta_vec[index (l,m)]  = AL[l] * Math::sqrt2 * c;
+                delta_vec[index (l,-m)] = AL[l] * Math::sqrt2 * s;
 #else
-              delta_vec[index (l,m)]  = AL[l] * 2.0 * c;
-              delta_vec[index (l,-m)] = AL[l] * 2.0 * s;
+                delta_vec[index (l,m)]  = AL[l] * 2.0 * c;
+                delta_vec[index (l,-m)] = AL[l] * 2.0 * s;
 #endif
+              }
+              c0 = c;
+              s0 = s;
             }
-            c0 = c;
-            s0 = s;
           }
+      }
+      //! \endcond
+
+      template <typename ValueType>
+        inline Vector<ValueType>& delta (Vector<ValueType>& delta_vec, const Point<ValueType>& unit_dir, int lmax)
+        {
+          delta_vec.allocate (NforL (lmax));
+          SH_DISPATCH_LMAX (lmax, LMAX, delta_impl (delta_vec, unit_dir, LMAX));
           return delta_vec;
         }
 
@@ -539,6 +577,16 @@ namespace MR
 
           template <class ValueContainer>
             ValueType value (const ValueContainer& val, const Point<ValueType>& unit_dir) const {
+              SH_DISPATCH_LMAX (lmax, LMAX, return value_impl (val, unit_dir, LMAX));
+            }
+
+        protected:
+          int lmax, ndir, nAL;
+          ValueType inc;
+          std::vector<ValueType> AL;
+
+          template <class ValueContainer, class LmaxType>
+            ValueType value_impl (const ValueContainer& val, const Point<ValueType>& unit_dir, const LmaxType lmax) const {
               PrecomputedFraction<ValueType> f;
               set (f, std::acos (unit_dir[2]));
               ValueType rxy = std::sqrt ( pow2(unit_dir[1]) + pow2(unit_dir[0]) );
@@ -558,11 +606,6 @@ namespace MR
               }
               return v;
             }
-
-        protected:
-          int lmax, ndir, nAL;
-          ValueType inc;
-          std::vector<ValueType> AL;
       };
 
 
@@ -617,83 +660,98 @@ namespace MR
 
 
 
-      //! computes first and second order derivatives of SH series
-      /*! This is used primarily in the get_peaks() function. */
-      template <typename ValueType>
-        inline void derivatives (
-            const ValueType* sh, const int lmax, const ValueType elevation, const ValueType azimuth, ValueType& amplitude,
-            ValueType& dSH_del, ValueType& dSH_daz, ValueType& d2SH_del2, ValueType& d2SH_deldaz,
-            ValueType& d2SH_daz2, PrecomputedAL<ValueType>* precomputer)
-        {
-          ValueType sel = std::sin (elevation);
-          ValueType cel = std::cos (elevation);
-          bool atpole = sel < 1e-4;
+      //! \cond skip
+      namespace
+      {
+        template <typename ValueType, class LmaxType>
+          inline void derivatives_impl (
+              const ValueType* sh, const LmaxType lmax, const ValueType elevation, const ValueType azimuth, ValueType& amplitude,
+              ValueType& dSH_del, ValueType& dSH_daz, ValueType& d2SH_del2, ValueType& d2SH_deldaz,
+              ValueType& d2SH_daz2, PrecomputedAL<ValueType>* precomputer)
+          {
+            ValueType sel = std::sin (elevation);
+            ValueType cel = std::cos (elevation);
+            bool atpole = sel < 1e-4;
 
-          dSH_del = dSH_daz = d2SH_del2 = d2SH_deldaz = d2SH_daz2 = 0.0;
-          VLA_MAX (AL, ValueType, NforL_mpos (lmax), 64);
+            dSH_del = dSH_daz = d2SH_del2 = d2SH_deldaz = d2SH_daz2 = 0.0;
+            VLA_MAX (AL, ValueType, NforL_mpos (lmax), 64);
 
-          if (precomputer) {
-            PrecomputedFraction<ValueType> f;
-            precomputer->set (f, elevation);
-            precomputer->get (AL, f);
-          }
-          else {
-            VLA_MAX (buf, ValueType, lmax+1, 64);
-            for (int m = 0; m <= lmax; m++) {
-              Legendre::Plm_sph (buf, lmax, m, cel);
-              for (int l = ( (m&1) ?m+1:m); l <= lmax; l+=2)
-                AL[index_mpos (l,m)] = buf[l];
+            if (precomputer) {
+              PrecomputedFraction<ValueType> f;
+              precomputer->set (f, elevation);
+              precomputer->get (AL, f);
+            }
+            else {
+              VLA_MAX (buf, ValueType, lmax+1, 64);
+              for (int m = 0; m <= lmax; m++) {
+                Legendre::Plm_sph (buf, lmax, m, cel);
+                for (int l = ( (m&1) ?m+1:m); l <= lmax; l+=2)
+                  AL[index_mpos (l,m)] = buf[l];
+              }
             }
-          }
 
-          amplitude = sh[0] * AL[0];
-          for (int l = 2; l <= (int) lmax; l+=2) {
-            const ValueType& v (sh[index (l,0)]);
-            amplitude += v * AL[index_mpos (l,0)];
-            dSH_del += v * sqrt (ValueType (l* (l+1))) * AL[index_mpos (l,1)];
-            d2SH_del2 += v * (sqrt (ValueType (l* (l+1) * (l-1) * (l+2))) * AL[index_mpos (l,2)] - l* (l+1) * AL[index_mpos (l,0)]) /2.0;
-          }
+            amplitude = sh[0] * AL[0];
+            for (int l = 2; l <= (int) lmax; l+=2) {
+              const ValueType& v (sh[index (l,0)]);
+              amplitude += v * AL[index_mpos (l,0)];
+              dSH_del += v * sqrt (ValueType (l* (l+1))) * AL[index_mpos (l,1)];
+              d2SH_del2 += v * (sqrt (ValueType (l* (l+1) * (l-1) * (l+2))) * AL[index_mpos (l,2)] - l* (l+1) * AL[index_mpos (l,0)]) /2.0;
+            }
 
-          for (int m = 1; m <= lmax; m++) {
+            for (int m = 1; m <= lmax; m++) {
 #ifndef USE_NON_ORTHONORMAL_SH_BASIS
-            ValueType caz = Math::sqrt2 * std::cos (m*azimuth);
-            ValueType saz = Math::sqrt2 * std::sin (m*azimuth);
+              ValueType caz = Math::sqrt2 * std::cos (m*azimuth);
+              ValueType saz = Math::sqrt2 * std::sin (m*azimuth);
 #else
-            ValueType caz = std::cos (m*azimuth);
-            ValueType saz = std::sin (m*azimuth);
+              ValueType caz = std::cos (m*azimuth);
+              ValueType saz = std::sin (m*azimuth);
 #endif
-            for (int l = ( (m&1) ? m+1 : m); l <= lmax; l+=2) {
-              const ValueType& vp (sh[index (l,m)]);
-              const ValueType& vm (sh[index (l,-m)]);
-              amplitude += (vp*caz + vm*saz) * AL[index_mpos (l,m)];
-
-              ValueType tmp = sqrt (ValueType ( (l+m) * (l-m+1))) * AL[index_mpos (l,m-1)];
-              if (l > m) tmp -= sqrt (ValueType ( (l-m) * (l+m+1))) * AL[index_mpos (l,m+1)];
-              tmp /= -2.0;
-              dSH_del += (vp*caz + vm*saz) * tmp;
-
-              ValueType tmp2 = - ( (l+m) * (l-m+1) + (l-m) * (l+m+1)) * AL[index_mpos (l,m)];
-              if (m == 1) tmp2 -= sqrt (ValueType ( (l+m) * (l-m+1) * (l+m-1) * (l-m+2))) * AL[index_mpos (l,1)];
-              else tmp2 += sqrt (ValueType ( (l+m) * (l-m+1) * (l+m-1) * (l-m+2))) * AL[index_mpos (l,m-2)];
-              if (l > m+1) tmp2 += sqrt (ValueType ( (l-m) * (l+m+1) * (l-m-1) * (l+m+2))) * AL[index_mpos (l,m+2)];
-              tmp2 /= 4.0;
-              d2SH_del2 += (vp*caz + vm*saz) * tmp2;
-
-              if (atpole) dSH_daz += (vm*caz - vp*saz) * tmp;
-              else {
-                d2SH_deldaz += m * (vm*caz - vp*saz) * tmp;
-                dSH_daz += m * (vm*caz - vp*saz) * AL[index_mpos (l,m)];
-                d2SH_daz2 -= (vp*caz + vm*saz) * m*m * AL[index_mpos (l,m)];
+              for (int l = ( (m&1) ? m+1 : m); l <= lmax; l+=2) {
+                const ValueType& vp (sh[index (l,m)]);
+                const ValueType& vm (sh[index (l,-m)]);
+                amplitude += (vp*caz + vm*saz) * AL[index_mpos (l,m)];
+
+                ValueType tmp = sqrt (ValueType ( (l+m) * (l-m+1))) * AL[index_mpos (l,m-1)];
+                if (l > m) tmp -= sqrt (ValueType ( (l-m) * (l+m+1))) * AL[index_mpos (l,m+1)];
+                tmp /= -2.0;
+                dSH_del += (vp*caz + vm*saz) * tmp;
+
+                ValueType tmp2 = - ( (l+m) * (l-m+1) + (l-m) * (l+m+1)) * AL[index_mpos (l,m)];
+                if (m == 1) tmp2 -= sqrt (ValueType ( (l+m) * (l-m+1) * (l+m-1) * (l-m+2))) * AL[index_mpos (l,1)];
+                else tmp2 += sqrt (ValueType ( (l+m) * (l-m+1) * (l+m-1) * (l-m+2))) * AL[index_mpos (l,m-2)];
+                if (l > m+1) tmp2 += sqrt (ValueType ( (l-m) * (l+m+1) * (l-m-1) * (l+m+2))) * AL[index_mpos (l,m+2)];
+                tmp2 /= 4.0;
+                d2SH_del2 += (vp*caz + vm*saz) * tmp2;
+
+                if (atpole) dSH_daz += (vm*caz - vp*saz) * tmp;
+                else {
+                  d2SH_deldaz += m * (vm*caz - vp*saz) * tmp;
+                  dSH_daz += m * (vm*caz - vp*saz) * AL[index_mpos (l,m)];
+                  d2SH_daz2 -= (vp*caz + vm*saz) * m*m * AL[index_mpos (l,m)];
+                }
+
               }
+            }
 
+            if (!atpole) {
+              dSH_daz /= sel;
+              d2SH_deldaz /= sel;
+              d2SH_daz2 /= sel*sel;
             }
           }
+      }
+      //! \endcond
 
-          if (!atpole) {
-            dSH_daz /= sel;
-            d2SH_deldaz /= sel;
-            d2SH_daz2 /= sel*sel;
-          }
+      //! computes first and second order derivatives of SH series
+      /*! This is used primarily in the get_peaks() function. */
+      template <typename ValueType>
+        inline void derivatives (
+            const ValueType* sh, const int lmax, const ValueType elevation, const ValueType azimuth, ValueType& amplitude,
+            ValueType& dSH_del, ValueType& dSH_daz, ValueType& d2SH_del2, ValueType& d2SH_deldaz,
+            ValueType& d2SH_daz2, PrecomputedAL<ValueType>* precomputer)
+        {
+          SH_DISPATCH_LMAX (lmax, LMAX, derivatives_impl (sh, LMAX, elevation, azimuth, amplitude,
+                dSH_del, dSH_daz, d2SH_del2, d2SH_deldaz, d2SH_daz2, precomputer));
         }
 
 
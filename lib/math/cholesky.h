@@ -86,6 +86,57 @@ namespace MR
         return inv_from_decomp (decomp (A));
       }
 
+      //! update the %Cholesky decomposition \a D of A to that of A + v*v^T, in place
+      /** Both triangles of \a D are updated, as expected by solve(). The
+       * rotations are computed in double precision irrespective of \a
+       * ValueType, so that only the final entries of \a D are rounded. */
+      template <typename ValueType> inline Matrix<ValueType>& update (Matrix<ValueType>& D, const Vector<ValueType>& v)
+      {
+        VLA (w, double, D.rows());
+        for (size_t i = 0; i < D.rows(); ++i)
+          w[i] = v[i];
+        for (size_t k = 0; k < D.rows(); ++k) {
+          const double dkk = D(k,k);
+          const double r = std::sqrt (dkk*dkk + w[k]*w[k]);
+          const double c = r / dkk, s = w[k] / dkk;
+          D(k,k) = r;
+          for (size_t i = k+1; i < D.rows(); ++i) {
+            const double dik = (D(i,k) + s*w[i]) / c;
+            D(i,k) = D(k,i) = dik;
+            w[i] = c*w[i] - s*dik;
+          }
+        }
+        return D;
+      }
+
+      //! downdate the %Cholesky decomposition \a D of A to that of A - v*v^T, in place
+      /** Both triangles of \a D are updated, as expected by solve(). The
+       * rotations are computed in double precision irrespective of \a
+       * ValueType, as for update().
+       * \return false if the downdated matrix is not positive definite, in
+       * which case the contents of \a D are no longer valid. */
+      template <typename ValueType> inline bool downdate (Matrix<ValueType>& D, const Vector<ValueType>& v)
+      {
+        VLA (w, double, D.rows());
+        for (size_t i = 0; i < D.rows(); ++i)
+          w[i] = v[i];
+        for (size_t k = 0; k < D.rows(); ++k) {
+          const double dkk = D(k,k);
+          const double r2 = dkk*dkk - w[k]*w[k];
+          if (!(r2 > 0.0))
+            return false;
+          const double r = std::sqrt (r2);
+          const double c = r / dkk, s = w[k] / dkk;
+          D(k,k) = r;
+          for (size_t i = k+1; i < D.rows(); ++i) {
+            const double dik = (D(i,k) - s*w[i]) / c;
+            D(i,k) = D(k,i) = dik;
+            w[i] = c*w[i] - s*dik;
+          }
+        }
+        return true;
+      }
+
       /** @} */
       /** @} */
 
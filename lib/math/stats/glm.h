@@ -28,6 +28,9 @@
 
 #define GLM_BATCH_SIZE 1024
 
+// Number of permutations evaluated together when permutation testing is run in batched mode
+#define GLM_PERMUTATION_BATCH_SIZE 32
+
 namespace MR
 {
   namespace Math
@@ -129,6 +132,131 @@ namespace MR
 
           /** \addtogroup Statistics
           @{ */
+          /*! A general linear model for a fixed design matrix.
+           *
+           * The pseudo-inverse and rank of the design matrix, and the scaling of each
+           * contrast for the t-test, are computed once on construction and then reused
+           * for any number of datasets. Each row of the contrast matrix is treated as an
+           * independent contrast; all contrasts are evaluated, and all requested outputs
+           * are derived from the same betas, within a single pass over the measurements.
+           */
+          template <typename ValueType>
+            class Model {
+              public:
+                /*!
+                * @param design the design matrix (unlike other packages a column of ones is NOT automatically added for correlation analysis)
+                * @param contrasts the contrast matrix, with one contrast per row (may be empty if only the betas and standard deviation are required)
+                */
+                Model (const Math::Matrix<ValueType>& design, const Math::Matrix<ValueType>& contrasts = Math::Matrix<ValueType>()) :
+                  X (design)
+                {
+                  Math::Matrix<double> d_X (design);
+                  SVD_invert (d_pinvX, d_X);
+                  pinvX = d_pinvX;
+                  dof = design.rows() - rank (d_X);
+
+                  if (!contrasts.rows())
+                    return;
+                  if (contrasts.columns() > design.columns())
+                    throw Exception ("too many columns in contrast matrix for design matrix");
+                  c.allocate (contrasts.rows(), design.columns());
+                  c = 0.0;
+                  c.sub (0, contrasts.rows(), 0, contrasts.columns()) = contrasts;
+
+                  Math::Matrix<double> d_XtX, d_pinv_XtX;
+                  Math::mult (d_XtX, 1.0, CblasTrans, d_X, CblasNoTrans, d_X);
+                  SVD_invert (d_pinv_XtX, d_XtX);
+                  scaled_c = c;
+                  for (size_t n = 0; n < c.rows(); ++n) {
+                    Math::Vector<double> d_c (c.row(n)), pinv_XtX_c;
+                    Math::mult (pinv_XtX_c, d_pinv_XtX, d_c);
+                    scaled_c.row(n) *= std::sqrt (double(dof) / Math::dot (d_c, pinv_XtX_c));
+                  }
+                }
+
+                size_t num_subjects () const { return X.rows(); }
+                size_t num_factors () const { return X.columns(); }
+                size_t num_contrasts () const { return c.rows(); }
+                size_t degrees_of_freedom () const { return dof; }
+
+                const Math::Matrix<ValueType>& design () const { return X; }
+                const Math::Matrix<ValueType>& pinv_design () const { return pinvX; }
+                //! the pseudo-inverse of the design matrix, as computed in double precision
+                const Math::Matrix<double>& pinv_design_double () const { return d_pinvX; }
+                const Math::Matrix<ValueType>& contrasts () const { return c; }
+                //! the contrasts scaled for use in GLM::ttest()
+                const Math::Matrix<ValueType>& scaled_contrasts () const { return scaled_c; }
+
+
+                /*! Fit the model to the measurements, computing any of the outputs
+                * Outputs for which a null pointer is passed are not computed. Each output has
+                * one row per element; the effect sizes and t-values have one column per contrast.
+                * @param measurements a matrix storing the measured data for each subject in a column
+                * @param betas the beta coefficients
+                * @param abs_effect the effect of interest
+                * @param std_effect Cohen's d, the standardised effect size
+                * @param stdev the pooled standard deviation (a single column)
+                * @param tvalues the t-statistics
+                */
+                void operator() (const Math::Matrix<ValueType>& measurements,
+                                 Math::Matrix<ValueType>* betas,
+                                 Math::Matrix<ValueType>* abs_effect,
+                                 Math::Matrix<ValueType>* std_effect,
+                                 Math::Matrix<ValueType>* stdev,
+                                 Math::Matrix<ValueType>* tvalues) const
+                {
+                  if (measurements.columns() != num_subjects())
+                    throw Exception ("number of subjects in data does not match design matrix");
+                  if ((abs_effect || std_effect || tvalues) && !num_contrasts())
+                    throw Exception ("no contrasts provided to GLM");
+                  const size_t num_elements = measurements.rows();
+                  if (betas) betas->allocate (num_elements, num_factors());
+                  if (abs_effect) abs_effect->allocate (num_elements, num_contrasts());
+                  if (std_effect) std_effect->allocate (num_elements, num_contrasts());
+                  if (stdev) stdev->allocate (num_elements, 1);
+                  if (tvalues) tvalues->allocate (num_elements, num_contrasts());
+
+                  Math::Matrix<ValueType> b, residuals, effect, t;
+                  for (size_t i = 0; i < num_elements; i += GLM_BATCH_SIZE) {
+                    const size_t num_rows = std::min (size_t (GLM_BATCH_SIZE), num_elements - i);
+                    const Math::Matrix<ValueType> y (measurements.sub (i, i+num_rows, 0, num_subjects()));
+                    Math::mult (b, ValueType(1.0), CblasNoTrans, y, CblasTrans, pinvX);
+                    if (betas)
+                      betas->sub (i, i+num_rows, 0, num_factors()) = b;
+                    if (abs_effect || std_effect)
+                      Math::mult (effect, ValueType(1.0), CblasNoTrans, b, CblasTrans, c);
+                    if (abs_effect)
+                      abs_effect->sub (i, i+num_rows, 0, num_contrasts()) = effect;
+                    if (!(std_effect || stdev || tvalues))
+                      continue;
+
+                    Math::mult (residuals, ValueType(-1.0), CblasNoTrans, b, CblasTrans, X);
+                    residuals += y;
+                    if (tvalues)
+                      Math::mult (t, ValueType(1.0), CblasNoTrans, b, CblasTrans, scaled_c);
+                    for (size_t n = 0; n < num_rows; ++n) {
+                      const ValueType sum_sq = Math::norm2 (residuals.row(n));
+                      const ValueType sd = std::sqrt (sum_sq / ValueType(dof));
+                      if (stdev)
+                        (*stdev) (i+n, 0) = sd;
+                      for (size_t k = 0; k < num_contrasts(); ++k) {
+                        if (std_effect)
+                          (*std_effect) (i+n, k) = effect (n, k) / sd;
+                        if (tvalues)
+                          (*tvalues) (i+n, k) = t (n, k) / std::sqrt (sum_sq);
+                      }
+                    }
+                  }
+                }
+
+              protected:
+                Math::Matrix<ValueType> X, pinvX, c, scaled_c;
+                Math::Matrix<double> d_pinvX;
+                size_t dof;
+            };
+
+
+
           /*! Compute a matrix of the beta coefficients
           * @param measurements a matrix storing the measured data for each subject in a column
           * @param design the design matrix (unlike other packages a column of ones is NOT automatically added for correlation analysis)
@@ -138,10 +266,8 @@ namespace MR
             inline void solve_betas (const Math::Matrix<ValueType>& measurements,
                                      const Math::Matrix<ValueType>& design,
                                      Math::Matrix<ValueType>& betas) {
-            Math::Matrix<double> d_pinvX, d_X (design);
-            SVD_invert (d_pinvX, d_X);
-            Math::Matrix<ValueType> pinvX = d_pinvX;
-            Math::mult (betas, ValueType(1.0), CblasNoTrans, measurements, CblasTrans, pinvX);
+              const Model<ValueType> model (design);
+              model (measurements, &betas, nullptr, nullptr, nullptr, nullptr);
           }
 
 
@@ -157,9 +283,8 @@ namespace MR
                                          const Math::Matrix<ValueType>& design,
                                          const Math::Matrix<ValueType>& contrast,
                                          Math::Matrix<ValueType>& effect) {
-              Math::Matrix<ValueType> betas;
-              GLM::solve_betas (measurements, design, betas);
-              Math::mult (effect, ValueType(1.0), CblasNoTrans, betas, CblasTrans, contrast);
+              const Model<ValueType> model (design, contrast);
+              model (measurements, nullptr, &effect, nullptr, nullptr, nullptr);
           }
 
 
@@ -175,19 +300,8 @@ namespace MR
                                          const Math::Matrix<ValueType>& design,
                                          const Math::Matrix<ValueType>& contrast,
                                          Math::Matrix<ValueType>& cohens_d) {
-              Math::Matrix<ValueType> betas;
-              GLM::solve_betas (measurements, design, betas);
-              Math::Matrix<ValueType> residuals;
-              Math::mult (residuals, ValueType(-1.0), CblasNoTrans, betas, CblasTrans, design);
-              residuals += measurements;
-              residuals.pow (2.0);
-              Math::Matrix<ValueType> one_over_dof (measurements.columns(), 1);
-              one_over_dof = 1.0 / ValueType(design.rows()-rank(design));
-              Math::Matrix<ValueType> stdev;
-              Math::mult (stdev, residuals, one_over_dof);
-              stdev.sqrt();
-              Math::mult (cohens_d, ValueType(1.0), CblasNoTrans, betas, CblasTrans, contrast);
-              cohens_d /= stdev;
+              const Model<ValueType> model (design, contrast);
+              model (measurements, nullptr, nullptr, &cohens_d, nullptr, nullptr);
           }
 
 
@@ -201,16 +315,8 @@ namespace MR
             inline void stdev (const Math::Matrix<ValueType>& measurements,
                                const Math::Matrix<ValueType>& design,
                                Math::Matrix<ValueType>& stdev) {
-              Math::Matrix<ValueType> betas;
-              GLM::solve_betas (measurements, design, betas);
-              Math::Matrix<ValueType> residuals;
-              Math::mult (residuals, ValueType(-1.0), CblasNoTrans, betas, CblasTrans, design);
-              residuals += measurements;
-              residuals.pow(2.0);
-              Math::Matrix<ValueType> one_over_dof (measurements.columns(), 1);
-              one_over_dof = 1.0 / ValueType(design.rows()-rank(design));
-              Math::mult (stdev, residuals, one_over_dof);
-              stdev.sqrt();
+              const Model<ValueType> model (design);
+              model (measurements, nullptr, nullptr, nullptr, &stdev, nullptr);
           }
           //! @}
       }
@@ -229,16 +335,30 @@ namespace MR
           GLMTTest (const Math::Matrix<value_type>& measurements,
                     const Math::Matrix<value_type>& design,
                     const Math::Matrix<value_type>& contrast) :
-            y (measurements),
-            X (design),
-            scaled_contrasts (GLM::scale_contrasts (contrast, X, X.rows()-rank(X)))
+            y (measurements)
           {
-            Math::Matrix<double> d_pinvX, d_X (X);
-            SVD_invert (d_pinvX, d_X);
-            pinvX = d_pinvX;
+            // a single contrast may be provided as either a row or a column vector
+            if (contrast.rows() > 1 && contrast.columns() > 1)
+              throw Exception ("too many columns in contrast matrix: this implementation currently only supports univariate GLM");
+            init (GLM::Model<value_type> (design, contrast.rows() > 1 ? Math::Matrix<value_type> (Math::transpose (contrast)) : contrast), 0);
+          }
+
+          /*!
+          * @param measurements a matrix storing the measured data for each subject in a column
+          * @param model a previously constructed model, whose factorisation of the design matrix is reused
+          * @param contrast the index of the contrast (row of the model's contrast matrix) to test
+          */
+          GLMTTest (const Math::Matrix<value_type>& measurements,
+                    const GLM::Model<value_type>& model,
+                    const size_t contrast = 0) :
+            y (measurements)
+          {
+            init (model, contrast);
           }
 
           /*! Compute the t-statistics
+          * This is evaluated as a block of a single permutation, such that the statistics
+          * are identical to those obtained for the same permutation within any block.
           * @param perm_labelling a vector to shuffle the rows in the design matrix (for permutation testing)
           * @param stats the vector containing the output t-statistics
           * @param max_stat the maximum t-statistic
@@ -247,27 +367,77 @@ namespace MR
           void operator() (const std::vector<size_t>& perm_labelling, std::vector<value_type>& stats,
                            value_type& max_stat, value_type& min_stat) const
           {
-            stats.resize (y.rows(), 0.0);
-            Math::Matrix<value_type> tvalues, betas, residuals, SX, pinvSX;
-
-            SX.allocate (X);
-            pinvSX.allocate (pinvX);
-            for (size_t i = 0; i < X.rows(); ++i) {
-              // TODO: check whether we should permute rows or columns
-              SX.row(i) = X.row (perm_labelling[i]);
-              pinvSX.column(i) = pinvX.column (perm_labelling[i]);
+            const std::vector<std::vector<size_t> > perm_labellings (1, perm_labelling);
+            std::vector<std::vector<value_type> > block_stats (1);
+            std::vector<value_type> max_stats, min_stats;
+            std::swap (stats, block_stats[0]);
+            (*this) (perm_labellings, block_stats, max_stats, min_stats);
+            std::swap (stats, block_stats[0]);
+            if (max_stats[0] > max_stat)
+              max_stat = max_stats[0];
+            if (min_stats[0] < min_stat)
+              min_stat = min_stats[0];
+          }
+
+          /*! Compute the t-statistics for a block of permutations simultaneously
+          * The permuted pseudo-inverses and design matrices are stacked, such that the betas
+          * for all permutations are obtained from a single matrix multiplication per batch of
+          * elements, as is the projection of the data onto each permuted design. Since the
+          * pseudo-inverse yields an orthogonal projection, the residual sum of squares is then
+          * |y|^2 - (y.SX).beta. Since this difference cancels as the mean of the data grows
+          * relative to its standard deviation, the design matrix and its pseudo-inverse are
+          * held, and the products evaluated, in double precision throughout.
+          * @param perm_labellings the permutations to evaluate
+          * @param stats the output t-statistics, one vector per permutation
+          * @param max_stats the maximum t-statistic for each permutation
+          * @param min_stats the minimum t-statistic for each permutation
+          */
+          void operator() (const std::vector<std::vector<size_t> >& perm_labellings, std::vector<std::vector<value_type> >& stats,
+                           std::vector<value_type>& max_stats, std::vector<value_type>& min_stats) const
+          {
+            const size_t num_perms = perm_labellings.size(), num_factors = X.columns(), num_subjects = X.rows();
+            stats.resize (num_perms);
+            for (size_t p = 0; p < num_perms; ++p)
+              stats[p].resize (y.rows(), 0.0);
+            max_stats.assign (num_perms, 0.0);
+            min_stats.assign (num_perms, 0.0);
+
+            // Rows [p*num_factors, (p+1)*num_factors) hold the permuted pinv(X) and transposed X for permutation p
+            Math::Matrix<double> pinvSX_stack (num_perms * num_factors, num_subjects), SXt_stack (num_perms * num_factors, num_subjects);
+            for (size_t p = 0; p < num_perms; ++p) {
+              for (size_t f = 0; f < num_factors; ++f) {
+                for (size_t i = 0; i < num_subjects; ++i) {
+                  pinvSX_stack (p*num_factors + f, i) = pinvX (f, perm_labellings[p][i]);
+                  SXt_stack    (p*num_factors + f, i) = X (perm_labellings[p][i], f);
+                }
+              }
             }
 
+            Math::Matrix<double> data, betas, projections;
             for (size_t i = 0; i < y.rows(); i += GLM_BATCH_SIZE) {
-              GLM::ttest (tvalues, SX, pinvSX, y.sub(i, std::min (i+GLM_BATCH_SIZE, y.rows()), 0, y.columns()),
-                  scaled_contrasts, betas, residuals);
-              for (size_t n = 0; n < tvalues.rows(); ++n) {
-                value_type val = tvalues(n,0);
-                if (val > max_stat)
-                  max_stat = val;
-                if (val < min_stat)
-                  min_stat = val;
-                stats[i+n] = val;
+              const size_t num_rows = std::min (size_t (GLM_BATCH_SIZE), y.rows() - i);
+              data.allocate (num_rows, num_subjects);
+              for (size_t n = 0; n < num_rows; ++n)
+                for (size_t s = 0; s < num_subjects; ++s)
+                  data (n, s) = y (i+n, s);
+              Math::mult (betas,       1.0, CblasNoTrans, data, CblasTrans, pinvSX_stack);
+              Math::mult (projections, 1.0, CblasNoTrans, data, CblasTrans, SXt_stack);
+
+              for (size_t n = 0; n < num_rows; ++n) {
+                const double sum_sq = Math::norm2 (data.row (n));
+                for (size_t p = 0; p < num_perms; ++p) {
+                  double effect = 0.0, explained = 0.0;
+                  for (size_t f = 0; f < num_factors; ++f) {
+                    effect    += betas (n, p*num_factors + f) * scaled_contrasts (0, f);
+                    explained += betas (n, p*num_factors + f) * projections (n, p*num_factors + f);
+                  }
+                  const value_type val = effect / std::sqrt (std::max (sum_sq - explained, 0.0));
+                  if (val > max_stats[p])
+                    max_stats[p] = val;
+                  if (val < min_stats[p])
+                    min_stats[p] = val;
+                  stats[p][i+n] = val;
+                }
               }
             }
           }
@@ -277,7 +447,17 @@ namespace MR
 
         protected:
           const Math::Matrix<value_type>& y;
-          Math::Matrix<value_type> X, pinvX, scaled_contrasts;
+          Math::Matrix<double> X, pinvX;
+          Math::Matrix<value_type> scaled_contrasts;
+
+          void init (const GLM::Model<value_type>& model, const size_t contrast)
+          {
+            if (contrast >= model.num_contrasts())
+              throw Exception ("contrast index exceeds number of contrasts in GLM");
+            X = model.design();
+            pinvX = model.pinv_design_double();
+            scaled_contrasts = model.scaled_contrasts().sub (contrast, contrast+1, 0, model.num_factors());
+          }
       };
       //! @}
 
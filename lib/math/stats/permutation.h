@@ -21,6 +21,11 @@
 #ifndef __math_stats_permutation_h__
 #define __math_stats_permutation_h__
 
+#include <map>
+#include <random>
+#include <unordered_set>
+
+#include "math/rng.h"
 #include "math/vector.h"
 #include "math/matrix.h"
 
@@ -34,50 +39,118 @@ namespace MR
       typedef float value_type;
 
 
-      inline bool is_duplicate_vector (const std::vector<size_t>& v1, const std::vector<size_t>& v2)
+      //! 64-bit fingerprint of a permutation, used to detect duplicates
+      inline uint64_t permutation_fingerprint (const std::vector<size_t>& permutation)
       {
-        for (size_t i = 0; i < v1.size(); i++) {
-          if (v1[i] != v2[i])
-            return false;
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        for (size_t i = 0; i < permutation.size(); ++i) {
+          hash ^= uint64_t (permutation[i]);
+          hash *= 0x100000001b3ULL;
+          hash ^= hash >> 29;
         }
-        return true;
+        return hash;
       }
 
 
-      inline bool is_duplicate_permutation (const std::vector<size_t>& perm,
-                                            const std::vector<std::vector<size_t> >& previous_permutations)
+
+      //! generate permutations on demand
+      /*! Each permutation is produced from its own random stream, seeded from
+       * the global seed, the permutation index and the number of previous
+       * attempts at that index. Duplicates of earlier permutations are
+       * detected using a hash set of their fingerprints, and rejected (the next
+       * attempt at that index is then used). Only the fingerprints, and the
+       * indices that required more than one attempt, are stored; any
+       * previously generated permutation can therefore be reproduced without
+       * retaining all of them in memory.
+       *
+       * Note that this does not take into account grouping of subjects and therefore generated
+       * permutations are not guaranteed to be unique wrt the computed test statistic.
+       * If the number of subjects is large then the likelihood of generating duplicates is low. */
+      class PermutationGenerator
       {
-        for (unsigned int p = 0; p < previous_permutations.size(); p++) {
-          if (is_duplicate_vector (perm, previous_permutations[p]))
-            return true;
-        }
-        return false;
-      }
+        public:
+          PermutationGenerator (const size_t num_subjects, const uint64_t seed, const bool include_default) :
+            num_subjects (num_subjects),
+            seed (seed),
+            include_default (include_default),
+            generated (0) { }
+
+          //! generate the next permutation in the sequence
+          void next (std::vector<size_t>& permutation)
+          {
+            size_t attempt = 0;
+            do {
+              generate (generated, attempt++, permutation);
+            } while (!fingerprints.insert (permutation_fingerprint (permutation)).second);
+            if (attempt > 1)
+              attempts[generated] = attempt - 1;
+            ++generated;
+          }
+
+          //! advance the sequence by \a count permutations, retaining their fingerprints
+          void skip (const size_t count)
+          {
+            std::vector<size_t> permutation;
+            for (size_t p = 0; p < count; ++p)
+              next (permutation);
+          }
+
+          //! regenerate a permutation that has already been produced by next()
+          void get (const size_t index, std::vector<size_t>& permutation) const
+          {
+            assert (index < generated);
+            const std::map<size_t, size_t>::const_iterator i = attempts.find (index);
+            generate (index, i == attempts.end() ? 0 : i->second, permutation);
+          }
+
+          size_t size () const { return generated; }
+
+        private:
+          const size_t num_subjects;
+          const uint64_t seed;
+          const bool include_default;
+          size_t generated;
+          std::unordered_set<uint64_t> fingerprints;
+          std::map<size_t, size_t> attempts;
+
+          static uint64_t mix (uint64_t x)
+          {
+            x += 0x9e3779b97f4a7c15ULL;
+            x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+            return x ^ (x >> 31);
+          }
+
+          void generate (const size_t index, const size_t attempt, std::vector<size_t>& permutation) const
+          {
+            permutation.resize (num_subjects);
+            for (size_t i = 0; i < num_subjects; ++i)
+              permutation[i] = i;
+            if (include_default && !index && !attempt)
+              return;
+            // Fisher-Yates shuffle; bounded integers drawn by rejection to remain
+            //   independent of the standard library's distribution implementations
+            std::mt19937_64 rng (mix (seed ^ mix (index ^ mix (attempt))));
+            for (size_t i = num_subjects; i > 1; --i) {
+              const uint64_t limit = std::numeric_limits<uint64_t>::max() - (std::numeric_limits<uint64_t>::max() % i);
+              uint64_t r;
+              do { r = rng(); } while (r >= limit);
+              std::swap (permutation[i-1], permutation[r % i]);
+            }
+          }
+      };
+
+
 
-      // Note that this function does not take into account grouping of subjects and therefore generated
-      // permutations are not guaranteed to be unique wrt the computed test statistic.
-      // If the number of subjects is large then the likelihood of generating duplicates is low.
       inline void generate_permutations (const size_t num_perms,
                                          const size_t num_subjects,
                                          std::vector<std::vector<size_t> >& permutations,
                                          bool include_default)
       {
-        permutations.clear();
-        std::vector<size_t> default_labelling (num_subjects);
-        for (size_t i = 0; i < num_subjects; ++i)
-          default_labelling[i] = i;
-        size_t p = 0;
-        if (include_default) {
-          permutations.push_back (default_labelling);
-          ++p;
-        }
-        for (;p < num_perms; ++p) {
-          std::vector<size_t> permuted_labelling (default_labelling);
-          do {
-            std::random_shuffle (permuted_labelling.begin(), permuted_labelling.end());
-          } while (is_duplicate_permutation (permuted_labelling, permutations));
-          permutations.push_back (permuted_labelling);
-        }
+        permutations.resize (num_perms);
+        PermutationGenerator generator (num_subjects, Math::RNG::get_seed(), include_default);
+        for (size_t p = 0; p < num_perms; ++p)
+          generator.next (permutations[p]);
       }
 
 
@@ -23,6 +23,8 @@
 #ifndef __dwi_Sn_scale_estimator_h__
 #define __dwi_Sn_scale_estimator_h__
 
+#include <algorithm>
+
 #include "math/vector.h"
 #include "math/median.h"
 
@@ -34,11 +36,68 @@ namespace MR {
     // Sn robust estimator of scale to get solid estimate of standard deviation:
     // for details, see: Rousseeuw PJ, Croux C. Alternatives to the Median Absolute Deviation. Journal of the American Statistical Association 1993;88:1273–1283. 
 
+    //
+    // The values are sorted once, after which the median distance from each value to all others is
+    // obtained by selection between the two sorted sequences of distances to the values either side
+    // of it, requiring O(n log n) rather than O(n^2) operations. Inputs containing NaNs are handled by
+    // direct evaluation, since these are excluded from the medians.
+
     template <typename value_type> 
       class Sn_scale_estimator {
         public:
           template <class Container>
             value_type operator() (const Container& vec)
+            {
+              const size_t n = vec.size();
+              sorted.resize (n);
+              for (size_t i = 0; i < n; ++i) {
+                sorted[i] = vec[i];
+                if (std::isnan (sorted[i]))
+                  return direct (vec);
+              }
+              std::sort (sorted.begin(), sorted.end());
+
+              med_diff.resize (n);
+              for (size_t j = 0; j < n; ++j) {
+                if (n & 1U)
+                  med_diff[j] = select (j, n/2);
+                else
+                  med_diff[j] = (select (j, n/2) + select (j, n/2 - 1))/2.0;
+              }
+              return 1.1926 * Math::median (med_diff);
+            }
+
+        protected:
+          std::vector<value_type> sorted, diff, med_diff;
+
+          // the k-th smallest (from zero) of the distances between sorted value j and all values (including itself)
+          value_type select (const size_t j, const size_t k) const
+          {
+            if (!k)
+              return 0.0;
+            // distances to the values below and above value j, each in increasing order:
+            const size_t num_below = j, num_above = sorted.size() - 1 - j;
+            auto below = [&] (size_t a) { return sorted[j] - sorted[j-1-a]; };
+            auto above = [&] (size_t b) { return sorted[j+1+b] - sorted[j]; };
+            // find the number of distances taken from below among the k smallest non-zero distances:
+            size_t lo = k > num_above ? k - num_above : 0, hi = std::min (k, num_below);
+            while (lo < hi) {
+              const size_t a = (lo + hi) / 2, b = k - a;
+              if (b > 0 && above (b-1) > below (a))
+                lo = a + 1;
+              else
+                hi = a;
+            }
+            const size_t b = k - lo;
+            if (!lo)
+              return above (b-1);
+            if (!b)
+              return below (lo-1);
+            return std::max (below (lo-1), above (b-1));
+          }
+
+          template <class Container>
+            value_type direct (const Container& vec)
             {
               diff.resize (vec.size());
               med_diff.resize (vec.size());
@@ -50,9 +109,6 @@ namespace MR {
               return 1.1926 * Math::median (med_diff);
             }
 
-        protected:
-          std::vector<value_type> diff, med_diff;
-
       };
 
   }
@@ -23,8 +23,16 @@
 #ifndef __dwi_bootstrap_h__
 #define __dwi_bootstrap_h__
 
+#include <limits>
+#include <map>
+#include <random>
+
+#include "point.h"
 #include "image/position.h"
 #include "image/adapter/voxel.h"
+#include "math/least_squares.h"
+#include "math/matrix.h"
+#include "math/rng.h"
 
 
 namespace MR {
@@ -114,6 +122,142 @@ namespace MR {
         friend class Image::Position<Bootstrap<VoxelType,Functor,NUM_VOX_PER_CHUNK> >;
     };
 
+
+
+    /*! Generate bootstrap realisations of the signals of a block of voxels.
+     *
+     * Whereas the Bootstrap adapter above resamples individual voxels on demand
+     * (as required for tractography), this resamples many realisations of a block
+     * of voxels at once, for subsequent batched fitting. For a linear model of the
+     * signals with design matrix \a A, the hat matrix H = A*pinv(A) and the
+     * residual-forming matrix I-H are precomputed. The fitted signals and residuals
+     * of all voxels in the block are then obtained using a single matrix-matrix
+     * product. Each residual is divided by sqrt(1-h), with h the corresponding
+     * diagonal element of H (leverage), and each realisation is formed as the
+     * fitted signals plus resampled residuals, using either:
+     * - the wild bootstrap: the sign of each residual is flipped at random;
+     * - the residual bootstrap: the mean-centred residuals of each voxel are
+     * sampled with replacement.
+     *
+     * As for NoiseEstimatorFunctor, measurements with a leverage of 1 (to within
+     * rounding error) are left unscaled; since these are fitted exactly (e.g. a
+     * single b=0 volume in a tensor fit), their residuals are zero, and the
+     * variability of the fit due to these measurements is not reflected in the
+     * realisations (see is_exact()).
+     *
+     * Both the signals and the realisations are stored with one voxel per row, with
+     * realisation \a r of voxel \a v in row (r * num_voxels() + v), such that the
+     * realisations can be passed directly to batched fitting routines such as
+     * WLSTensorFit or CSDeconvBatch. For tensor fitting, the signals and design
+     * matrix should be provided in the log domain. */
+    template <typename ValueType> class BootstrapBlock
+    {
+      public:
+        typedef ValueType value_type;
+
+        enum mode_t { WILD, RESIDUAL };
+
+        BootstrapBlock (const Math::Matrix<value_type>& design, const mode_t mode = WILD) :
+          mode (mode)
+        {
+          Math::mult (hat, design, Math::pinv (design));
+          residual_projection.allocate (hat.rows(), hat.columns());
+          residual_projection.identity();
+          residual_projection -= hat;
+          leverage_scale.allocate (hat.rows());
+          for (size_t i = 0; i < hat.rows(); ++i)
+            leverage_scale[i] = is_exact (i) ? value_type (1.0) : value_type (1.0) / std::sqrt (value_type (1.0) - hat (i,i));
+        }
+
+
+        //! compute the fitted signals & residuals of the voxels in \a signals (one voxel per row)
+        void set (const Math::Matrix<value_type>& signals)
+        {
+          assert (signals.columns() == hat.rows());
+          if (!signals.rows()) {
+            fit.allocate (0, hat.rows());
+            res.allocate (0, hat.rows());
+            return;
+          }
+          Math::mult (res, value_type (1.0), CblasNoTrans, signals, CblasTrans, residual_projection);
+          fit = signals;
+          fit -= res;
+
+          for (size_t v = 0; v < res.rows(); ++v) {
+            value_type mean = 0.0;
+            for (size_t i = 0; i < res.columns(); ++i) {
+              res (v,i) *= leverage_scale[i];
+              mean += res (v,i);
+            }
+            if (mode == RESIDUAL) {
+              mean /= value_type (res.columns());
+              for (size_t i = 0; i < res.columns(); ++i)
+                res (v,i) -= mean;
+            }
+          }
+        }
+
+
+        //! generate \a num_realisations realisations of the current block of voxels
+        void operator() (Math::Matrix<value_type>& realisations, const size_t num_realisations, Math::RNG& rng) const
+        {
+          const size_t nvox = num_voxels(), nvol = fit.columns();
+          realisations.allocate (num_realisations * nvox, nvol);
+          if (mode == WILD) {
+            // each random number provides the signs of 32 residuals:
+            uint32_t bits = 0;
+            size_t remaining = 0;
+            for (size_t r = 0; r < num_realisations; ++r) {
+              for (size_t v = 0; v < nvox; ++v) {
+                value_type* out = &realisations (r*nvox + v, 0);
+                const value_type* f = &fit (v,0);
+                const value_type* e = &res (v,0);
+                for (size_t i = 0; i < nvol; ++i) {
+                  if (!remaining) {
+                    bits = rng();
+                    remaining = 32;
+                  }
+                  out[i] = (bits & 1u) ? f[i] + e[i] : f[i] - e[i];
+                  bits >>= 1;
+                  --remaining;
+                }
+              }
+            }
+          }
+          else {
+            std::uniform_int_distribution<size_t> index (0, nvol-1);
+            for (size_t r = 0; r < num_realisations; ++r) {
+              for (size_t v = 0; v < nvox; ++v) {
+                value_type* out = &realisations (r*nvox + v, 0);
+                const value_type* f = &fit (v,0);
+                const value_type* e = &res (v,0);
+                for (size_t i = 0; i < nvol; ++i)
+                  out[i] = f[i] + e[index (rng)];
+              }
+            }
+          }
+        }
+
+
+        size_t num_voxels () const { return fit.rows(); }
+
+        //! whether measurement \a i is fitted exactly by the model, such that its noise is not reflected in the realisations
+        /*! The leverage of such measurements is 1 only to within rounding error, so
+         * a tolerance is needed to avoid amplifying their (round-off) residuals. */
+        bool is_exact (const size_t i) const {
+          return hat (i,i) > value_type (1.0) - std::sqrt (std::numeric_limits<value_type>::epsilon());
+        }
+
+        const Math::Matrix<value_type>& hat_matrix () const { return hat; }
+        const Math::Matrix<value_type>& fitted () const { return fit; }
+        const Math::Matrix<value_type>& residuals () const { return res; }
+
+      protected:
+        const mode_t mode;
+        Math::Matrix<value_type> hat, residual_projection, fit, res;
+        Math::Vector<value_type> leverage_scale;
+    };
+
   }
 }
 
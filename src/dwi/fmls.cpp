@@ -161,6 +161,39 @@ bool Segmenter::operator() (const SH_coefs& in, FOD_lobes& out) const {
 
   Math::Vector<float> values (dirs.size());
   transform->SH2A (values, in);
+  segment (in.ptr(), values, out);
+  return true;
+
+}
+
+
+
+bool Segmenter::operator() (const SH_coefs_block& in, FOD_lobes_block& out) const {
+
+  assert (in.coefs.columns() == Math::SH::NforL (lmax));
+
+  out.resize (in.size());
+  if (!in.size())
+    return true;
+
+  // Amplitudes of all voxels in the block, one voxel per row
+  Math::Matrix<float> values;
+  Math::mult (values, 1.0f, CblasNoTrans, in.coefs, CblasTrans, transform->mat_SH2A());
+
+  for (size_t n = 0; n != in.size(); ++n) {
+    out[n].clear();
+    out[n].vox = in.vox[n];
+    const float* sh = &in.coefs (n, 0);
+    if (sh[0] > 0.0 && std::isfinite (sh[0]))
+      segment (sh, values.row (n), out[n]);
+  }
+  return true;
+
+}
+
+
+
+void Segmenter::segment (const float* sh, const Math::Vector<float>& values, FOD_lobes& out) const {
 
   typedef std::multimap<float, dir_t, Max_abs> map_type;
   map_type data_in_order;
@@ -168,7 +201,7 @@ bool Segmenter::operator() (const SH_coefs& in, FOD_lobes& out) const {
     data_in_order.insert (std::make_pair (values[i], i));
 
   if (data_in_order.begin()->first <= 0.0)
-    return true;
+    return;
 
   std::vector< std::pair<dir_t, uint32_t> > retrospective_assignments;
 
@@ -244,7 +277,7 @@ bool Segmenter::operator() (const SH_coefs& in, FOD_lobes& out) const {
     } else {
       const dir_t peak_bin (i->get_peak_dir_bin());
       Point<float> newton_peak (dirs.get_dir (peak_bin));
-      float new_peak_value = Math::SH::get_peak (in.ptr(), lmax, newton_peak, &(*precomputer));
+      float new_peak_value = Math::SH::get_peak (sh, lmax, newton_peak, &(*precomputer));
       if (new_peak_value > i->get_peak_value() && newton_peak.valid())
         i->revise_peak (newton_peak, new_peak_value);
       i->finalise();
@@ -323,8 +356,6 @@ bool Segmenter::operator() (const SH_coefs& in, FOD_lobes& out) const {
     out.push_back (FOD_lobe (null_mask));
   }
 
-  return true;
-
 }
 
 
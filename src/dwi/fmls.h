@@ -45,6 +45,7 @@
 #define FMLS_RATIO_TO_NEGATIVE_LOBE_MEAN_PEAK_DEFAULT 1.0 // Peak amplitude needs to be greater than the mean negative peak
 #define FMLS_PEAK_VALUE_THRESHOLD 0.1 // Throw out anything that's below the CSD regularisation threshold
 #define FMLS_RATIO_TO_PEAK_VALUE_DEFAULT 1.0 // By default, turn all peaks into lobes (discrete peaks are never merged)
+#define FMLS_BLOCK_SIZE 256 // Number of voxels passed through the queue at once when segmenting in blocks
 
 
 // By default, the mean direction of each FOD lobe is calculated by taking a weighted average of the
@@ -192,6 +193,38 @@ class SH_coefs : public Math::Vector<float> {
     Point<int> vox;
 };
 
+// A block of voxels for tiled segmentation: the SH coefficients of each voxel are stored in one row of the matrix,
+//   such that the amplitudes of the entire block can be computed using a single matrix multiplication
+class SH_coefs_block {
+  public:
+    Math::Matrix<float> coefs;
+    std::vector< Point<int> > vox;
+    size_t size() const { return vox.size(); }
+};
+
+class FOD_lobes_block : public std::vector<FOD_lobes> { };
+
+
+// Pass the contents of each FOD_lobes_block to a receiver that processes voxels individually
+template <class ReceiverType>
+class FOD_lobes_block_receiver
+{
+  public:
+    FOD_lobes_block_receiver (ReceiverType& receiver) : receiver (receiver) { }
+    bool operator() (const FOD_lobes_block& in)
+    {
+      for (FOD_lobes_block::const_iterator i = in.begin(); i != in.end(); ++i) {
+        if (!receiver (*i))
+          return false;
+      }
+      return true;
+    }
+  private:
+    ReceiverType& receiver;
+};
+
+
+
 template <class FODVoxelType, class MaskVoxelType = Image::Buffer<bool>::voxel_type >
 class FODQueueWriter
 {
@@ -223,15 +256,8 @@ class FODQueueWriter
 
     bool operator () (SH_coefs& out)
     {
-      if (!loop.ok())
+      if (!next())
         return false;
-      if (mask_vox_ptr) {
-        do {
-          Image::voxel_assign (*mask_vox_ptr, fod_vox, 0, 3);
-          if (!mask_vox_ptr->value())
-            loop.next (fod_vox);
-        } while (loop.ok() && !mask_vox_ptr->value());
-      }
       out.vox[0] = fod_vox[0]; out.vox[1] = fod_vox[1]; out.vox[2] = fod_vox[2];
       out.allocate (fod_vox.dim (3));
       for (fod_vox[3] = 0; fod_vox[3] != fod_vox.dim (3); ++fod_vox[3])
@@ -240,12 +266,43 @@ class FODQueueWriter
       return true;
     }
 
+    bool operator () (SH_coefs_block& out)
+    {
+      out.coefs.allocate (FMLS_BLOCK_SIZE, fod_vox.dim (3));
+      out.vox.clear();
+      while (out.size() != FMLS_BLOCK_SIZE && next()) {
+        const size_t row = out.size();
+        out.vox.push_back (Point<int> (fod_vox[0], fod_vox[1], fod_vox[2]));
+        for (fod_vox[3] = 0; fod_vox[3] != fod_vox.dim (3); ++fod_vox[3])
+          out.coefs (row, fod_vox[3]) = fod_vox.value();
+        loop.next (fod_vox);
+      }
+      if (!out.size())
+        return false;
+      out.coefs.resize (out.size(), fod_vox.dim (3));
+      return true;
+    }
+
 
   private:
     FODVoxelType fod_vox;
     Image::Loop loop;
     std::unique_ptr<MaskVoxelType> mask_vox_ptr;
 
+    // Advance to the next voxel within the mask; returns false once all voxels have been processed
+    bool next ()
+    {
+      if (mask_vox_ptr) {
+        while (loop.ok()) {
+          Image::voxel_assign (*mask_vox_ptr, fod_vox, 0, 3);
+          if (mask_vox_ptr->value())
+            break;
+          loop.next (fod_vox);
+        }
+      }
+      return loop.ok();
+    }
+
 };
 
 
@@ -257,6 +314,7 @@ class Segmenter {
     Segmenter (const DWI::Directions::Set&, const size_t);
 
     bool operator() (const SH_coefs&, FOD_lobes&) const;
+    bool operator() (const SH_coefs_block&, FOD_lobes_block&) const;
 
 
     float get_ratio_to_negative_lobe_integral  ()              const { return ratio_to_negative_lobe_integral; }
@@ -293,6 +351,8 @@ class Segmenter {
     bool  dilate_lookup_table; // If this is set, the lookup table created for each voxel will be dilated so that all directions correspond to the nearest positive non-zero FOD lobe
 
 
+    void segment (const float*, const Math::Vector<float>&, FOD_lobes&) const;
+
     void verify_settings() const
     {
       if (create_null_lobe && dilate_lookup_table)
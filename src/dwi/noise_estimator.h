@@ -45,17 +45,24 @@ namespace MR {
         NoiseEstimatorFunctor (InputVoxelType& dwi, OutputVoxelType& noise, const Math::Matrix<value_type>& SH2amp_mapping, int axis) :
           dwi (dwi),
           noise (noise),
+          A (SH2amp_mapping),
           axis (axis) {
 
-            Math::Matrix<value_type> iSH = Math::pinv (SH2amp_mapping);
-            Math::mult (H, SH2amp_mapping, iSH);
+            // The hat matrix H = A * iSH has rank equal to the number of SH coefficients, so the
+            // residuals are computed via the SH fit rather than using H itself, which would require
+            // O(N^2) operations per voxel for N volumes:
+            iSH = Math::pinv (A);
 
-            S.allocate (H.columns(), dwi.dim(axis));
+            S.allocate (A.rows(), dwi.dim(axis));
             R.allocate (S);
 
-            leverage.allocate (H.rows());
-            for (size_t n = 0; n < leverage.size(); ++n) 
-              leverage[n] = H(n,n) < 1.0 ? 1.0 / std::sqrt (1.0 - H(n,n)) : 1.0;
+            leverage.allocate (A.rows());
+            for (size_t n = 0; n < leverage.size(); ++n) {
+              value_type Hnn = 0.0;
+              for (size_t k = 0; k < A.columns(); ++k)
+                Hnn += A(n,k) * iSH(k,n);
+              leverage[n] = Hnn < 1.0 ? 1.0 / std::sqrt (1.0 - Hnn) : 1.0;
+            }
 
           }
 
@@ -65,7 +72,8 @@ namespace MR {
             for (dwi[3] = 0; dwi[3] < dwi.dim(3); ++dwi[3]) 
               S(dwi[3],dwi[axis]) = dwi.value();
 
-          Math::mult (R, CblasLeft, value_type(0.0), value_type(1.0), CblasUpper, H, S);
+          Math::mult (fit, iSH, S);
+          Math::mult (R, A, fit);
           R -= S;
 
           Image::voxel_assign (noise, pos);
@@ -78,7 +86,7 @@ namespace MR {
       protected:
         InputVoxelType dwi;
         OutputVoxelType noise;
-        Math::Matrix<value_type> H, S, R;
+        Math::Matrix<value_type> A, iSH, S, fit, R;
         Math::Vector<value_type> leverage;
         Sn_scale_estimator<value_type> scale_estimator;
         int axis;
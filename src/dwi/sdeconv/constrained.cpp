@@ -49,7 +49,13 @@ namespace MR
 
       + Option ("niter",
                 "the maximum number of iterations to perform for each voxel (default = 50).")
-      + Argument ("number").type_integer (1, 50, 1000);
+      + Argument ("number").type_integer (1, 50, 1000)
+
+      + Option ("warm_start",
+                "initialise the non-negativity constraint of each voxel from the converged "
+                "solution of the previous voxel along the same row of the image. This "
+                "reduces the number of iterations required, but may produce marginally "
+                "different results in voxels with multiple feasible solutions.");
 
 
   }
@@ -23,6 +23,10 @@
 #ifndef __dwi_sdeconv_constrained_h__
 #define __dwi_sdeconv_constrained_h__
 
+#include <algorithm>
+#include <iterator>
+#include <list>
+
 #include "app.h"
 #include "image/header.h"
 #include "dwi/gradient.h"
@@ -32,6 +36,12 @@
 
 #define NORM_LAMBDA_MULTIPLIER 0.0002
 
+// Number of Cholesky factorisations retained by CSDeconvBatch for reuse
+#define CSD_FACTORISATION_CACHE_SIZE 16
+
+// Maximum number of successive rank-1 updates applied to a factorisation before it is recomputed from scratch
+#define CSD_MAX_CHOLESKY_UPDATES 8
+
 namespace MR
 {
   namespace DWI
@@ -52,7 +62,8 @@ namespace MR
                 neg_lambda (1.0),
                 norm_lambda (1.0),
                 threshold (0.0),
-                niter (50)
+                niter (50),
+                warm_start (false)
             {
               grad = DWI::get_valid_DW_scheme<value_type> (dwi_header);
               // Discard b=0 (b=0 normalisation not supported in this version)
@@ -92,6 +103,9 @@ namespace MR
               opt = get_options ("niter");
               if (opt.size())
                 niter = opt[0][0];
+              opt = get_options ("warm_start");
+              if (opt.size())
+                warm_start = true;
             }
 
 
@@ -189,6 +203,7 @@ namespace MR
             std::vector<size_t> dwis;
             int lmax_response, lmax_data, lmax;
             size_t niter;
+            bool warm_start;
         };
 
 
@@ -295,6 +310,324 @@ namespace MR
     };
 
 
+
+
+    /*! Constrained spherical deconvolution of a batch of voxels.
+     *
+     * This implements the same algorithm as CSDeconv, but processes a tile of voxels
+     * (one voxel per row of the input matrix) at a time: the initialisation and the
+     * evaluation of the high-resolution amplitudes are performed as matrix-matrix
+     * products over all voxels still being iterated, and voxels are dropped from
+     * subsequent iterations as soon as their set of negative directions stops
+     * changing.
+     *
+     * The Cholesky factorisations for the most recently encountered sets of
+     * negative directions are cached. A set that has been seen before reuses its
+     * factorisation directly; otherwise, the factorisation is derived from that of
+     * the most similar cached set using rank-1 updates (directions entering the
+     * set) and downdates (directions leaving it), provided this is cheaper than
+     * factorising from scratch; a factorisation is recomputed from scratch once it
+     * has accumulated CSD_MAX_CHOLESKY_UPDATES such changes. The factorisations and
+     * the corresponding solves are performed in double precision. The FODs therefore
+     * match those of CSDeconv to within the rounding error of its single-precision
+     * factorisation, rather than bit for bit; in rare cases where the set of negative
+     * directions is marginal, this can affect which directions are constrained.
+     *
+     * If Shared::warm_start is set, the voxels of each batch are instead processed
+     * in sequence, with each voxel starting from the converged set of negative
+     * directions of the previous voxel in the batch (i.e. its neighbour along the
+     * scan line) rather than from the unconstrained initialisation. This reduces
+     * the number of iterations required, but may converge to a marginally
+     * different solution than the default scheme. */
+    template <typename T> class CSDeconvBatch
+    {
+      public:
+        typedef T value_type;
+        typedef typename CSDeconv<T>::Shared Shared;
+
+        CSDeconvBatch (const Shared& shared_data) :
+          shared (shared_data),
+          x (shared.HR_trans.columns()),
+          amps (shared.HR_trans.rows()),
+          HR_trans (shared.HR_trans),
+          solution (shared.HR_trans.columns()),
+          update_vector (shared.HR_trans.columns()) {
+            norm_lambda = NORM_LAMBDA_MULTIPLIER * shared.norm_lambda * shared.Mt_M (0,0);
+          }
+
+        CSDeconvBatch (const CSDeconvBatch& c) :
+          shared (c.shared),
+          norm_lambda (c.norm_lambda),
+          x (shared.HR_trans.columns()),
+          amps (shared.HR_trans.rows()),
+          HR_trans (c.HR_trans),
+          solution (shared.HR_trans.columns()),
+          update_vector (shared.HR_trans.columns()) { }
+
+
+        //! perform the deconvolution for each row of \a DW_signals
+        void operator() (const Math::Matrix<value_type>& DW_signals)
+        {
+          const size_t num_voxels = DW_signals.rows();
+          F.allocate (num_voxels, shared.nSH());
+          converged.assign (num_voxels, false);
+          if (!num_voxels)
+            return;
+
+          Math::mult (init_F, value_type (1.0), CblasNoTrans, DW_signals, CblasTrans, shared.rconv);
+          F.sub (0, num_voxels, 0, init_F.columns()) = init_F;
+          F.sub (0, num_voxels, init_F.columns(), F.columns()) = 0.0;
+          Math::mult (Mt_b, value_type (1.0), CblasNoTrans, DW_signals, CblasNoTrans, shared.M);
+
+          if (shared.warm_start)
+            run_sequential();
+          else
+            run_batched();
+        }
+
+        //! the FOD SH coefficients, one voxel per row
+        const Math::Matrix<value_type>& FODs () const { return F; }
+
+        //! whether the iteration converged for voxel \a n of the last batch
+        bool is_converged (size_t n) const { return converged[n]; }
+
+
+        const Shared& shared;
+
+      protected:
+        class Factorisation {
+          public:
+            std::vector<int> neg;
+            Math::Matrix<double> L;
+            size_t num_updates;
+        };
+
+        value_type norm_lambda;
+        Math::Matrix<value_type> F, init_F, Mt_b, active_F, HR_amps;
+        Math::Vector<value_type> x, amps;
+        // double-precision copy of shared.HR_trans, used to form the factorisations:
+        Math::Matrix<double> HR_trans, HR_T;
+        Math::Vector<double> solution, update_vector;
+        std::vector<std::vector<int> > old_neg;
+        std::vector<int> neg, added, removed;
+        std::vector<size_t> active;
+        std::vector<bool> converged;
+        std::list<Factorisation> cache;
+
+
+        void run_batched ()
+        {
+          const size_t num_voxels = F.rows();
+          old_neg.resize (num_voxels);
+          std::vector<bool> computed_once (num_voxels, false);
+          active.resize (num_voxels);
+          for (size_t v = 0; v < num_voxels; ++v)
+            active[v] = v;
+
+          for (size_t iter = 0; iter < shared.niter && active.size(); ++iter) {
+            active_F.allocate (active.size(), F.columns());
+            for (size_t n = 0; n < active.size(); ++n)
+              active_F.row (n) = F.row (active[n]);
+            Math::mult (HR_amps, value_type (1.0), CblasNoTrans, active_F, CblasTrans, shared.HR_trans);
+
+            size_t num_active = 0;
+            for (size_t n = 0; n < active.size(); ++n) {
+              const size_t v = active[n];
+              neg.clear();
+              for (size_t d = 0; d < HR_amps.columns(); ++d)
+                if (HR_amps (n, d) < shared.threshold)
+                  neg.push_back (d);
+
+              if (computed_once[v] && old_neg[v] == neg) {
+                converged[v] = true;
+                continue;
+              }
+
+              solve (v);
+              computed_once[v] = true;
+              old_neg[v] = neg;
+              active[num_active++] = v;
+            }
+            active.resize (num_active);
+          }
+        }
+
+
+        void run_sequential ()
+        {
+          std::vector<int> current_neg;
+          for (size_t v = 0; v < F.rows(); ++v) {
+            bool computed_once = false;
+            if (v && converged[v-1]) {
+              // warm start from the converged set of the previous voxel:
+              neg = current_neg;
+              solve (v);
+              computed_once = true;
+            }
+
+            for (size_t iter = computed_once ? 1 : 0; iter < shared.niter; ++iter) {
+              x = F.row (v);
+              Math::mult (amps, shared.HR_trans, x);
+              current_neg.swap (neg);
+              neg.clear();
+              for (size_t d = 0; d < amps.size(); ++d)
+                if (amps[d] < shared.threshold)
+                  neg.push_back (d);
+
+              if (computed_once && current_neg == neg) {
+                converged[v] = true;
+                break;
+              }
+
+              solve (v);
+              computed_once = true;
+            }
+            current_neg = neg;
+          }
+        }
+
+
+        // Solve for voxel v subject to the constraints in neg
+        void solve (const size_t v)
+        {
+          const Math::Matrix<double>& L (factorisation());
+          solution = Mt_b.row (v);
+          Math::Cholesky::solve (solution, L);
+          F.row (v) = solution;
+        }
+
+
+        // Obtain the Cholesky factorisation of the normal equations for the negative directions in neg
+        const Math::Matrix<double>& factorisation ()
+        {
+          const size_t nSH = shared.nSH();
+          // approximate cost of a full factorisation, relative to that of a single rank-1 update:
+          const size_t max_changes = neg.size() / 4 + nSH / 12 + 1;
+
+          typename std::list<Factorisation>::iterator nearest = cache.end();
+          size_t nearest_changes = max_changes;
+          for (typename std::list<Factorisation>::iterator i = cache.begin(); i != cache.end(); ++i) {
+            if (i->neg == neg) {
+              cache.splice (cache.begin(), cache, i);
+              return cache.front().L;
+            }
+            if (i->num_updates >= CSD_MAX_CHOLESKY_UPDATES)
+              continue;
+            const size_t changes = count_changes (i->neg, nearest_changes);
+            if (changes < nearest_changes) {
+              nearest = i;
+              nearest_changes = changes;
+            }
+          }
+
+          if (cache.size() < CSD_FACTORISATION_CACHE_SIZE)
+            cache.push_front (Factorisation());
+          else
+            cache.splice (cache.begin(), cache, --cache.end());
+          Factorisation& target (cache.front());
+
+          if (nearest != cache.end() && nearest != cache.begin()) {
+            target.L = nearest->L;
+            target.num_updates = nearest->num_updates + nearest_changes;
+            differences (nearest->neg);
+            if (apply_updates (target.L)) {
+              target.neg = neg;
+              return target.L;
+            }
+          }
+
+          try {
+            factorise (target.L);
+          }
+          catch (...) {
+            // don't leave an invalid factorisation in the cache:
+            cache.pop_front();
+            throw;
+          }
+          target.num_updates = 0;
+          target.neg = neg;
+          return target.L;
+        }
+
+
+        // The number of directions that differ between neg and the sorted list \a other, up to \a limit
+        size_t count_changes (const std::vector<int>& other, const size_t limit) const
+        {
+          size_t changes = 0;
+          std::vector<int>::const_iterator a = neg.begin(), b = other.begin();
+          while (changes < limit && (a != neg.end() || b != other.end())) {
+            if (b == other.end() || (a != neg.end() && *a < *b)) { ++a; ++changes; }
+            else if (a == neg.end() || *b < *a) { ++b; ++changes; }
+            else { ++a; ++b; }
+          }
+          return changes;
+        }
+
+
+        // Fill added & removed with the directions entering / leaving neg relative to \a other
+        void differences (const std::vector<int>& other)
+        {
+          added.clear();
+          removed.clear();
+          std::set_difference (neg.begin(), neg.end(), other.begin(), other.end(), std::back_inserter (added));
+          std::set_difference (other.begin(), other.end(), neg.begin(), neg.end(), std::back_inserter (removed));
+        }
+
+
+        // Apply updates for the directions in added, then downdates for those in removed;
+        //   returns false if a downdate fails due to loss of precision
+        bool apply_updates (Math::Matrix<double>& L)
+        {
+          for (size_t n = 0; n < added.size(); ++n) {
+            update_vector = HR_trans.row (added[n]);
+            Math::Cholesky::update (L, update_vector);
+          }
+          for (size_t n = 0; n < removed.size(); ++n) {
+            update_vector = HR_trans.row (removed[n]);
+            if (!Math::Cholesky::downdate (L, update_vector))
+              return false;
+          }
+          return true;
+        }
+
+
+        // Full Cholesky factorisation of the normal equations for the negative directions in neg
+        void factorise (Math::Matrix<double>& work)
+        {
+          work.allocate (shared.Mt_M.rows(), shared.Mt_M.columns());
+          for (size_t i = 0; i < work.rows(); i++)
+            for (size_t j = 0; j <= i; j++)
+              work (i,j) = shared.Mt_M (i,j);
+
+          // min-norm constraint:
+          if (norm_lambda) {
+#ifndef USE_NON_ORTHONORMAL_SH_BASIS
+            work.diagonal() += norm_lambda;
+#else
+            int l = 0;
+            for (size_t i = 0; i < work.rows(); ++i) {
+              if (Math::SH::index (l,0) == i) {
+                work(i,i) += norm_lambda;
+                l+=2;
+              }
+              else
+                work(i,i) += 0.5 * norm_lambda;
+            }
+#endif
+          }
+
+          if (neg.size()) {
+            HR_T.allocate (neg.size(), HR_trans.columns());
+            for (size_t i = 0; i < neg.size(); i++)
+              HR_T.row (i) = HR_trans.row (neg[i]);
+            rankN_update (work, HR_T, CblasTrans, CblasLower, 1.0, 1.0);
+          }
+
+          Math::Cholesky::decomp (work);
+        }
+    };
+
+
   }
 }
 
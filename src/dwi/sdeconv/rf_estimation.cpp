@@ -115,50 +115,142 @@ void SFThresholds::update (const std::vector<FODSegResult>& data, const float di
 
 
 
-bool FODCalcAndSeg::operator() (const Image::Iterator& pos)
+class PackedSignals::Loader
 {
-  if (!Image::Nav::get_value_at_pos (mask, pos))
-    return true;
+  public:
+    Loader (Image::BufferPreload<float>& dwi,
+            Image::BufferScratch<bool>& mask,
+            const std::vector<size_t>& dwis,
+            const size_t inner_axis,
+            std::vector< Point<int> >& vox,
+            std::vector<float>& values) :
+        in (dwi),
+        mask (mask),
+        dwis (dwis),
+        inner_axis (inner_axis),
+        vox (vox),
+        values (values),
+        mutex (new std::mutex) { }
+
+    void operator() (const Image::Iterator& pos)
+    {
+      Image::voxel_assign (in, pos);
+      Image::voxel_assign (mask, pos);
+      row_vox.clear();
+      row_values.clear();
+      for (ssize_t i = 0; i < mask.dim (inner_axis); ++i) {
+        mask[inner_axis] = in[inner_axis] = i;
+        if (!mask.value())
+          continue;
+        // Voxels with non-finite data are excluded, as they cannot be deconvolved
+        const size_t offset = row_values.size();
+        size_t n;
+        for (n = 0; n != dwis.size(); ++n) {
+          in[3] = dwis[n];
+          const float value = in.value();
+          if (!std::isfinite (value))
+            break;
+          row_values.push_back (value < 0.0 ? 0.0 : value);
+        }
+        if (n == dwis.size())
+          row_vox.push_back (Point<int> (in[0], in[1], in[2]));
+        else
+          row_values.resize (offset);
+      }
+      std::lock_guard<std::mutex> lock (*mutex);
+      vox.insert (vox.end(), row_vox.begin(), row_vox.end());
+      values.insert (values.end(), row_values.begin(), row_values.end());
+    }
 
-  Image::Nav::set_pos (in, pos, 0, 3);
+  private:
+    Image::BufferPreload<float>::voxel_type in;
+    Image::BufferScratch<bool>::voxel_type mask;
+    const std::vector<size_t>& dwis;
+    const size_t inner_axis;
+    std::vector< Point<int> >& vox;
+    std::vector<float>& values;
+    std::shared_ptr<std::mutex> mutex;
+    std::vector< Point<int> > row_vox;
+    std::vector<float> row_values;
+};
 
-  // Load the raw DWI data
-  Math::Vector<float> dwi_data (csd.shared.dwis.size());
-  for (size_t n = 0; n < csd.shared.dwis.size(); n++) {
-    in[3] = csd.shared.dwis[n];
-    dwi_data[n] = in.value();
-    if (!std::isfinite (dwi_data[n]))
-      return true;
-    if (dwi_data[n] < 0.0)
-      dwi_data[n] = 0.0;
+
+
+PackedSignals::PackedSignals (const Image::Header& H, Image::BufferScratch<bool>& mask, const std::vector<size_t>& dwis)
+{
+  // The image data are only required until they have been packed
+  Image::BufferPreload<float> dwi (H, Image::Stride::contiguous_along_axis (3));
+
+  std::vector< Point<int> > unsorted_vox;
+  std::vector<float> values;
+  {
+    Image::ThreadedLoop loop ("loading DWI data... ", mask, 0, 3);
+    Loader loader (dwi, mask, dwis, loop.inner_axes()[0], unsorted_vox, values);
+    loop.run_outer (loader);
   }
-  csd.set (dwi_data);
 
-  // Perform CSD
+  // Rows are sorted by voxel position, such that the outcome does not depend on thread scheduling
+  std::vector<size_t> order (unsorted_vox.size());
+  for (size_t i = 0; i != order.size(); ++i)
+    order[i] = i;
+  std::sort (order.begin(), order.end(), [&] (const size_t a, const size_t b) {
+    const Point<int>& p (unsorted_vox[a]), &q (unsorted_vox[b]);
+    return p[2] < q[2] || (p[2] == q[2] && (p[1] < q[1] || (p[1] == q[1] && p[0] < q[0])));
+  });
+
+  vox.reserve (order.size());
+  signals.allocate (order.size(), dwis.size());
+  for (size_t row = 0; row != order.size(); ++row) {
+    vox.push_back (unsorted_vox[order[row]]);
+    const float* const source = &values[order[row] * dwis.size()];
+    for (size_t n = 0; n != dwis.size(); ++n)
+      signals (row, n) = source[n];
+  }
+}
+
+
+
+
+
+bool FODCalcAndSeg::operator() (const CandidateBlock& in)
+{
+  signals.allocate (in.size(), data.get_signals().columns());
+  for (size_t n = 0; n != in.size(); ++n)
+    signals.row (n) = data.get_signals().row (in[n]);
+
+  coefs.coefs.allocate (in.size(), csd.shared.nSH());
+  coefs.vox.clear();
+  indices.clear();
+
+  // Perform CSD; voxels that do not converge are excluded
   try {
-    size_t n;
-    for (n = 0; n < csd.shared.niter; n++)
-      if (csd.iterate())
-        break;
-    if (n == csd.shared.niter)
-      return true;
+    csd (signals);
+    for (size_t n = 0; n != in.size(); ++n)
+      add_converged (n, in[n]);
   } catch (...) {
-    return true;
+    // A failure aborts deconvolution of the whole block; process each voxel in turn
+    //   so that only those voxels responsible are excluded
+    coefs.vox.clear();
+    indices.clear();
+    Math::Matrix<float> single (1, signals.columns());
+    for (size_t n = 0; n != in.size(); ++n) {
+      single.row (0) = signals.row (n);
+      try {
+        csd (single);
+        add_converged (0, in[n]);
+      } catch (...) { }
+    }
   }
+  coefs.coefs.resize (coefs.size(), coefs.coefs.columns());
 
   // Perform FOD segmentation
-  DWI::FMLS::SH_coefs coefs (csd.FOD());
-  coefs.vox[0] = pos[0]; coefs.vox[1] = pos[1]; coefs.vox[2] = pos[2];
-  DWI::FMLS::FOD_lobes lobes;
   (*fmls) (coefs, lobes);
-  if (lobes.empty())
-    return true;
 
   // Summarise the results of FOD segmentation and store
-  const FODSegResult result (lobes);
-  {
-    std::lock_guard<std::mutex> lock (*mutex);
-    output.push_back (result);
+  std::lock_guard<std::mutex> lock (*mutex);
+  for (size_t n = 0; n != lobes.size(); ++n) {
+    if (!lobes[n].empty())
+      output.push_back (FODSegResult (lobes[n], indices[n]));
   }
 
   return true;
@@ -166,13 +258,24 @@ bool FODCalcAndSeg::operator() (const Image::Iterator& pos)
 
 
 
+void FODCalcAndSeg::add_converged (const size_t row, const size_t index)
+{
+  if (!csd.is_converged (row))
+    return;
+  coefs.coefs.row (coefs.size()) = csd.FODs().row (row);
+  coefs.vox.push_back (data.get_vox (index));
+  indices.push_back (index);
+}
+
+
+
 
 bool SFSelector::operator() (FODSegResult& out)
 {
   while (it != input.end()) {
     if (it->is_sf (thresholds)) {
       out = *it;
-      Image::Nav::set_value_at_pos (output, it->get_vox(), true);
+      output.push_back (it->get_index());
       ++it;
       return true;
     }
@@ -186,16 +289,8 @@ bool SFSelector::operator() (FODSegResult& out)
 
 bool ResponseEstimator::operator() (const FODSegResult& in)
 {
-  Image::Nav::set_pos (dwi, in.get_vox(), 0, 3);
-
-  // Load the raw DWI data
-  Math::Vector<float> dwi_data (shared.dwis.size());
-  for (size_t n = 0; n < shared.dwis.size(); n++) {
-    dwi[3] = shared.dwis[n];
-    dwi_data[n] = dwi.value();
-    if (dwi_data[n] < 0.0)
-      dwi_data[n] = 0.0;
-  }
+  // The DWI data have already been loaded & clamped to be non-negative
+  const Math::Vector<float> dwi_data (data.get_signals().row (in.get_index()));
 
   // Rotate the diffusion gradient orientations into a new reference frame,
   //   where the Z direction is defined by the FOD peak
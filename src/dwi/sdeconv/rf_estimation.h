@@ -22,7 +22,9 @@
 
 
 
+#include <algorithm>
 #include <limits>
+#include <mutex>
 #include <vector>
 
 #include "exception.h"
@@ -37,6 +39,7 @@
 #include "image/iterator.h"
 #include "image/nav.h"
 #include "image/position.h"
+#include "image/threaded_loop.h"
 #include "image/value.h"
 
 #include "math/matrix.h"
@@ -52,6 +55,11 @@
 
 
 
+// Number of candidate voxels processed together by the CSD & FOD segmentation engines
+#define RF_ESTIMATION_BLOCK_SIZE 256
+
+
+
 namespace MR {
 namespace DWI {
 namespace RF {
@@ -60,6 +68,7 @@ namespace RF {
 
 class SFThresholds;
 class FODSegResult;
+class PackedSignals;
 
 
 
@@ -90,8 +99,9 @@ class SFThresholds
 class FODSegResult
 {
   public:
-    FODSegResult (const DWI::FMLS::FOD_lobes& lobes) :
+    FODSegResult (const DWI::FMLS::FOD_lobes& lobes, const size_t index) :
         vox (lobes.vox),
+        index (index),
         peak_dir (lobes[0].get_peak_dir()),
         integral (lobes[0].get_integral()),
         dispersion (integral / lobes[0].get_peak_value())
@@ -103,11 +113,12 @@ class FODSegResult
       volume_ratio = sum_integrals / lobes[0].get_integral();
     }
 
-    FODSegResult() : vox (), peak_dir (), integral (NAN), dispersion (NAN), volume_ratio (NAN) { }
+    FODSegResult() : vox (), index (0), peak_dir (), integral (NAN), dispersion (NAN), volume_ratio (NAN) { }
 
     bool is_sf (const SFThresholds& thresholds) const;
 
     const Point<int>&   get_vox()      const { return vox; }
+    size_t              get_index()    const { return index; }
     const Point<float>& get_peak_dir() const { return peak_dir; }
 
     float get_integral()     const { return integral; }
@@ -117,6 +128,7 @@ class FODSegResult
 
   private:
     Point<int> vox;
+    size_t index; // Row of the voxel within the PackedSignals
     Point<float> peak_dir;
     float integral, dispersion, volume_ratio;
 
@@ -126,17 +138,68 @@ class FODSegResult
 
 
 
+// The DWI signals of all voxels within the initial mask, with one voxel per row
+// These are read from the image once; all iterations of response function
+//   estimation then operate on (subsets of) the rows of this matrix
+class PackedSignals
+{
+  public:
+    PackedSignals (const Image::Header&, Image::BufferScratch<bool>&, const std::vector<size_t>&);
+
+    size_t size() const { return vox.size(); }
+
+    const Math::Matrix<float>& get_signals() const { return signals; }
+    const Point<int>& get_vox (const size_t index) const { return vox[index]; }
+
+  private:
+    std::vector< Point<int> > vox;
+    Math::Matrix<float> signals;
+
+    class Loader;
+};
+
+
+
+
+
+// A set of candidate voxels, identified by their rows within the PackedSignals
+class CandidateBlock : public std::vector<size_t> { };
+
+class CandidateSource
+{
+  public:
+    CandidateSource (const std::vector<size_t>& candidates) :
+        candidates (candidates),
+        next (0) { }
+
+    bool operator() (CandidateBlock& out)
+    {
+      if (next == candidates.size())
+        return false;
+      const size_t count = std::min (size_t(RF_ESTIMATION_BLOCK_SIZE), candidates.size() - next);
+      out.assign (candidates.begin() + next, candidates.begin() + next + count);
+      next += count;
+      return true;
+    }
+
+  private:
+    const std::vector<size_t>& candidates;
+    size_t next;
+};
+
+
+
+
+
 class FODCalcAndSeg
 {
   public:
-    FODCalcAndSeg (Image::BufferPreload<float>& dwi,
-               Image::BufferScratch<bool>& mask,
+    FODCalcAndSeg (const PackedSignals& data,
                const DWI::CSDeconv<float>::Shared& csd_shared,
                const DWI::Directions::Set& dirs,
                const size_t lmax,
                std::vector<FODSegResult>& output) :
-        in (dwi),
-        mask (mask),
+        data (data),
         csd (csd_shared),
         fmls (new DWI::FMLS::Segmenter (dirs, lmax)),
         lmax (lmax),
@@ -157,8 +220,7 @@ class FODCalcAndSeg
 
 
     FODCalcAndSeg (const FODCalcAndSeg& that) :
-        in         (that.in),
-        mask       (that.mask),
+        data       (that.data),
         csd        (that.csd),
         fmls       (that.fmls),
         lmax       (that.lmax),
@@ -168,19 +230,25 @@ class FODCalcAndSeg
     ~FODCalcAndSeg() { }
 
 
-    bool operator() (const Image::Iterator& pos);
+    bool operator() (const CandidateBlock&);
 
 
   private:
-    Image::BufferPreload<float>::voxel_type in;
-    Image::BufferScratch<bool>::voxel_type mask;
-    DWI::CSDeconv<float> csd;
+    const PackedSignals& data;
+    DWI::CSDeconvBatch<float> csd;
     std::shared_ptr<DWI::FMLS::Segmenter> fmls;
     const size_t lmax;
     std::vector<FODSegResult>& output;
 
     std::shared_ptr<std::mutex> mutex;
 
+    Math::Matrix<float> signals;
+    DWI::FMLS::SH_coefs_block coefs;
+    DWI::FMLS::FOD_lobes_block lobes;
+    std::vector<size_t> indices;
+
+    void add_converged (const size_t, const size_t);
+
 };
 
 
@@ -192,11 +260,11 @@ class SFSelector
   public:
     SFSelector (const std::vector<FODSegResult>& results,
                 const SFThresholds& thresholds,
-                Image::BufferScratch<bool>& output_mask) :
+                std::vector<size_t>& selection) :
         input (results),
         thresholds (thresholds),
         it (input.begin()),
-        output (output_mask) { }
+        output (selection) { }
 
     SFSelector (const SFSelector& that) :
         input (that.input),
@@ -214,7 +282,7 @@ class SFSelector
     const SFThresholds& thresholds;
 
     std::vector<FODSegResult>::const_iterator it;
-    Image::BufferScratch<bool>::voxel_type output;
+    std::vector<size_t>& output;
 
 };
 
@@ -268,18 +336,18 @@ class ResponseEstimator
 {
 
   public:
-    ResponseEstimator (Image::BufferPreload<float>& dwi_data,
+    ResponseEstimator (const PackedSignals& data,
                        const DWI::CSDeconv<float>::Shared& csd_shared,
                        const size_t lmax,
                        Response& output) :
-        dwi (dwi_data),
+        data (data),
         shared (csd_shared),
         lmax (lmax),
         output (output),
         mutex (new std::mutex()) { }
 
     ResponseEstimator (const ResponseEstimator& that) :
-        dwi (that.dwi),
+        data (that.data),
         shared (that.shared),
         lmax (that.lmax),
         output (that.output),
@@ -291,7 +359,7 @@ class ResponseEstimator
 
 
   private:
-    Image::BufferPreload<float>::voxel_type dwi;
+    const PackedSignals& data;
     const DWI::CSDeconv<float>::Shared& shared;
     const size_t lmax;
     Response& output;
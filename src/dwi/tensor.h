@@ -86,6 +86,72 @@ namespace MR
              T (0.0);
     }
 
+
+    //! \cond skip
+    namespace
+    {
+      // Jacobi rotation annihilating element (p,q) of the symmetric 3x3 matrix with diagonal
+      //   elements d, and off-diagonal elements o (with o[r] holding the element not in row or
+      //   column r); the rotation is accumulated in the columns of v
+      inline void jacobi_rotate (double* d, double* o, double (*v)[3], const size_t p, const size_t q)
+      {
+        const size_t r = 3 - p - q;
+        const double apq = o[r];
+        if (apq == 0.0)
+          return;
+        const double theta = (d[q] - d[p]) / (2.0 * apq);
+        const double t = std::abs (theta) > 1.0e100 ?
+                         0.5 / theta :
+                         (theta < 0.0 ? -1.0 : 1.0) / (std::abs (theta) + std::sqrt (theta*theta + 1.0));
+        const double c = 1.0 / std::sqrt (t*t + 1.0), s = t * c;
+        d[p] -= t * apq;
+        d[q] += t * apq;
+        o[r] = 0.0;
+        const double arp = o[q], arq = o[p];
+        o[q] = c*arp - s*arq;
+        o[p] = s*arp + c*arq;
+        for (size_t k = 0; k < 3; ++k) {
+          const double vkp = v[k][p], vkq = v[k][q];
+          v[k][p] = c*vkp - s*vkq;
+          v[k][q] = s*vkp + c*vkq;
+        }
+      }
+    }
+    //! \endcond
+
+
+    //! eigen-decomposition of the tensor \a t, using cyclic Jacobi rotations
+    /*! The eigenvalues are stored in \a eval in ascending order. If \a evec is
+     * non-null, the corresponding unit eigenvectors are stored in its columns
+     * (as a row-major 3x3 matrix). The computation is performed in double precision. */
+    template <typename T> inline void tensor2eig (const T* t, T* eval, T* evec = nullptr)
+    {
+      double d[3] = { t[0], t[1], t[2] };
+      double o[3] = { t[5], t[4], t[3] };
+      double v[3][3] = { { 1.0, 0.0, 0.0 }, { 0.0, 1.0, 0.0 }, { 0.0, 0.0, 1.0 } };
+      const double norm = d[0]*d[0] + d[1]*d[1] + d[2]*d[2] + 2.0 * (o[0]*o[0] + o[1]*o[1] + o[2]*o[2]);
+
+      // convergence is quadratic, so this limit is never reached in practice:
+      for (size_t sweep = 0; sweep < 50; ++sweep) {
+        if (o[0]*o[0] + o[1]*o[1] + o[2]*o[2] <= 1.0e-30 * norm)
+          break;
+        jacobi_rotate (d, o, v, 0, 1);
+        jacobi_rotate (d, o, v, 0, 2);
+        jacobi_rotate (d, o, v, 1, 2);
+      }
+
+      size_t order[3] = { 0, 1, 2 };
+      if (d[order[1]] < d[order[0]]) std::swap (order[0], order[1]);
+      if (d[order[2]] < d[order[1]]) std::swap (order[1], order[2]);
+      if (d[order[1]] < d[order[0]]) std::swap (order[0], order[1]);
+      for (size_t i = 0; i < 3; ++i) {
+        eval[i] = d[order[i]];
+        if (evec)
+          for (size_t k = 0; k < 3; ++k)
+            evec[3*k+i] = v[k][order[i]];
+      }
+    }
+
   }
 }
 
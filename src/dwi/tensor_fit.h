@@ -0,0 +1,151 @@
+/*
+    Copyright 2008 Brain Research Institute, Melbourne, Australia
+
+    This file is part of MRtrix.
+
+    MRtrix is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    MRtrix is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with MRtrix.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __dwi_tensor_fit_h__
+#define __dwi_tensor_fit_h__
+
+#include "math/matrix.h"
+
+namespace MR
+{
+  namespace DWI
+  {
+
+    //! \cond skip
+    namespace
+    {
+      // Solve A*x = b in place for a small symmetric positive definite system of fixed size,
+      //   using the lower triangle of A; returns false if A is not positive definite
+      template <size_t N, typename T> inline bool solve_fixed_size (T (&A)[N][N], T (&b)[N])
+      {
+        for (size_t j = 0; j < N; ++j) {
+          T d = A[j][j];
+          for (size_t k = 0; k < j; ++k)
+            d -= A[j][k] * A[j][k];
+          if (!(d > T (0.0)))
+            return false;
+          A[j][j] = std::sqrt (d);
+          for (size_t i = j+1; i < N; ++i) {
+            T s = A[i][j];
+            for (size_t k = 0; k < j; ++k)
+              s -= A[i][k] * A[j][k];
+            A[i][j] = s / A[j][j];
+          }
+        }
+        for (size_t i = 0; i < N; ++i) {
+          for (size_t k = 0; k < i; ++k)
+            b[i] -= A[i][k] * b[k];
+          b[i] /= A[i][i];
+        }
+        for (size_t i = N; i-- > 0;) {
+          for (size_t k = i+1; k < N; ++k)
+            b[i] -= A[k][i] * b[k];
+          b[i] /= A[i][i];
+        }
+        return true;
+      }
+    }
+    //! \endcond
+
+
+
+    /*! Weighted least-squares fit of the diffusion tensor for a batch of voxels.
+     *
+     * This performs iteratively reweighted log-linear least-squares fitting, with
+     * the weight of each measurement given by its squared predicted signal. Each
+     * voxel occupies one row of the input and output matrices. For each iteration,
+     * the 7x7 normal equations of all voxels are formed using two matrix-matrix
+     * products: one between the weights and the precomputed pairwise products of
+     * the b-matrix columns (yielding the 28 unique elements of each voxel's
+     * system), and one between the weighted log-signals and the b-matrix. Each
+     * system is then solved using a fixed-size Cholesky decomposition.
+     *
+     * The b-matrix is as produced by grad2bmatrix(), and the log-signals are the
+     * negated logarithm of the DW signals, such that the tensor coefficients (with
+     * the log of the b=0 signal in the last element) are the unweighted solution of
+     * bmatrix * tensor = logsignals. */
+    template <typename ValueType> class WLSTensorFit
+    {
+      public:
+        typedef ValueType value_type;
+
+        WLSTensorFit (const Math::Matrix<value_type>& b_matrix, const size_t iterations = 2) :
+          bmatrix (b_matrix),
+          products (b_matrix.rows(), 28),
+          iterations (iterations)
+        {
+          assert (bmatrix.columns() == 7);
+          for (size_t i = 0; i < bmatrix.rows(); ++i) {
+            size_t n = 0;
+            for (size_t j = 0; j < 7; ++j)
+              for (size_t k = 0; k <= j; ++k)
+                products (i, n++) = bmatrix (i,j) * bmatrix (i,k);
+          }
+        }
+
+
+        //! refine the estimates in \a tensors (one voxel per row, 7 columns) given the \a logsignals
+        /*! \a tensors should be initialised with the unweighted (log-linear) estimates. */
+        void operator() (const Math::Matrix<value_type>& logsignals, Math::Matrix<value_type>& tensors)
+        {
+          assert (tensors.rows() == logsignals.rows());
+          assert (logsignals.columns() == bmatrix.rows());
+          if (!tensors.rows())
+            return;
+
+          weighted_logsignals.allocate (logsignals.rows(), logsignals.columns());
+          for (size_t iter = 0; iter < iterations; ++iter) {
+            Math::mult (weights, value_type (1.0), CblasNoTrans, tensors, CblasTrans, bmatrix);
+            for (size_t v = 0; v < weights.rows(); ++v) {
+              for (size_t i = 0; i < weights.columns(); ++i) {
+                weights (v,i) = std::exp (value_type (-2.0) * weights (v,i));
+                weighted_logsignals (v,i) = weights (v,i) * logsignals (v,i);
+              }
+            }
+            Math::mult (normal, value_type (1.0), CblasNoTrans, weights, CblasNoTrans, products);
+            Math::mult (rhs, value_type (1.0), CblasNoTrans, weighted_logsignals, CblasNoTrans, bmatrix);
+
+            for (size_t v = 0; v < tensors.rows(); ++v) {
+              value_type A[7][7], b[7];
+              size_t n = 0;
+              for (size_t j = 0; j < 7; ++j) {
+                for (size_t k = 0; k <= j; ++k)
+                  A[j][k] = normal (v, n++);
+                b[j] = rhs (v,j);
+              }
+              // leave the previous estimate in place if the weights are degenerate:
+              if (solve_fixed_size (A, b))
+                for (size_t j = 0; j < 7; ++j)
+                  tensors (v,j) = b[j];
+            }
+          }
+        }
+
+      protected:
+        const Math::Matrix<value_type>& bmatrix;
+        Math::Matrix<value_type> products, weights, weighted_logsignals, normal, rhs;
+        const size_t iterations;
+    };
+
+  }
+}
+
+#endif
+
@@ -24,6 +24,7 @@
 #include "dwi/tractography/SIFT/gradient_sort.h"
 
 #include <algorithm>
+#include <cmath>
 
 #include "thread_queue.h"
 
@@ -41,46 +42,54 @@ namespace MR
 
 
 
-      MT_gradient_vector_sorter::MT_gradient_vector_sorter (MT_gradient_vector_sorter::VecType& in, const track_t block_size)
+      MT_gradient_vector_sorter::MT_gradient_vector_sorter (MT_gradient_vector_sorter::VecType& in) :
+          exhausted (in.size(), 0.0, 0.0)
       {
+        const track_t block_size = std::max (track_t(SIFT_GRADIENT_SORT_MIN_BLOCK_SIZE), track_t(std::ceil (in.size() / double(Thread::number_of_threads()))));
         BlockSender source (in.size(), block_size);
-        Sorter      pipe   (in);
-        Thread::run_queue (source, TrackIndexRange(), Thread::multi (pipe), VecItType(), *this);
+        Selector    pipe   (in);
+        Thread::run_queue (source, TrackIndexRange(), Thread::multi (pipe), Block(), *this);
       }
 
 
 
 
-      MT_gradient_vector_sorter::VecItType MT_gradient_vector_sorter::get()
+      const Cost_fn_gradient_sort& MT_gradient_vector_sorter::get()
       {
-        VecItType return_iterator (*candidates.begin());
-        VecItType incremented (*candidates.begin());
-        ++incremented;
-        candidates.erase (candidates.begin());
-        candidates.insert (incremented);
-        return return_iterator;
+        if (candidates.empty())
+          return exhausted;
+        Block block (candidates.top());
+        candidates.pop();
+        const Cost_fn_gradient_sort& result (*block.next);
+        if (++block.next == block.sorted_end)
+          select_batch (block);
+        if (block.next != block.negative_end)
+          candidates.push (block);
+        return result;
       }
 
 
 
-      bool MT_gradient_vector_sorter::Sorter::operator() (const TrackIndexRange& in, VecItType& out) const
+      void MT_gradient_vector_sorter::select_batch (Block& block)
       {
-        VecItType start      (data.begin() + in.first);
-        VecItType from_end   (data.begin() + in.second);
-        VecItType from_start (start);
-        for (; from_start < from_end; ++from_start) {
-          if (from_start->get_gradient_per_unit_length() >= 0.0) {
-            for (--from_end; from_end > from_start && from_end->get_gradient_per_unit_length() >= 0.0; --from_end);
-            std::swap (*from_start, *from_end);
-          }
-        }
-        std::sort (start, from_start);
-        out = start;
-        return true;
+        block.batch_size = block.batch_size ? (2 * block.batch_size) : SIFT_GRADIENT_SORT_INITIAL_BATCH_SIZE;
+        block.sorted_end = (size_t(block.negative_end - block.next) > block.batch_size) ? (block.next + block.batch_size) : block.negative_end;
+        std::nth_element (block.next, block.sorted_end, block.negative_end);
+        std::sort (block.next, block.sorted_end);
       }
 
 
 
+      bool MT_gradient_vector_sorter::Selector::operator() (const TrackIndexRange& in, Block& out) const
+      {
+        const VecItType start (data.begin() + in.first);
+        out.negative_end = std::partition (start, data.begin() + in.second, [] (const Cost_fn_gradient_sort& i) { return (i.get_gradient_per_unit_length() < 0.0); });
+        out.next = start;
+        out.batch_size = 0;
+        select_batch (out);
+        return true;
+      }
+
 
 
 
@@ -26,7 +26,7 @@
 #define __dwi_tractography_sift_sort_h__
 
 
-#include <set>
+#include <queue>
 #include <vector>
 
 #include "dwi/tractography/SIFT/track_index_range.h"
@@ -45,6 +45,12 @@ namespace MR
 
 
 
+#define SIFT_GRADIENT_SORT_MIN_BLOCK_SIZE 10000
+#define SIFT_GRADIENT_SORT_INITIAL_BATCH_SIZE 1000
+
+
+
+
       class Cost_fn_gradient_sort
       {
         public:
@@ -75,44 +81,54 @@ namespace MR
 
 
 
-      // Sorting of the gradient vector in SIFT is done in a multi-threaded fashion, in a number of stages:
-      // * Gradient vector is split into blocks of equal size
-      // * Within each block:
-      //     - Non-negative gradients are pushed to the end of the block (no need to sort these)
-      //     - Negative gradients within the block are sorted fully
-      //     - An iterator to the first entry in the sorted block is written to a set
-      // * For streamline filtering, the candidate streamline is chosen from the beginning of this set.
-      //     The entry in the set corresponding to the gradient vector is removed, but the iterator WITHIN THE BLOCK
-      //     is incremented and re-written to the set; this allows multiple streamlines from a single block to
-      //     be filtered in a single iteration, provided the gradient is less than that of the candidate streamline
-      //     from all other blocks
+      // Selection of candidate streamlines in SIFT is done in a multi-threaded fashion, without ever sorting
+      //   the full gradient vector:
+      // * Gradient vector is split into one contiguous block per thread
+      // * Within each block (in parallel):
+      //     - Non-negative gradients are pushed to the end of the block (these are never candidates)
+      //     - The smallest few negative gradients are selected using std::nth_element(), and only these are sorted
+      // * For streamline filtering, the candidate streamline is chosen by a k-way merge of the blocks,
+      //     using a heap keyed on the next sorted entry of each block. Once a block's sorted entries are exhausted,
+      //     the next (twice as large) batch of its remaining negative gradients is selected and sorted on demand.
+      // The cost of each iteration is therefore proportional to the size of the gradient vector plus the number of
+      //   candidates actually requested, rather than to a full sort of all negative gradients.
       class MT_gradient_vector_sorter
       {
 
           typedef std::vector<Cost_fn_gradient_sort> VecType;
           typedef VecType::iterator VecItType;
 
-          class Comparator {
+          class Block
+          {
             public:
-              bool operator() (const VecItType& a, const VecItType& b) const { return (a->get_gradient_per_unit_length() < b->get_gradient_per_unit_length()); }
+              Block () : batch_size (0) { }
+              VecItType next, sorted_end, negative_end;
+              size_t batch_size;
+              // Reversed, such that the std::priority_queue presents the smallest gradient first
+              bool operator< (const Block& that) const { return (that.next->get_gradient_per_unit_length() < next->get_gradient_per_unit_length()); }
           };
-          typedef std::set<VecItType, Comparator> SetType;
 
 
         public:
-          MT_gradient_vector_sorter (VecType& in, const track_t);
+          MT_gradient_vector_sorter (VecType&);
 
-          VecItType get();
+          // Returns the remaining entry with the most negative gradient per unit length; once all
+          //   negative gradients have been returned, an entry with zero gradient is returned
+          const Cost_fn_gradient_sort& get();
 
-          bool operator() (const VecItType& in)
+          bool operator() (const Block& in)
           {
-            candidates.insert (in);
+            if (in.next != in.negative_end)
+              candidates.push (in);
             return true;
           }
 
 
         private:
-          SetType candidates;
+          std::priority_queue<Block> candidates;
+          const Cost_fn_gradient_sort exhausted;
+
+          static void select_batch (Block&);
 
 
           class BlockSender
@@ -138,14 +154,14 @@ namespace MR
               track_t counter;
           };
 
-          class Sorter
+          class Selector
           {
             public:
-              Sorter (VecType& in) :
+              Selector (VecType& in) :
                 data  (in) { }
-              Sorter (const Sorter& that) :
+              Selector (const Selector& that) :
                 data  (that.data) { }
-              bool operator() (const TrackIndexRange&, VecItType&) const;
+              bool operator() (const TrackIndexRange&, Block&) const;
             private:
               VecType& data;
           };
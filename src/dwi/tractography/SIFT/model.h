@@ -75,15 +75,19 @@ namespace MR
         public:
           template <class Set>
           Model (Set& dwi, const DWI::Directions::FastLookupSet& dirs) :
-              ModelBase<Fixel> (dwi, dirs)
+              ModelBase<Fixel> (dwi, dirs),
+              out_of_core (false)
           {
             Track_fixel_contribution::set_scaling (dwi);
           }
           Model (const Model& that) = delete;
 
-          virtual ~Model ();
+          virtual ~Model () { }
 
 
+          // Store the streamline contributions in a scratch file rather than in RAM; must be set before map_streamlines()
+          void set_out_of_core (const bool i) { out_of_core = i; }
+
           // Over-rides the function defined in ModelBase; need to build contributions member also
           void map_streamlines (const std::string&);
 
@@ -102,7 +106,8 @@ namespace MR
 
         protected:
           std::string tck_file_path;
-          std::vector<TrackContribution*> contributions;
+          TrackContributionStore contributions;
+          bool out_of_core;
 
           using Fixel_map<Fixel>::accessor;
           using Fixel_map<Fixel>::begin;
@@ -136,6 +141,7 @@ namespace MR
               std::shared_ptr<std::mutex> mutex;
               double TD_sum;
               std::vector<double> fixel_TDs;
+              TrackContributionStore::Arena arena;
           };
 
           class FixelRemapper
@@ -156,20 +162,6 @@ namespace MR
 
 
 
-      template <class Fixel>
-      Model<Fixel>::~Model ()
-      {
-        for (std::vector<TrackContribution*>::iterator i = contributions.begin(); i != contributions.end(); ++i) {
-          if (*i) {
-            delete *i;
-            *i = nullptr;
-          }
-        }
-      }
-
-
-
-
       template <class Fixel>
       void Model<Fixel>::map_streamlines (const std::string& path)
       {
@@ -180,7 +172,7 @@ namespace MR
           throw Exception ("Input .tck file does not specify number of streamlines (run tckfixcount on your .tck file!)");
         const track_t count = to<track_t>(properties["count"]);
 
-        contributions.assign (count, nullptr);
+        contributions.init (count, out_of_core);
 
         {
           Mapping::TrackLoader loader (file, count);
@@ -196,17 +188,19 @@ namespace MR
               Thread::multi (receiver));
         }
 
-        if (!contributions.back()) {
+        contributions.compact();
+
+        if (count && !contributions.exists (count - 1)) {
           track_t num_tracks = 0, max_index = 0;
           for (track_t i = 0; i != contributions.size(); ++i) {
-            if (contributions[i]) {
+            if (contributions.exists (i)) {
               ++num_tracks;
               max_index = std::max (max_index, i);
             }
-            WARN ("Only " + str (num_tracks) + " tracks read from input track file; expected " + str (contributions.size()));
-            WARN ("(suggest running command tckfixcount on file " + path + ")");
-            contributions.resize (max_index + 1);
           }
+          WARN ("Only " + str (num_tracks) + " tracks read from input track file; expected " + str (contributions.size()));
+          WARN ("(suggest running command tckfixcount on file " + path + ")");
+          contributions.resize (max_index + 1);
         }
 
         tck_file_path = path;
@@ -264,9 +258,10 @@ namespace MR
 
         fixels.swap (new_fixels);
 
-        TrackIndexRangeWriter writer (SIFT_TRACK_INDEX_BUFFER_SIZE, num_tracks(), "Removing excluded fixels...");
+        TrackIndexRangeWriter writer (SIFT_TRACK_INDEX_BUFFER_SIZE, num_tracks(), "Removing excluded fixels...", &contributions);
         FixelRemapper remapper (*this, fixel_index_mapping);
         Thread::run_queue (writer, TrackIndexRange(), Thread::multi (remapper));
+        contributions.compact();
 
         TD_sum = 0.0;
         for (typename std::vector<Fixel>::const_iterator i = fixels.begin(); i != fixels.end(); ++i)
@@ -294,9 +289,9 @@ namespace MR
         VAR (sum_from_fixels);
         VAR (sum_from_fixels_weighted);
         double sum_from_tracks = 0.0;
-        for (std::vector<TrackContribution*>::const_iterator i = contributions.begin(); i != contributions.end(); ++i) {
-          if (*i)
-            sum_from_tracks += (*i)->get_total_contribution();
+        for (track_t i = 0; i != contributions.size(); ++i) {
+          if (contributions.exists (i))
+            sum_from_tracks += contributions[i].get_total_contribution();
         }
         VAR (sum_from_tracks);
       }
@@ -315,10 +310,11 @@ namespace MR
         ProgressBar progress ("Writing non-contributing streamlines output file...", contributions.size());
         track_t tck_counter = 0;
         while (reader (tck) && tck_counter < contributions.size()) {
-          if (contributions[tck_counter] && !contributions[tck_counter++]->get_total_contribution())
+          if (contributions.exists (tck_counter) && !contributions[tck_counter].get_total_contribution())
             writer (tck);
           else
             writer (null_tck);
+          ++tck_counter;
           ++progress;
         }
         reader.close();
@@ -338,6 +334,7 @@ namespace MR
         master.TD_sum += TD_sum;
         for (size_t i = 0; i != fixel_TDs.size(); ++i)
           master.fixels[i] += fixel_TDs[i];
+        master.contributions.commit (arena);
       }
 
 
@@ -348,8 +345,6 @@ namespace MR
 
         if (in.index >= master.contributions.size())
           throw Exception ("Received mapped streamline beyond the expected number of streamlines (run tckfixcount on your .tck file!)");
-        if (master.contributions[in.index])
-          throw Exception ("FIXME: Same streamline has been mapped multiple times! (?)");
 
         std::vector<Track_fixel_contribution> masked_contributions;
         double total_contribution = 0.0, total_length = 0.0;
@@ -369,7 +364,7 @@ namespace MR
           }
         }
 
-        master.contributions[in.index] = new TrackContribution (masked_contributions, total_contribution, total_length);
+        master.contributions.set (arena, in.index, masked_contributions, total_contribution, total_length);
 
         TD_sum += total_contribution;
         for (std::vector<Track_fixel_contribution>::const_iterator i = masked_contributions.begin(); i != masked_contributions.end(); ++i)
@@ -387,8 +382,8 @@ namespace MR
       bool Model<Fixel>::FixelRemapper::operator() (const TrackIndexRange& in)
       {
         for (track_t track_index = in.first; track_index != in.second; ++track_index) {
-          if (master.contributions[track_index]) {
-            TrackContribution& this_cont (*master.contributions[track_index]);
+          if (master.contributions.exists (track_index)) {
+            const TrackContribution this_cont (master.contributions[track_index]);
             std::vector<Track_fixel_contribution> new_cont;
             double total_contribution = 0.0;
             for (size_t i = 0; i != this_cont.dim(); ++i) {
@@ -398,9 +393,7 @@ namespace MR
                 total_contribution += this_cont[i].get_length() * master[new_index].get_weight();
               }
             }
-            TrackContribution* new_contribution = new TrackContribution (new_cont, total_contribution, this_cont.get_total_length());
-            delete master.contributions[track_index];
-            master.contributions[track_index] = new_contribution;
+            master.contributions.replace (track_index, new_cont, total_contribution);
           }
         }
         return true;
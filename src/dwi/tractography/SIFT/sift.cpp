@@ -27,7 +27,11 @@ const OptionGroup SIFTModelOption = OptionGroup ("Options affecting the SIFT mod
 
   + Option ("fd_thresh", "fibre density threshold; exclude an FOD lobe from filtering processing if its integral is less than this amount "
                          "(streamlines will still be mapped to it, but it will not contribute to the cost function or the filtering)")
-    + Argument ("value").type_float (0.0, 0.0, 2.0 * Math::pi);
+    + Argument ("value").type_float (0.0, 0.0, 2.0 * Math::pi)
+
+  + Option ("out_of_core", "store the fixel contributions of all streamlines in a memory-mapped scratch file rather than in RAM, "
+                           "so that tractograms too large to fit in memory can be processed. The scratch file is created in the "
+                           "directory specified by the TmpFileDir config file entry (/tmp by default), which should reside on fast local storage.");
 
 
 
@@ -4,7 +4,6 @@
 #include "point.h"
 #include "progressbar.h"
 #include "memory.h"
-#include "timer.h"
 
 #include "dwi/tractography/file.h"
 #include "dwi/tractography/properties.h"
@@ -49,11 +48,11 @@ namespace MR
         double sum_contributing_length = 0.0, sum_noncontributing_length = 0.0;
         std::vector<track_t> noncontributing_indices;
         for (track_t i = 0; i != contributions.size(); ++i) {
-          if (contributions[i]) {
-            if (contributions[i]->get_total_contribution()) {
-              sum_contributing_length    += contributions[i]->get_total_length();
+          if (contributions.exists (i)) {
+            if (contributions[i].get_total_contribution()) {
+              sum_contributing_length    += contributions[i].get_total_length();
             } else {
-              sum_noncontributing_length += contributions[i]->get_total_length();
+              sum_noncontributing_length += contributions[i].get_total_length();
               noncontributing_indices.push_back (i);
             }
           }
@@ -69,6 +68,9 @@ namespace MR
         if (tracks_remaining < term_number)
           throw Exception ("Filtering failed; desired number of filtered streamlines is greater than or equal to the size of the input dataset");
 
+        initialise_cost_sums();
+        initialise_incremental();
+
         const double init_cf = calc_cost_function();
         unsigned int iteration = 0;
         double cf_end_iteration = init_cf;
@@ -96,27 +98,18 @@ namespace MR
           const double current_roc_cf = calc_roc_cost_function();
 
 
-          TrackIndexRangeWriter range_writer (SIFT_TRACK_INDEX_BUFFER_SIZE, num_tracks());
+          if (incremental)
+            flag_changed_tracks();
+
+          TrackIndexRangeWriter range_writer (SIFT_TRACK_INDEX_BUFFER_SIZE, num_tracks(), std::string(), &contributions);
           TrackGradientCalculator gradient_calculator (*this, gradient_vector, current_mu, current_roc_cf);
           Thread::run_queue (range_writer, TrackIndexRange(), Thread::multi (gradient_calculator));
 
+          if (incremental)
+            tracks_changed.clear();
 
-          // Theoretically possible to optimise the sorting block size at execution time
-          // * Estimate the smallest possible block size that will not overload the std::set
-          // * Simulate a gradient vector using a Gaussian distribution of gradients (ignore length dependence)
-          // * Simulate sorting this gradient vector; need to simulate both the sort, and some number of get() calls
-          // * Perform a golden section search to find the optimal block size
-          // This wasn't implemented as the optimal block size seems pretty stable regardless of gradient vector size
-
-          // Ideally the sorting block size should change dynamically as streamlines are filtered
-          // This is to reduce the load on the single-threaded section as the multi-threaded sorting complexity declines
-          //   (as more streamlines are no longer present, hence have a null gradient and are excluded from the full sort)
-          // Tried for an algebraic solution but the numbers didn't line up with my experiments
-          // Trying a heuristic for now; go for a sort size of 1000 following initial sort, assuming half of all
-          //   remaining streamlines have a negative gradient
 
-          const track_t sort_size = std::min (num_tracks() / double(Thread::number_of_threads()), std::round (2000.0 * double(num_tracks()) / double(tracks_remaining)));
-          MT_gradient_vector_sorter sorter (gradient_vector, sort_size);
+          MT_gradient_vector_sorter sorter (gradient_vector);
 
           // Remove candidate streamlines one at a time, and correspondingly modify the fixels to which they were attributed
           removed_this_iteration = 0;
@@ -154,19 +147,18 @@ namespace MR
               noncontributing_indices.pop_back();
 
               // Remove this streamline, and adjust all of the relevant quantities
-              noncontributing_length_removed += contributions[to_remove]->get_total_length();
-              delete contributions[to_remove];
-              contributions[to_remove] = NULL;
+              noncontributing_length_removed += contributions[to_remove].get_total_length();
+              contributions.remove (to_remove);
               ++removed_this_iteration;
               --tracks_remaining;
 
             } else { // Proceed as normal
 
-              const std::vector<Cost_fn_gradient_sort>::iterator candidate = sorter.get();
+              const Cost_fn_gradient_sort& candidate = sorter.get();
 
-              const track_t candidate_index = candidate->get_tck_index();
+              const track_t candidate_index = candidate.get_tck_index();
 
-              if (candidate->get_cost_gradient() >= 0.0) {
+              if (candidate.get_cost_gradient() >= 0.0) {
                 recalculate = POS_GRADIENT;
                 if (!removed_this_iteration)
                   another_iteration = false;
@@ -174,12 +166,12 @@ namespace MR
               }
 
               assert (candidate_index != num_tracks());
-              assert (contributions[candidate_index]);
+              assert (contributions.exists (candidate_index));
 
-              const double streamline_density_ratio = candidate->get_cost_gradient() / (sum_contributing_length - contributing_length_removed);
+              const double streamline_density_ratio = candidate.get_cost_gradient() / (sum_contributing_length - contributing_length_removed);
               const double required_cf_change_ratio = - term_ratio * streamline_density_ratio * current_cf;
 
-              const TrackContribution& candidate_contribution (*contributions[candidate_index]);
+              const TrackContribution candidate_contribution (contributions[candidate_index]);
 
               const double old_mu = mu();
               const double new_mu = FOD_sum / (TD_sum - candidate_contribution.get_total_contribution());
@@ -200,19 +192,18 @@ namespace MR
               }
 
               const double required_cf_change_quantisation = enforce_quantisation ? (-0.5 * quantisation) : 0.0;
-              const double this_nonlinearity = (candidate->get_cost_gradient() - this_actual_cf_change);
+              const double this_nonlinearity = (candidate.get_cost_gradient() - this_actual_cf_change);
 
               if (this_actual_cf_change < minvalue (required_cf_change_ratio, required_cf_change_quantisation, this_nonlinearity)) {
 
                 // Candidate streamline removal meets all criteria; remove from reconstruction
                 for (size_t f = 0; f != candidate_contribution.dim(); ++f) {
                   const Track_fixel_contribution& fixel_cont = candidate_contribution[f];
-                  fixels[fixel_cont.get_fixel_index()] -= fixel_cont.get_length();
+                  remove_TD (fixel_cont.get_fixel_index(), fixel_cont.get_length());
                 }
                 TD_sum -= candidate_contribution.get_total_contribution();
                 contributing_length_removed += candidate_contribution.get_total_length();
-                delete contributions[candidate_index];
-                contributions[candidate_index] = NULL;
+                contributions.remove (candidate_index);
                 ++removed_this_iteration;
                 --tracks_remaining;
 
@@ -290,6 +281,14 @@ namespace MR
 
         INFO ("Proportionality coefficient at end of filtering is " + str (mu()));
 
+        gradient_terms.clear();
+        gradient_terms.shrink_to_fit();
+        fixel_track_offsets.clear();
+        fixel_track_offsets.shrink_to_fit();
+        fixel_tracks.clear();
+        fixel_tracks.shrink_to_fit();
+        incremental = false;
+
       }
 
 
@@ -308,7 +307,7 @@ namespace MR
         ProgressBar progress ("Writing filtered tracks output file...", contributions.size());
         std::vector< Point<float> > empty_tck;
         while (reader (tck) && tck_counter < contributions.size()) {
-          if (contributions[tck_counter++])
+          if (contributions.exists (tck_counter++))
             writer (tck);
           else
             writer (empty_tck);
@@ -325,7 +324,7 @@ namespace MR
       {
         File::OFStream out (path, std::ios_base::out | std::ios_base::trunc);
         for (track_t i = 0; i != contributions.size(); ++i) {
-          if (contributions[i])
+          if (contributions.exists (i))
             out << "1\n";
           else
             out << "0\n";
@@ -353,80 +352,149 @@ namespace MR
 
 
 
-      void SIFTer::test_sorting_block_size (const size_t num_tracks) const
+      // Convenience functions
+
+      // With fixel cost  w * (TD*mu - FOD)^2  and d(cost)/d(mu) = 2 * w * TD * (TD*mu - FOD),
+      //   both sums are expressible using the running sums over fixels
+      double SIFTer::calc_cost_function() const
       {
+        const double current_mu = mu();
+        return std::max (0.0, (current_mu * current_mu * sum_TD2) - (2.0 * current_mu * sum_TD_FOD) + sum_FOD2);
+      }
 
-        Math::RNG::Normal<float> rng;
+      double SIFTer::calc_roc_cost_function() const
+      {
+        return 2.0 * ((mu() * sum_TD2) - sum_TD_FOD);
+      }
 
-        std::vector<Cost_fn_gradient_sort> gradient_vector;
-        gradient_vector.assign (num_tracks, Cost_fn_gradient_sort (num_tracks, 0.0, 0.0));
-        // Fill the gradient vector with random Gaussian data
-        for (track_t index = 0; index != num_tracks; ++index) {
-          const float value = rng();
-          gradient_vector[index].set (index, value, value);
+      double SIFTer::calc_gradient (const track_t index, const double current_mu, const double current_roc_cost) const
+      {
+        if (!contributions.exists (index))
+          return std::numeric_limits<double>::max();
+        const TrackContribution tck_cont (contributions[index]);
+        const double TD_sum_if_removed = TD_sum - tck_cont.get_total_contribution();
+        const double mu_if_removed = FOD_sum / TD_sum_if_removed;
+        const double mu_change_if_removed = mu_if_removed - current_mu;
+        double gradient = current_roc_cost * mu_change_if_removed;
+        for (size_t f = 0; f != tck_cont.dim(); ++f) {
+          const Fixel& fixel = fixels[tck_cont[f].get_fixel_index()];
+          const double undo_gradient_mu_only = fixel.get_d_cost_d_mu (current_mu) * mu_change_if_removed;
+          const double gradient_remove_tck = fixel.get_cost_wo_track (mu_if_removed, tck_cont[f].get_length()) - fixel.get_cost (current_mu);
+          gradient = gradient - undo_gradient_mu_only + gradient_remove_tck;
         }
+        return gradient;
+      }
+
 
-        std::vector<size_t> block_sizes;
-        for (size_t i = 16; i < num_tracks; i *= 2)
-          block_sizes.push_back (i);
-        block_sizes.push_back (num_tracks);
-
-        for (std::vector<size_t>::const_iterator i = block_sizes.begin(); i != block_sizes.end(); ++i) {
-          const size_t block_size = *i;
-
-          // Make a copy of the gradient vector, so the same data is sorted each time
-          std::vector<Cost_fn_gradient_sort> temp_gv (gradient_vector);
-
-          Timer timer;
-          // Simulate sorting and filtering
-          try {
-            MT_gradient_vector_sorter sorter (temp_gv, block_size);
-            for (size_t candidate_count = 0; candidate_count < num_tracks / 1000; ++candidate_count)
-              sorter.get();
-            std::cerr << "Time required for sorting " << num_tracks << " tracks, block size " << block_size << " = " << timer.elapsed() * 1000.0 << "ms\n";
-          } catch (...) {
-            std::cerr << "Could not sort " << num_tracks << "tracks with block size " << block_size << "\n";
-          }
 
 
 
-        }
 
+      void SIFTer::initialise_cost_sums()
+      {
+        sum_TD2 = sum_TD_FOD = sum_FOD2 = 0.0;
+        std::vector<Fixel>::const_iterator i = fixels.begin();
+        for (++i; i != fixels.end(); ++i) {
+          sum_TD2    += i->get_weight() * i->get_TD()  * i->get_TD();
+          sum_TD_FOD += i->get_weight() * i->get_TD()  * i->get_FOD();
+          sum_FOD2   += i->get_weight() * i->get_FOD() * i->get_FOD();
+        }
       }
 
 
 
+      void SIFTer::initialise_incremental()
+      {
+        incremental = !contributions.is_out_of_core();
+        if (!incremental)
+          return;
+
+        // Build the fixel -> streamline inverted index
+        fixel_track_offsets.assign (fixels.size() + 1, 0);
+        for (track_t i = 0; i != contributions.size(); ++i) {
+          if (contributions.exists (i)) {
+            const TrackContribution tck_cont (contributions[i]);
+            for (size_t f = 0; f != tck_cont.dim(); ++f)
+              ++fixel_track_offsets[tck_cont[f].get_fixel_index() + 1];
+          }
+        }
+        for (size_t f = 1; f != fixel_track_offsets.size(); ++f)
+          fixel_track_offsets[f] += fixel_track_offsets[f-1];
+        fixel_tracks.resize (fixel_track_offsets.back());
+        std::vector<size_t> fill (fixel_track_offsets.begin(), fixel_track_offsets.end() - 1);
+        for (track_t i = 0; i != contributions.size(); ++i) {
+          if (contributions.exists (i)) {
+            const TrackContribution tck_cont (contributions[i]);
+            for (size_t f = 0; f != tck_cont.dim(); ++f)
+              fixel_tracks[fill[tck_cont[f].get_fixel_index()]++] = i;
+          }
+        }
+
+        // All gradient terms must be calculated in the first iteration
+        gradient_terms.assign (num_tracks(), GradientTerms());
+        fixels_changed.resize (fixels.size());
+        fixels_changed.clear (false);
+        tracks_changed.resize (num_tracks());
+        tracks_changed.clear (true);
+      }
+
+
 
+      void SIFTer::flag_changed_tracks()
+      {
+        for (size_t f = 1; f != fixels.size(); ++f) {
+          if (fixels_changed[f]) {
+            for (size_t i = fixel_track_offsets[f]; i != fixel_track_offsets[f+1]; ++i)
+              tracks_changed[fixel_tracks[i]] = true;
+          }
+        }
+        fixels_changed.clear();
+      }
 
 
-      // Convenience functions
 
-      double SIFTer::calc_roc_cost_function() const
+      void SIFTer::remove_TD (const size_t index, const float length)
       {
-        const double current_mu = mu();
-        double roc_cost = 0.0;
-        std::vector<Fixel>::const_iterator i = fixels.begin();
-        for (++i; i != fixels.end(); ++i)
-          roc_cost += i->get_d_cost_d_mu (current_mu);
-        return roc_cost;
+        Fixel& fixel = fixels[index];
+        const double weight = fixel.get_weight(), FOD = fixel.get_FOD();
+        const double old_TD = fixel.get_TD();
+        fixel -= length;
+        const double new_TD = fixel.get_TD();
+        sum_TD2    += weight * ((new_TD * new_TD) - (old_TD * old_TD));
+        sum_TD_FOD += weight * (new_TD - old_TD) * FOD;
+        if (incremental)
+          fixels_changed[index] = true;
       }
 
-      double SIFTer::calc_gradient (const track_t index, const double current_mu, const double current_roc_cost) const
+
+
+      // Per-streamline terms of the gradient; see calc_gradient() below
+      SIFTer::GradientTerms SIFTer::calc_gradient_terms (const track_t index) const
       {
-        if (!contributions[index])
-          return std::numeric_limits<double>::max();
-        const TrackContribution& tck_cont = *contributions[index];
-        const double TD_sum_if_removed = TD_sum - tck_cont.get_total_contribution();
-        const double mu_if_removed = FOD_sum / TD_sum_if_removed;
-        const double mu_change_if_removed = mu_if_removed - current_mu;
-        double gradient = current_roc_cost * mu_change_if_removed;
+        GradientTerms terms;
+        const TrackContribution tck_cont (contributions[index]);
         for (size_t f = 0; f != tck_cont.dim(); ++f) {
           const Fixel& fixel = fixels[tck_cont[f].get_fixel_index()];
-          const double undo_gradient_mu_only = fixel.get_d_cost_d_mu (current_mu) * mu_change_if_removed;
-          const double gradient_remove_tck = fixel.get_cost_wo_track (mu_if_removed, tck_cont[f].get_length()) - fixel.get_cost (current_mu);
-          gradient = gradient - undo_gradient_mu_only + gradient_remove_tck;
+          const double weight = fixel.get_weight(), TD = fixel.get_TD();
+          const double TD_wo_track = std::max (TD - tck_cont[f].get_length(), 0.0);
+          terms.sum_TD2      += weight * TD * TD;
+          terms.delta_TD2    += weight * ((TD_wo_track * TD_wo_track) - (TD * TD));
+          terms.delta_TD_FOD += weight * (TD_wo_track - TD) * fixel.get_FOD();
         }
-        return gradient;
+        return terms;
+      }
+
+      // Equivalent to calc_gradient (const track_t, const double, const double):
+      //   expanding the per-fixel terms about the new value of mu (mu') gives
+      //   gradient = roc * dmu + dmu^2 * sum(w.TD^2) + mu'^2 * sum(w.(TD'^2 - TD^2)) - 2 * mu' * sum(w.FOD.(TD' - TD))
+      double SIFTer::calc_gradient (const track_t index, const GradientTerms& terms, const double current_mu, const double current_roc_cost) const
+      {
+        const double mu_if_removed = FOD_sum / (TD_sum - contributions[index].get_total_contribution());
+        const double mu_change_if_removed = mu_if_removed - current_mu;
+        return (current_roc_cost * mu_change_if_removed)
+             + (mu_change_if_removed * mu_change_if_removed * terms.sum_TD2)
+             + (mu_if_removed * mu_if_removed * terms.delta_TD2)
+             - (2.0 * mu_if_removed * terms.delta_TD_FOD);
       }
 
 
@@ -437,9 +505,17 @@ namespace MR
       bool SIFTer::TrackGradientCalculator::operator() (const TrackIndexRange& in) const
       {
         for (track_t track_index = in.first; track_index != in.second; ++track_index) {
-          if (master.contributions[track_index]) {
-            const double gradient = master.calc_gradient (track_index, current_mu, current_roc_cost);
-            const double grad_per_unit_length = master.contributions[track_index]->get_total_contribution() ? (gradient / master.contributions[track_index]->get_total_contribution()) : 0.0;
+          if (master.contributions.exists (track_index)) {
+            double gradient;
+            if (master.incremental) {
+              if (master.tracks_changed[track_index])
+                master.gradient_terms[track_index] = master.calc_gradient_terms (track_index);
+              gradient = master.calc_gradient (track_index, master.gradient_terms[track_index], current_mu, current_roc_cost);
+            } else {
+              gradient = master.calc_gradient (track_index, current_mu, current_roc_cost);
+            }
+            const float total_contribution = master.contributions[track_index].get_total_contribution();
+            const double grad_per_unit_length = total_contribution ? (gradient / total_contribution) : 0.0;
             gradient_vector[track_index].set (track_index, gradient, grad_per_unit_length);
           } else {
             gradient_vector[track_index].set (master.num_tracks(), 0.0, 0.0);
@@ -28,6 +28,7 @@
 
 #include <vector>
 
+#include "bitset.h"
 #include "math/rng.h"
 #include "image/buffer.h"
 #include "image/header.h"
@@ -68,7 +69,13 @@ namespace MR
             term_number (0),
             term_ratio (0.0),
             term_mu (0.0),
-            enforce_quantisation (true) { }
+            enforce_quantisation (true),
+            sum_TD2 (0.0),
+            sum_TD_FOD (0.0),
+            sum_FOD2 (0.0),
+            incremental (false),
+            fixels_changed (0),
+            tracks_changed (0) { }
 
         SIFTer (const SIFTer& that) = delete;
 
@@ -89,10 +96,6 @@ namespace MR
         void set_regular_outputs (const std::vector<int>&, const bool);
 
 
-        // DEBUGGING
-        void test_sorting_block_size (const size_t) const;
-
-
         protected:
         using Fixel_map<Fixel>::accessor;
         using Fixel_map<Fixel>::fixels;
@@ -115,21 +118,54 @@ namespace MR
         std::string csv_path;
 
 
+        // Running sums over all fixels of (weight * TD^2), (weight * TD * FOD) and (weight * FOD^2);
+        //   the cost function and its rate of change with respect to mu are quadratic / linear in mu
+        //   with these coefficients, so can be evaluated without scanning the fixels
+        double sum_TD2, sum_TD_FOD, sum_FOD2;
+
+
+        // Incremental gradient calculation:
+        // The cost function gradient of each streamline is a closed-form function of the global quantities
+        //   (mu, rate of change of cost function, TD_sum) and three per-streamline terms that depend only on
+        //   the TDs of the fixels traversed by that streamline. These terms are cached, and only recalculated
+        //   for those streamlines that traverse a fixel whose TD has changed, found using a fixel->streamline
+        //   inverted index. Not used in out-of-core mode, where the additional RAM would defeat the purpose.
+        class GradientTerms
+        {
+          public:
+            GradientTerms () : sum_TD2 (0.0), delta_TD2 (0.0), delta_TD_FOD (0.0) { }
+            double sum_TD2, delta_TD2, delta_TD_FOD;
+        };
+        bool incremental;
+        std::vector<GradientTerms> gradient_terms;
+        std::vector<size_t> fixel_track_offsets;
+        std::vector<track_t> fixel_tracks;
+        BitSet fixels_changed, tracks_changed;
+
+
         // Convenience functions
+        double calc_cost_function() const;
         double calc_roc_cost_function() const;
         double calc_gradient (const track_t, const double, const double) const;
 
+        void initialise_cost_sums();
+        void initialise_incremental();
+        void flag_changed_tracks();
+        void remove_TD (const size_t, const float);
+        GradientTerms calc_gradient_terms (const track_t) const;
+        double calc_gradient (const track_t, const GradientTerms&, const double, const double) const;
+
 
 
         // For calculating the streamline removal gradients in a multi-threaded fashion
         class TrackGradientCalculator
         {
           public:
-            TrackGradientCalculator (const SIFTer& sifter, std::vector<Cost_fn_gradient_sort>& v, const double mu, const double r) :
+            TrackGradientCalculator (SIFTer& sifter, std::vector<Cost_fn_gradient_sort>& v, const double mu, const double r) :
               master (sifter), gradient_vector (v), current_mu (mu), current_roc_cost (r) { }
             bool operator() (const TrackIndexRange&) const;
           private:
-            const SIFTer& master;
+            SIFTer& master;
             std::vector<Cost_fn_gradient_sort>& gradient_vector;
             const double current_mu, current_roc_cost;
         };
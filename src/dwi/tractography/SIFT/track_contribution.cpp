@@ -1,6 +1,15 @@
 
 #include "dwi/tractography/SIFT/track_contribution.h"
 
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifndef MRTRIX_WINDOWS
+#include <sys/mman.h>
+#endif
+
+#include "file/utils.h"
+
 namespace MR
 {
   namespace DWI
@@ -16,6 +25,279 @@ namespace MR
         float Track_fixel_contribution::min_length_for_storage = 0.0;
 
 
+
+
+        void TrackContributionBuffer::allocate (const size_t size, const bool out_of_core)
+        {
+          release();
+          count = size;
+          if (!out_of_core) {
+            std::vector<Track_fixel_contribution> (size).swap (ram);
+            data = ram.data();
+            return;
+          }
+#ifdef MRTRIX_WINDOWS
+          throw Exception ("Out-of-core SIFT model is not supported on Windows");
+#else
+          mapped_bytes = std::max (size, size_t(1)) * sizeof (Track_fixel_contribution);
+          path = File::create_tempfile (mapped_bytes, "sift");
+          INFO ("storing streamline contributions in scratch file \"" + path + "\" (" + str (mapped_bytes / (1024*1024)) + " MB)");
+          if ((fd = open (path.c_str(), O_RDWR, 0666)) < 0)
+            throw Exception ("error opening scratch file \"" + path + "\": " + strerror (errno));
+          void* addr = mmap ((char*) 0, mapped_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+          if (addr == MAP_FAILED) {
+            const std::string error (strerror (errno));
+            release();
+            throw Exception ("memory-mapping failed for scratch file \"" + path + "\": " + error);
+          }
+          data = static_cast<Track_fixel_contribution*> (addr);
+#endif
+        }
+
+
+
+        void TrackContributionBuffer::release()
+        {
+#ifndef MRTRIX_WINDOWS
+          if (is_mapped()) {
+            if (data && munmap (data, mapped_bytes))
+              WARN ("error unmapping scratch file \"" + path + "\": " + strerror (errno));
+            close (fd);
+            fd = -1;
+            mapped_bytes = 0;
+          }
+#endif
+          if (path.size()) {
+            if (::unlink (path.c_str()))
+              WARN ("error deleting scratch file \"" + path + "\": " + strerror (errno));
+            path.clear();
+          }
+          std::vector<Track_fixel_contribution>().swap (ram);
+          data = nullptr;
+          count = 0;
+        }
+
+
+
+        void TrackContributionBuffer::shrink (const size_t size)
+        {
+          assert (size <= count);
+          count = size;
+          if (!is_mapped()) {
+            ram.resize (size);
+            std::vector<Track_fixel_contribution> (ram).swap (ram);
+            data = ram.data();
+          }
+        }
+
+
+
+        void TrackContributionBuffer::prefetch (const size_t from, const size_t to) const
+        {
+#ifndef MRTRIX_WINDOWS
+          if (!is_mapped() || from >= to)
+            return;
+          static const size_t page_size = sysconf (_SC_PAGESIZE);
+          const size_t first = (reinterpret_cast<size_t> (data + from) / page_size) * page_size;
+          const size_t last  = reinterpret_cast<size_t> (data + to);
+          madvise (reinterpret_cast<void*> (first), last - first, MADV_WILLNEED);
+#endif
+        }
+
+
+
+
+        TrackContributionStore::Arena::~Arena()
+        {
+          spill.reset();
+          if (spill_path.size() && ::unlink (spill_path.c_str()))
+            WARN ("error deleting scratch file \"" + spill_path + "\": " + strerror (errno));
+        }
+
+
+
+        void TrackContributionStore::Arena::add (const track_t index, const std::vector<Track_fixel_contribution>& in, const bool out_of_core)
+        {
+          tracks.push_back (index);
+          for (std::vector<Track_fixel_contribution>::const_iterator i = in.begin(); i != in.end(); ++i) {
+            if (blocks.empty() || blocks.back().size() == SIFT_CONTRIBUTION_ARENA_BLOCK_SIZE) {
+              if (out_of_core && !blocks.empty()) {
+                // Write the full block to this arena's scratch file, and re-use its memory
+                if (!spill) {
+                  spill_path = File::create_tempfile (0, "sift");
+                  spill.reset (new std::ofstream (spill_path.c_str(), std::ios_base::out | std::ios_base::binary | std::ios_base::trunc));
+                }
+                spill->write (reinterpret_cast<const char*> (blocks.back().data()), SIFT_CONTRIBUTION_ARENA_BLOCK_SIZE * sizeof (Track_fixel_contribution));
+                if (!spill->good())
+                  throw Exception ("error writing to scratch file \"" + spill_path + "\": " + strerror (errno));
+                ++spilled_blocks;
+                blocks.back().clear();
+              } else {
+                blocks.push_back (std::vector<Track_fixel_contribution>());
+                blocks.back().reserve (SIFT_CONTRIBUTION_ARENA_BLOCK_SIZE);
+              }
+            }
+            blocks.back().push_back (*i);
+          }
+          num_contributions += in.size();
+        }
+
+
+
+
+        void TrackContributionStore::init (const track_t count, const bool ooc)
+        {
+          data.release();
+          arenas.clear();
+          offsets.assign (count, 0);
+          counts.assign (count, 0);
+          total_contributions.assign (count, 0.0);
+          total_lengths.assign (count, 0.0);
+          present.resize (count);
+          present.clear();
+          out_of_core = ooc;
+        }
+
+
+
+        void TrackContributionStore::set (Arena& arena, const track_t index, const std::vector<Track_fixel_contribution>& in, const float total_contribution, const float total_length)
+        {
+          assert (index < size());
+          counts[index] = in.size();
+          total_contributions[index] = total_contribution;
+          total_lengths[index] = total_length;
+          arena.add (index, in, out_of_core);
+        }
+
+
+
+        void TrackContributionStore::commit (Arena& arena)
+        {
+          if (arena.empty())
+            return;
+          arenas.push_back (Arena());
+          std::swap (arenas.back(), arena);
+        }
+
+
+
+        void TrackContributionStore::compact()
+        {
+
+          if (arenas.empty()) {
+
+            // Data are already in streamline order; just shift each streamline down to remove any gaps
+            Track_fixel_contribution* const d = data.begin();
+            size_t offset = 0;
+            for (track_t index = 0; index != size(); ++index) {
+              if (offset != offsets[index])
+                std::copy (d + offsets[index], d + offsets[index] + counts[index], d + offset);
+              offsets[index] = offset;
+              offset += counts[index];
+            }
+            data.shrink (offset);
+            return;
+
+          }
+
+          // Mark the streamlines received, so that the offsets can be calculated
+          for (std::vector<Arena>::const_iterator a = arenas.begin(); a != arenas.end(); ++a) {
+            for (std::vector<track_t>::const_iterator t = a->tracks.begin(); t != a->tracks.end(); ++t) {
+              if (present[*t])
+                throw Exception ("FIXME: Same streamline has been mapped multiple times! (?)");
+              present[*t] = true;
+            }
+          }
+
+          size_t total = 0;
+          for (track_t index = 0; index != size(); ++index) {
+            offsets[index] = total;
+            if (present[index])
+              total += counts[index];
+            else
+              counts[index] = 0;
+          }
+
+          data.allocate (total, out_of_core);
+          Track_fixel_contribution* const d = data.begin();
+
+          // Copy data from each arena into place; blocks are read back from the arena's scratch file first
+          //   (in the order in which they were spilled), followed by those still held in RAM. Blocks in RAM
+          //   are released as they are consumed, so that peak memory usage does not exceed the final storage by much.
+          for (std::vector<Arena>::iterator a = arenas.begin(); a != arenas.end(); ++a) {
+
+            std::unique_ptr<std::ifstream> spill_in;
+            if (a->spilled_blocks) {
+              a->spill.reset();
+              spill_in.reset (new std::ifstream (a->spill_path.c_str(), std::ios_base::in | std::ios_base::binary));
+            }
+            size_t spilled_remaining = a->spilled_blocks;
+            std::vector< std::vector<Track_fixel_contribution> >::iterator next_block = a->blocks.begin();
+            std::vector<Track_fixel_contribution> block;
+
+            size_t block_offset = 0;
+            for (std::vector<track_t>::const_iterator t = a->tracks.begin(); t != a->tracks.end(); ++t) {
+              for (size_t i = 0; i != counts[*t]; ++i) {
+                if (block_offset == block.size()) {
+                  if (spilled_remaining) {
+                    block.resize (SIFT_CONTRIBUTION_ARENA_BLOCK_SIZE);
+                    spill_in->read (reinterpret_cast<char*> (block.data()), SIFT_CONTRIBUTION_ARENA_BLOCK_SIZE * sizeof (Track_fixel_contribution));
+                    if (!spill_in->good())
+                      throw Exception ("error reading from scratch file \"" + a->spill_path + "\": " + strerror (errno));
+                    --spilled_remaining;
+                  } else {
+                    block.swap (*next_block);
+                    std::vector<Track_fixel_contribution>().swap (*next_block++);
+                  }
+                  block_offset = 0;
+                }
+                d[offsets[*t] + i] = block[block_offset++];
+              }
+            }
+
+          }
+          arenas.clear();
+
+        }
+
+
+
+        void TrackContributionStore::replace (const track_t index, const std::vector<Track_fixel_contribution>& in, const float total_contribution)
+        {
+          assert (exists (index));
+          assert (in.size() <= counts[index]);
+          std::copy (in.begin(), in.end(), data.begin() + offsets[index]);
+          counts[index] = in.size();
+          total_contributions[index] = total_contribution;
+        }
+
+
+
+        void TrackContributionStore::resize (const track_t count)
+        {
+          assert (arenas.empty());
+          if (count >= size())
+            return;
+          data.shrink (count ? (offsets[count-1] + counts[count-1]) : 0);
+          offsets.resize (count);
+          counts.resize (count);
+          total_contributions.resize (count);
+          total_lengths.resize (count);
+          present.resize (count);
+        }
+
+
+
+        void TrackContributionStore::prefetch (const TrackIndexRange& range) const
+        {
+          if (!data.is_mapped() || range.first >= range.second)
+            return;
+          data.prefetch (offsets[range.first], offsets[range.second-1] + counts[range.second-1]);
+        }
+
+
+
+
       }
     }
   }
@@ -26,12 +26,18 @@
 #define __dwi_tractography_sift_track_contribution_h__
 
 
+#include <fstream>
+#include <memory>
 #include <stdint.h>
+#include <vector>
 
-#include "min_mem_array.h"
+#include "bitset.h"
 
 #include "image/info.h"
 
+#include "dwi/tractography/SIFT/track_index_range.h"
+#include "dwi/tractography/SIFT/types.h"
+
 
 namespace MR
 {
@@ -45,6 +51,11 @@ namespace MR
 
 
 
+#define SIFT_CONTRIBUTION_ARENA_BLOCK_SIZE 1048576
+
+
+
+
       class Track_fixel_contribution
       {
         public:
@@ -134,27 +145,28 @@ class Track_fixel_contribution
 
 
 
-      class TrackContribution : public Min_mem_array<Track_fixel_contribution>
+      // Read-only view of the fixel contributions of a single streamline; the data
+      //   themselves are owned by the TrackContributionStore class
+      class TrackContribution
       {
 
         public:
-        TrackContribution (const std::vector<Track_fixel_contribution>& in, const float c, const float l) :
-          Min_mem_array<Track_fixel_contribution> (in),
+        TrackContribution (const Track_fixel_contribution* d, const uint32_t n, const float c, const float l) :
+          data               (d),
+          count              (n),
           total_contribution (c),
           total_length       (l) { }
 
-        TrackContribution () :
-          Min_mem_array<Track_fixel_contribution> (),
-          total_contribution (0.0),
-          total_length       (0.0) { }
-
-        ~TrackContribution() { }
+        size_t dim() const { return count; }
+        const Track_fixel_contribution& operator[] (const size_t i) const { assert (i < count); return data[i]; }
 
         float get_total_contribution() const { return total_contribution; }
         float get_total_length      () const { return total_length; }
 
 
         private:
+        const Track_fixel_contribution* data;
+        const uint32_t count;
         const float total_contribution, total_length;
 
 
@@ -163,6 +175,135 @@ class Track_fixel_contribution
 
 
 
+      // Contiguous array of fixel contributions; held either in RAM, or in a memory-mapped scratch
+      //   file for tractograms whose streamline contributions would not otherwise fit in RAM
+      class TrackContributionBuffer
+      {
+
+        public:
+        TrackContributionBuffer() :
+          data (nullptr),
+          count (0),
+          fd (-1),
+          mapped_bytes (0) { }
+
+        TrackContributionBuffer (const TrackContributionBuffer&) = delete;
+
+        ~TrackContributionBuffer() { release(); }
+
+        void allocate (const size_t, const bool);
+        void release();
+        // Discard data beyond the requested size; memory is only returned to the system if held in RAM
+        void shrink (const size_t);
+
+        size_t size() const { return count; }
+        bool is_mapped() const { return (fd >= 0); }
+        Track_fixel_contribution* begin() { return data; }
+        const Track_fixel_contribution* begin() const { return data; }
+
+        // Advise the OS that this range of the scratch file will be accessed shortly
+        void prefetch (const size_t, const size_t) const;
+
+
+        private:
+        Track_fixel_contribution* data;
+        size_t count;
+        std::vector<Track_fixel_contribution> ram;
+        std::string path;
+        int fd;
+        size_t mapped_bytes;
+
+      };
+
+
+
+
+      // Storage of the fixel contributions of all streamlines in compressed sparse row format:
+      //   the contributions of all streamlines reside in a single contiguous array in streamline order,
+      //   with a per-streamline offset into that array.
+      // During streamline mapping, each thread appends its streamlines to its own Arena (allocated in
+      //   large blocks, not per streamline); these are handed over to the store, and compact() then
+      //   moves all data into the final contiguous array.
+      // In out-of-core mode, full arena blocks are spilled to scratch files during mapping, and the final
+      //   array is a memory-mapped scratch file; RAM usage is then limited to the per-streamline data.
+      class TrackContributionStore
+      {
+
+        public:
+
+        class Arena
+        {
+          public:
+            Arena() : num_contributions (0), spilled_blocks (0) { }
+            Arena (Arena&&) = default;
+            Arena& operator= (Arena&&) = default;
+            ~Arena();
+            bool empty() const { return tracks.empty(); }
+          private:
+            std::vector< std::vector<Track_fixel_contribution> > blocks;
+            std::vector<track_t> tracks;
+            size_t num_contributions;
+            std::string spill_path;
+            std::unique_ptr<std::ofstream> spill;
+            size_t spilled_blocks;
+            void add (const track_t, const std::vector<Track_fixel_contribution>&, const bool);
+            friend class TrackContributionStore;
+        };
+
+
+        TrackContributionStore() :
+          present (0),
+          out_of_core (false) { }
+
+        // Allocate storage for the per-streamline data of the requested number of streamlines;
+        //   each streamline is subsequently added by exactly one thread using set()
+        void init (const track_t, const bool out_of_core = false);
+
+        // Thread-safe provided that each streamline index is set only once
+        void set (Arena&, const track_t, const std::vector<Track_fixel_contribution>&, const float, const float);
+
+        // Not thread-safe; must be called with the caller's own locking
+        void commit (Arena&);
+
+        // Move all data into a single contiguous array in streamline order, removing any unused space
+        void compact();
+
+        // Replace the contributions of a streamline in-place; the new list must be no longer than the existing one.
+        //   Thread-safe for distinct streamline indices; call compact() afterwards to release the unused space
+        void replace (const track_t, const std::vector<Track_fixel_contribution>&, const float);
+
+        // Discard streamlines beyond the requested count
+        void resize (const track_t);
+
+        // In out-of-core mode, request that the data for a range of streamlines be read in advance
+        void prefetch (const TrackIndexRange&) const;
+
+        track_t size() const { return counts.size(); }
+        bool is_out_of_core() const { return out_of_core; }
+        bool exists (const track_t index) const { return present[index]; }
+        void remove (const track_t index) { present[index] = false; }
+
+        TrackContribution operator[] (const track_t index) const {
+          assert (exists (index));
+          return TrackContribution (data.begin() + offsets[index], counts[index], total_contributions[index], total_lengths[index]);
+        }
+
+
+        private:
+        TrackContributionBuffer data;
+        std::vector<size_t> offsets;
+        std::vector<uint32_t> counts;
+        std::vector<float> total_contributions, total_lengths;
+        BitSet present;
+        bool out_of_core;
+
+        std::vector<Arena> arenas;
+
+      };
+
+
+
+
       }
     }
   }
@@ -22,6 +22,7 @@
 
 
 #include "dwi/tractography/SIFT/track_index_range.h"
+#include "dwi/tractography/SIFT/track_contribution.h"
 
 
 namespace MR
@@ -35,11 +36,16 @@ namespace MR
 
 
 
-      TrackIndexRangeWriter::TrackIndexRangeWriter (const track_t buffer_size, const track_t num_tracks, const std::string& message) :
+      TrackIndexRangeWriter::TrackIndexRangeWriter (const track_t buffer_size, const track_t num_tracks, const std::string& message, const TrackContributionStore* contributions) :
         size  (buffer_size),
         end   (num_tracks),
         start (0),
-        progress (message.empty() ? NULL : new ProgressBar (message, ceil (float(end) / float(size)))) { }
+        progress (message.empty() ? NULL : new ProgressBar (message, ceil (float(end) / float(size)))),
+        prefetch (contributions)
+      {
+        if (prefetch)
+          prefetch->prefetch (TrackIndexRange (start, MIN (start + size, end)));
+      }
 
 
       bool TrackIndexRangeWriter::operator() (TrackIndexRange& out)
@@ -50,6 +56,8 @@ namespace MR
         const track_t last = MIN (start + size, end);
         out.second = last;
         start = last;
+        if (prefetch)
+          prefetch->prefetch (TrackIndexRange (start, MIN (start + size, end)));
         if (progress)
           ++*progress;
         return true;
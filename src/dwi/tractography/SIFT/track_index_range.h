@@ -47,16 +47,21 @@ namespace MR
       typedef Thread::Queue< TrackIndexRange > TrackIndexRangeQueue;
 
 
+      class TrackContributionStore;
+
+
 
       // Some processes in SIFT are fast for each streamline, but there are a large number of streamlines, so
       //   if multi-threading is done on a per-track basis the I/O associated with multi-threading begins to dominate
       // Instead, the input queue for multi-threading is filled with std::pair<track_t, track_t>'s, where the values
       //   are the start and end track indices to be processed
+      // If the streamline contributions are stored out-of-core, the writer can also request that the data for the
+      //   next range of streamlines be read ahead of its being processed
       class TrackIndexRangeWriter
       {
 
         public:
-          TrackIndexRangeWriter (const track_t, const track_t, const std::string& message = std::string ());
+          TrackIndexRangeWriter (const track_t, const track_t, const std::string& message = std::string (), const TrackContributionStore* prefetch = nullptr);
 
           bool operator() (TrackIndexRange&);
 
@@ -64,6 +69,7 @@ namespace MR
           const track_t size, end;
           track_t start;
           std::unique_ptr<ProgressBar> progress;
+          const TrackContributionStore* prefetch;
 
       };
 
@@ -23,6 +23,11 @@
 
 #include "dwi/tractography/connectomics/tck2nodes.h"
 
+#include <algorithm>
+#include <limits>
+
+#include "image/loop.h"
+
 
 namespace MR {
 namespace DWI {
@@ -33,6 +38,93 @@ namespace Connectomics {
 
 
 
+NodeDistanceField::NodeDistanceField (Image::Buffer<node_t>& nodes_data)
+{
+
+  for (size_t axis = 0; axis != 3; ++axis)
+    dim[axis] = nodes_data.dim (axis);
+  const size_t num_voxels = size_t(dim[0]) * size_t(dim[1]) * size_t(dim[2]);
+
+  // Squared distances during the transform; converted to distances at completion
+  dist.resize (num_voxels);
+
+  Image::Buffer<node_t>::voxel_type voxel (nodes_data);
+  Image::Loop loop (0, 3);
+  for (loop.start (voxel); loop.ok(); loop.next (voxel)) {
+    const size_t i = index (Point<int> (voxel[0], voxel[1], voxel[2]));
+    dist[i] = voxel.value() ? 0.0 : std::numeric_limits<float>::infinity();
+  }
+
+  std::vector<float> f (maxvalue (dim[0], dim[1], dim[2]));
+  std::vector<int> v (f.size());
+  std::vector<float> z (f.size() + 1);
+
+  for (int k = 0; k != dim[2]; ++k) {
+    for (int j = 0; j != dim[1]; ++j)
+      transform_line (index (Point<int> (0, j, k)), 1, dim[0], nodes_data.vox(0), f, v, z);
+  }
+  for (int k = 0; k != dim[2]; ++k) {
+    for (int i = 0; i != dim[0]; ++i)
+      transform_line (index (Point<int> (i, 0, k)), dim[0], dim[1], nodes_data.vox(1), f, v, z);
+  }
+  for (int j = 0; j != dim[1]; ++j) {
+    for (int i = 0; i != dim[0]; ++i)
+      transform_line (index (Point<int> (i, j, 0)), size_t(dim[0]) * dim[1], dim[2], nodes_data.vox(2), f, v, z);
+  }
+
+  for (std::vector<float>::iterator d = dist.begin(); d != dist.end(); ++d)
+    *d = std::sqrt (*d);
+
+}
+
+
+
+void NodeDistanceField::transform_line (const size_t start, const size_t stride, const int size, const float spacing,
+                                        std::vector<float>& f, std::vector<int>& v, std::vector<float>& z)
+{
+
+  // Copy the current squared distances along this line, and determine the lower envelope of the
+  //   parabolae rooted at each sample; samples at infinite distance contribute no parabola
+  const float inf = std::numeric_limits<float>::infinity();
+  int k = -1;
+  for (int q = 0; q != size; ++q) {
+    const size_t i = start + q * stride;
+    f[q] = dist[i];
+    if (!std::isfinite (f[q]))
+      continue;
+    const float fq = f[q] + Math::pow2 (q * spacing);
+    float s = -inf;
+    while (k >= 0) {
+      s = (fq - (f[v[k]] + Math::pow2 (v[k] * spacing))) / (2.0 * spacing * spacing * (q - v[k]));
+      if (s > z[k])
+        break;
+      --k;
+    }
+    ++k;
+    v[k] = q;
+    z[k] = (k ? s : -inf);
+    z[k+1] = inf;
+  }
+
+  // No finite samples on this line: values remain infinite
+  if (k < 0)
+    return;
+
+  k = 0;
+  for (int q = 0; q != size; ++q) {
+    while (z[k+1] < q)
+      ++k;
+    const size_t i = start + q * stride;
+    dist[i] = f[v[k]] + Math::pow2 ((q - v[k]) * spacing);
+  }
+
+}
+
+
+
+
+
+
 node_t Tck2nodes_voxel::select_node (const Streamline<>& tck, VoxelType& voxel, bool end) const
 {
 
@@ -64,8 +156,11 @@ void Tck2nodes_radial::initialise_search ()
   }
 
   radial_search.reserve (radial_search_map.size());
-  for (std::multimap<float, Point<int> >::const_iterator i = radial_search_map.begin(); i != radial_search_map.end(); ++i)
+  radial_dists.reserve (radial_search_map.size());
+  for (std::multimap<float, Point<int> >::const_iterator i = radial_search_map.begin(); i != radial_search_map.end(); ++i) {
     radial_search.push_back (i->second);
+    radial_dists.push_back (i->first);
+  }
 
 }
 
@@ -82,7 +177,31 @@ node_t Tck2nodes_radial::select_node (const Streamline<>& tck, VoxelType& voxel,
   const Point<float> v_float = transform.scanner2voxel (p);
   const Point<int> v (std::round (v_float[0]), std::round (v_float[1]), std::round (v_float[2]));
 
-  for (std::vector< Point<int> >::const_iterator offset = radial_search.begin(); offset != radial_search.end(); ++offset) {
+  std::vector< Point<int> >::const_iterator offset = radial_search.begin();
+
+  if (distance_field->within_bounds (v)) {
+
+    // No voxel centre can be closer to the central voxel than the nearest node voxel;
+    //   if that voxel is beyond the search radius, there is nothing to be found
+    const float field_dist = distance_field->distance (v);
+    if (field_dist > max_dist + max_add_dist)
+      return 0;
+
+    // Offsets closer to the central voxel than the nearest node voxel cannot contain a node,
+    //   and offsets within max_dist cannot terminate the search; skipping these therefore
+    //   visits the remaining voxels in the same order as the exhaustive search, such that
+    //   ties between equidistant node voxels are resolved identically. The tolerance ensures
+    //   that rounding differences never cause a node voxel to be skipped.
+    const float skip_dist = std::min (field_dist, max_dist) * (1.0f - 1.0e-5f);
+    offset += std::lower_bound (radial_dists.begin(), radial_dists.end(), skip_dist) - radial_dists.begin();
+
+  }
+
+  for (; offset != radial_search.end(); ++offset) {
+
+    // No voxel from here on can be closer to the endpoint than the best node found thus far
+    if (radial_dists[offset - radial_search.begin()] > min_dist + max_add_dist)
+      return node;
 
     const Point<int> this_voxel (v + *offset);
     const Point<float> p_voxel (transform.voxel2scanner (this_voxel));
@@ -115,17 +234,24 @@ node_t Tck2nodes_revsearch::select_node (const Streamline<>& tck, VoxelType& vox
   const int step           = end ? -1 : 1;
 
   float dist = 0.0;
+  // Length of streamline that can be traversed without any possibility of entering a node voxel
+  float skip = 0.0;
 
   for (int index = start_index; index != midpoint_index; index += step) {
-    const Point<float>& p (tck[index]);
-    const Point<float> v_float = transform.scanner2voxel (p);
-    const Point<int> v (std::round (v_float[0]), std::round (v_float[1]), std::round (v_float[2]));
-    if (Image::Nav::within_bounds (voxel, v)) {
-      const node_t this_node = Image::Nav::get_value_at_pos (voxel, v);
-      if (this_node)
-        return this_node;
+    if (skip <= 0.0) {
+      const Point<float>& p (tck[index]);
+      const Point<float> v_float = transform.scanner2voxel (p);
+      const Point<int> v (std::round (v_float[0]), std::round (v_float[1]), std::round (v_float[2]));
+      if (Image::Nav::within_bounds (voxel, v)) {
+        const node_t this_node = Image::Nav::get_value_at_pos (voxel, v);
+        if (this_node)
+          return this_node;
+        skip = distance_field->distance (v) - max_skip_error;
+      }
     }
-    if (max_dist && ((dist += (tck[index] - tck[index+step]).norm()) > max_dist))
+    const float step_length = (tck[index] - tck[index+step]).norm();
+    skip -= step_length;
+    if (max_dist && ((dist += step_length) > max_dist))
       return 0;
   }
 
@@ -170,6 +296,10 @@ node_t Tck2nodes_forwardsearch::select_node (const Streamline<>& tck, VoxelType&
   const Point<int> v (std::round (vp[0]), std::round (vp[1]), std::round (vp[2]));
   if (!Image::Nav::within_bounds (nodes, v))
     return 0;
+  // The cost function is never less than the distance from the endpoint; if no node voxel
+  //   lies within the maximum distance, don't bother searching
+  if (distance_field->distance (v) > max_dist + max_add_dist)
+    return 0;
   visited.insert (v);
   to_test.insert (std::make_pair (0.0, v));
 
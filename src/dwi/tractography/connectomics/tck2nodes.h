@@ -28,6 +28,7 @@
 
 #include <stdint.h>
 #include <deque>
+#include <memory>
 #include <vector>
 #include <map>
 #include <set>
@@ -94,6 +95,39 @@ class Tck2nodes_base {
 
 
 
+// Precomputed exact Euclidean distance transform of the parcellation image:
+//   for every voxel, stores the distance (in mm, between voxel centres) to the nearest
+//   voxel with a non-zero node index.
+// This is computed once, and shared between the search-based assignment mechanisms;
+//   it allows them to reject endpoints that are too far from any node without any search,
+//   and to skip those portions of their search space that cannot contain a node.
+class NodeDistanceField {
+
+  public:
+    NodeDistanceField (Image::Buffer<node_t>&);
+
+    bool within_bounds (const Point<int>& v) const {
+      return (v[0] >= 0 && v[0] < dim[0] && v[1] >= 0 && v[1] < dim[1] && v[2] >= 0 && v[2] < dim[2]);
+    }
+
+    // Returns infinity if the parcellation image contains no nodes
+    float distance (const Point<int>& v) const { return dist[index (v)]; }
+
+  private:
+    int dim[3];
+    std::vector<float> dist;
+
+    size_t index (const Point<int>& v) const { return v[0] + dim[0] * (v[1] + size_t(dim[1]) * v[2]); }
+
+    // One-dimensional pass of the separable exact distance transform (Felzenszwalb & Huttenlocher)
+    void transform_line (const size_t start, const size_t stride, const int size, const float spacing,
+                         std::vector<float>&, std::vector<int>&, std::vector<float>&);
+
+};
+
+
+
+
 // Specific implementations of assignment methodologies
 
 // Most basic: look up the voxel value at the voxel containing the streamline endpoint
@@ -124,7 +158,8 @@ class Tck2nodes_radial : public Tck2nodes_base {
     Tck2nodes_radial (Image::Buffer<node_t>& nodes_data, const float radius) :
       Tck2nodes_base (nodes_data),
       max_dist       (radius),
-      max_add_dist   (std::sqrt (Math::pow2 (0.5 * nodes.vox(2)) + Math::pow2 (0.5 * nodes.vox(1)) + Math::pow2 (0.5 * nodes.vox(0))))
+      max_add_dist   (std::sqrt (Math::pow2 (0.5 * nodes.vox(2)) + Math::pow2 (0.5 * nodes.vox(1)) + Math::pow2 (0.5 * nodes.vox(0)))),
+      distance_field (new NodeDistanceField (nodes_data))
     {
       initialise_search ();
     }
@@ -132,8 +167,10 @@ class Tck2nodes_radial : public Tck2nodes_base {
     Tck2nodes_radial (const Tck2nodes_radial& that) :
       Tck2nodes_base (that),
       radial_search  (that.radial_search),
+      radial_dists   (that.radial_dists),
       max_dist       (that.max_dist),
-      max_add_dist   (that.max_add_dist) { }
+      max_add_dist   (that.max_add_dist),
+      distance_field (that.distance_field) { }
 
     ~Tck2nodes_radial() { }
 
@@ -142,12 +179,17 @@ class Tck2nodes_radial : public Tck2nodes_base {
 
     void initialise_search ();
     std::vector< Point<int> > radial_search;
+    // Distance of each offset in radial_search from the central voxel; used to skip directly
+    //   to those offsets that may contain a node according to the distance field
+    std::vector<float> radial_dists;
     const float max_dist;
     // Distances are sub-voxel from the precise streamline termination point, so the search order is imperfect.
     //   This parameter controls when to stop the radial search because no voxel within the search space can be closer
     //   than the closest voxel with non-zero node index processed thus far.
     const float max_add_dist;
 
+    std::shared_ptr<NodeDistanceField> distance_field;
+
     friend class Tck2nodes_visitation;
 
 };
@@ -161,11 +203,15 @@ class Tck2nodes_revsearch : public Tck2nodes_base
   public:
     Tck2nodes_revsearch (Image::Buffer<node_t>& nodes_data, const float length) :
       Tck2nodes_base (nodes_data),
-      max_dist       (length) { }
+      max_dist       (length),
+      max_skip_error (std::sqrt (Math::pow2 (nodes.vox(2)) + Math::pow2 (nodes.vox(1)) + Math::pow2 (nodes.vox(0)))),
+      distance_field (new NodeDistanceField (nodes_data)) { }
 
     Tck2nodes_revsearch (const Tck2nodes_revsearch& that) :
       Tck2nodes_base (that),
-      max_dist       (that.max_dist) { }
+      max_dist       (that.max_dist),
+      max_skip_error (that.max_skip_error),
+      distance_field (that.distance_field) { }
 
     ~Tck2nodes_revsearch() { }
 
@@ -173,6 +219,12 @@ class Tck2nodes_revsearch : public Tck2nodes_base
     node_t select_node (const Streamline<>& tck, VoxelType& voxel, bool end) const;
 
     const float max_dist;
+    // Both the current streamline point and the point that eventually reaches a node may lie anywhere
+    //   within their respective voxels; the length of streamline that can be safely skipped
+    //   is therefore the distance field value minus one voxel diagonal
+    const float max_skip_error;
+
+    std::shared_ptr<NodeDistanceField> distance_field;
 
 };
 
@@ -186,12 +238,16 @@ class Tck2nodes_forwardsearch : public Tck2nodes_base
     Tck2nodes_forwardsearch (Image::Buffer<node_t>& nodes_data, const float length) :
       Tck2nodes_base (nodes_data),
       max_dist       (length),
-      angle_limit    (Math::pi_4) { } // 45 degree limit
+      angle_limit    (Math::pi_4), // 45 degree limit
+      max_add_dist   (std::sqrt (Math::pow2 (0.5 * nodes.vox(2)) + Math::pow2 (0.5 * nodes.vox(1)) + Math::pow2 (0.5 * nodes.vox(0)))),
+      distance_field (new NodeDistanceField (nodes_data)) { }
 
     Tck2nodes_forwardsearch (const Tck2nodes_forwardsearch& that) :
       Tck2nodes_base (that),
       max_dist       (that.max_dist),
-      angle_limit    (that.angle_limit) { }
+      angle_limit    (that.angle_limit),
+      max_add_dist   (that.max_add_dist),
+      distance_field (that.distance_field) { }
 
     ~Tck2nodes_forwardsearch() { }
 
@@ -200,6 +256,9 @@ class Tck2nodes_forwardsearch : public Tck2nodes_base
 
     const float max_dist;
     const float angle_limit;
+    const float max_add_dist;
+
+    std::shared_ptr<NodeDistanceField> distance_field;
 
     float get_cf (const Point<float>&, const Point<float>&, const Point<int>&) const;
 
@@ -116,6 +116,48 @@ class VoxelDEC : public Voxel
 
 
 
+// Store the mean tangent direction of the streamline within the voxel; since the sign of the
+//   tangent is arbitrary, each contribution is flipped as necessary to agree with the current sum
+class VoxelDir : public Voxel
+{
+
+  public:
+    VoxelDir () :
+        Voxel (),
+        dir (Point<float> (0.0f, 0.0f, 0.0f)) { }
+
+    VoxelDir (const Point<int>& V) :
+        Voxel (V),
+        dir (Point<float> (0.0f, 0.0f, 0.0f)) { }
+
+    VoxelDir (const Point<int>& V, const Point<float>& d) :
+        Voxel (V),
+        dir (d) { }
+
+    VoxelDir (const Point<int>& V, const Point<float>& d, const float l) :
+        Voxel (V, l),
+        dir (d) { }
+
+    VoxelDir& operator=  (const VoxelDir& V)   { Voxel::operator= (V); dir = V.dir; return (*this); }
+    VoxelDir& operator=  (const Point<int>& V) { Voxel::operator= (V); dir = Point<float> (0.0f, 0.0f, 0.0f); return (*this); }
+
+    // For sorting / inserting, want to identify the same voxel, even if the direction is different
+    bool      operator== (const VoxelDir& V) const { return Voxel::operator== (V); }
+    bool      operator<  (const VoxelDir& V) const { return Voxel::operator< (V); }
+
+    void normalise() const { Voxel::normalise(); dir.normalise(); }
+    void set_dir (const Point<float>& i) { dir = i; }
+    void add (const Point<float>& i, const float l) const { Voxel::operator+= (l); dir += i * (dir.dot (i) < 0.0f ? -l : l); }
+    void operator+= (const Point<float>& i) const { Voxel::operator+= (1.0f); dir += (dir.dot (i) < 0.0f ? -i : i); }
+    const Point<float>& get_dir() const { return dir; }
+
+  private:
+    mutable Point<float> dir;
+
+};
+
+
+
 // Assumes tangent has been mapped to a hemisphere basis direction set
 class Dixel : public Voxel
 {
@@ -275,6 +317,29 @@ class SetVoxelDEC : public std::set<VoxelDEC>, public SetVoxelExtras
       insert (temp);
     }
 };
+class SetVoxelDir : public std::set<VoxelDir>, public SetVoxelExtras
+{
+  public:
+    typedef VoxelDir VoxType;
+    inline void insert (const VoxelDir& v)
+    {
+      iterator existing = std::set<VoxelDir>::find (v);
+      if (existing == std::set<VoxelDir>::end())
+        std::set<VoxelDir>::insert (v);
+      else
+        (*existing).add (v.get_dir(), v.get_length());
+    }
+    inline void insert (const Point<int>& v, const Point<float>& d)
+    {
+      const VoxelDir temp (v, d);
+      insert (temp);
+    }
+    inline void insert (const Point<int>& v, const Point<float>& d, const float l)
+    {
+      const VoxelDir temp (v, d, l);
+      insert (temp);
+    }
+};
 class SetDixel : public std::set<Dixel>, public SetVoxelExtras
 {
   public:
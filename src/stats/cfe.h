@@ -21,8 +21,28 @@
 #ifndef __stats_cfe_h__
 #define __stats_cfe_h__
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+
 #include "image/buffer_scratch.h"
-#include "dwi/tractography/mapping/mapper.h"
+#include "image/nav.h"
+#include "file/ofstream.h"
+#include "thread.h"
+#include "dwi/tractography/mapping/voxel.h"
+
+
+// Number of fixel-fixel pairs buffered by each tracking thread before being
+//   sorted, compressed, and passed to the shared ConnectivityBuilder
+#define CFE_PAIR_BUFFER_SIZE 16777216
+
+// Number of fixels processed at a time by each thread during enhancement
+#define CFE_FIXEL_BLOCK_SIZE 256
+
 
 namespace MR
 {
@@ -39,17 +59,314 @@ namespace MR
       @{ */
 
 
-      class connectivity {
+
+      /**
+       * Fixel-fixel connectivity, stored in compressed sparse row format.
+       * The matrix is symmetric; each row lists the connected fixels in increasing
+       * order of index. Weights are stored either as floats, or quantised to
+       * 16-bit integers (with a single scaling factor for the whole matrix) to
+       * reduce memory usage. Additional key-value properties (e.g. the parameters
+       * used to compute the matrix) are stored in the file header.
+       */
+      class ConnectivityMatrix {
         public:
-          connectivity () : value (0.0) { }
-          value_type value;
+          typedef std::map<std::string, std::string> Properties;
+
+          ConnectivityMatrix () : quantised (false), scale (1.0) { }
+
+          size_t size() const { return offsets.size() ? offsets.size() - 1 : 0; }
+          size_t nonzero() const { return columns.size(); }
+          bool is_quantised() const { return quantised; }
+
+          size_t row_begin (const size_t fixel) const { return offsets[fixel]; }
+          size_t row_end   (const size_t fixel) const { return offsets[fixel+1]; }
+          uint32_t column  (const size_t k)     const { return columns[k]; }
+          value_type value (const size_t k)     const { return quantised ? (scale * quantised_weights[k]) : weights[k]; }
+
+          const uint32_t*   column_data() const { return columns.data(); }
+          const value_type* weight_data() const { return weights.data(); }
+          const uint16_t*   quantised_weight_data() const { return quantised_weights.data(); }
+          value_type        get_scale() const { return scale; }
+
+          Properties&       properties()       { return props; }
+          const Properties& properties() const { return props; }
+
+          // Divide the weights in each row by the track density of that fixel, and
+          //   discard any connections with a normalised weight below the threshold;
+          //   each fixel is then fully connected to itself, such that a fixel without
+          //   any surviving connections still contributes its own extent to the CFE
+          void normalise (const std::vector<uint16_t>& fixel_TDI, const value_type threshold)
+          {
+            if (fixel_TDI.size() != size())
+              throw Exception ("Fixel track density does not match size of connectivity matrix");
+            if (quantised)
+              throw Exception ("Cannot normalise a quantised connectivity matrix");
+            std::vector<uint32_t> out_columns;
+            std::vector<value_type> out_weights;
+            out_columns.reserve (columns.size() + size());
+            out_weights.reserve (weights.size() + size());
+            size_t row_start = 0;
+            for (size_t fixel = 0; fixel != size(); ++fixel) {
+              const size_t in_end = offsets[fixel+1];
+              bool diagonal = false;
+              for (size_t k = row_start; k != in_end; ++k) {
+                if (!diagonal && columns[k] >= fixel) {
+                  out_columns.push_back (fixel);
+                  out_weights.push_back (1.0);
+                  diagonal = true;
+                  if (columns[k] == fixel)
+                    continue;
+                }
+                const value_type w = fixel_TDI[fixel] ? (weights[k] / value_type (fixel_TDI[fixel])) : 0.0;
+                if (w >= threshold && w > 0.0) {
+                  out_columns.push_back (columns[k]);
+                  out_weights.push_back (w);
+                }
+              }
+              if (!diagonal) {
+                out_columns.push_back (fixel);
+                out_weights.push_back (1.0);
+              }
+              row_start = in_end;
+              offsets[fixel+1] = out_columns.size();
+            }
+            columns.swap (out_columns);
+            weights.swap (out_weights);
+          }
+
+          // Convert the weights to 16-bit integers, discarding the float weights
+          void quantise ()
+          {
+            if (quantised)
+              return;
+            const value_type max_weight = weights.size() ? *std::max_element (weights.begin(), weights.end()) : value_type (1.0);
+            scale = max_weight > 0.0 ? (max_weight / value_type (std::numeric_limits<uint16_t>::max())) : value_type (1.0);
+            quantised_weights.resize (weights.size());
+            for (size_t k = 0; k != weights.size(); ++k)
+              quantised_weights[k] = uint16_t (std::min (std::round (weights[k] / scale), value_type (std::numeric_limits<uint16_t>::max())));
+            std::vector<value_type>().swap (weights);
+            quantised = true;
+          }
+
+          void save (const std::string& path) const
+          {
+            File::OFStream out (path, std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+            out << "mrtrix fixel connectivity\n";
+            out << "fixels: " << size() << "\n";
+            out << "connections: " << nonzero() << "\n";
+            out << "weights: " << (quantised ? "uint16" : "float32") << "\n";
+            out << "scale: " << str (scale) << "\n";
+            for (Properties::const_iterator i = props.begin(); i != props.end(); ++i)
+              out << i->first << ": " << i->second << "\n";
+            out << "END\n";
+            out.write (reinterpret_cast<const char*> (offsets.data()), offsets.size() * sizeof (uint64_t));
+            out.write (reinterpret_cast<const char*> (columns.data()), columns.size() * sizeof (uint32_t));
+            if (quantised)
+              out.write (reinterpret_cast<const char*> (quantised_weights.data()), quantised_weights.size() * sizeof (uint16_t));
+            else
+              out.write (reinterpret_cast<const char*> (weights.data()), weights.size() * sizeof (value_type));
+            if (!out.good())
+              throw Exception ("error writing fixel connectivity file \"" + path + "\"");
+          }
+
+          void load (const std::string& path)
+          {
+            std::ifstream in (path.c_str(), std::ios_base::in | std::ios_base::binary);
+            if (!in)
+              throw Exception ("failed to open fixel connectivity file \"" + path + "\"");
+            std::string line;
+            std::getline (in, line);
+            if (line != "mrtrix fixel connectivity")
+              throw Exception ("file \"" + path + "\" is not a fixel connectivity file");
+            size_t num_fixels = 0, num_connections = 0;
+            bool header_quantised = false;
+            value_type header_scale = 1.0;
+            props.clear();
+            while (std::getline (in, line) && line != "END") {
+              const size_t colon = line.find (": ");
+              if (colon == std::string::npos)
+                throw Exception ("malformed header in fixel connectivity file \"" + path + "\"");
+              const std::string key = line.substr (0, colon), value = line.substr (colon + 2);
+              if (key == "fixels")
+                num_fixels = to<size_t> (value);
+              else if (key == "connections")
+                num_connections = to<size_t> (value);
+              else if (key == "weights")
+                header_quantised = (value == "uint16");
+              else if (key == "scale")
+                header_scale = to<value_type> (value);
+              else
+                props[key] = value;
+            }
+            if (line != "END")
+              throw Exception ("unexpected end of header in fixel connectivity file \"" + path + "\"");
+            offsets.resize (num_fixels + 1);
+            columns.resize (num_connections);
+            in.read (reinterpret_cast<char*> (offsets.data()), offsets.size() * sizeof (uint64_t));
+            in.read (reinterpret_cast<char*> (columns.data()), columns.size() * sizeof (uint32_t));
+            quantised = header_quantised;
+            scale = header_scale;
+            if (quantised) {
+              std::vector<value_type>().swap (weights);
+              quantised_weights.resize (num_connections);
+              in.read (reinterpret_cast<char*> (quantised_weights.data()), quantised_weights.size() * sizeof (uint16_t));
+            } else {
+              std::vector<uint16_t>().swap (quantised_weights);
+              weights.resize (num_connections);
+              in.read (reinterpret_cast<char*> (weights.data()), weights.size() * sizeof (value_type));
+            }
+            if (!in || offsets.back() != num_connections)
+              throw Exception ("error reading fixel connectivity file \"" + path + "\"");
+          }
+
+        protected:
+          std::vector<uint64_t> offsets;
+          std::vector<uint32_t> columns;
+          std::vector<value_type> weights;
+          std::vector<uint16_t> quantised_weights;
+          bool quantised;
+          value_type scale;
+          Properties props;
+
+          friend class ConnectivityBuilder;
       };
 
 
 
 
       /**
-       * Process each track by converting each streamline to a set of dixels, and map these to fixels.
+       * Accumulates fixel-fixel streamline counts from multiple TrackProcessor
+       * instances, and converts them into a ConnectivityMatrix once all streamlines
+       * have been processed. Each fixel pair is stored only once (smaller index
+       * first) as a 64-bit key; sorted, run-length encoded blocks of pairs from each
+       * thread are merged such that no two stored blocks differ greatly in size.
+       * Each TrackProcessor obtains its pair buffer from the builder, such that any
+       * pairs still buffered once tracking has completed are merged by finalise().
+       */
+      class ConnectivityBuilder {
+        public:
+          typedef std::pair<uint64_t, uint32_t> Entry;
+
+          ConnectivityBuilder (const size_t num_fixels) : num_fixels (num_fixels) { }
+
+          // Provide a new buffer for a TrackProcessor to accumulate pairs into
+          std::shared_ptr<std::vector<uint64_t> > buffer ()
+          {
+            std::lock_guard<std::mutex> lock (mutex);
+            buffers.push_back (std::make_shared<std::vector<uint64_t> >());
+            return buffers.back();
+          }
+
+          // Sort the pairs provided, and merge them into the stored blocks; the input is cleared
+          void add (std::vector<uint64_t>& pairs)
+          {
+            if (pairs.empty())
+              return;
+            std::sort (pairs.begin(), pairs.end());
+            std::vector<Entry> block;
+            for (std::vector<uint64_t>::const_iterator p = pairs.begin(); p != pairs.end(); ++p) {
+              if (block.size() && block.back().first == *p)
+                ++block.back().second;
+              else
+                block.push_back (Entry (*p, 1));
+            }
+            pairs.clear();
+            std::lock_guard<std::mutex> lock (mutex);
+            blocks.push_back (std::move (block));
+            while (blocks.size() > 1 && blocks[blocks.size()-2].size() <= 2 * blocks.back().size()) {
+              std::vector<Entry> merged = merge (blocks[blocks.size()-2], blocks.back());
+              blocks.pop_back();
+              blocks.back().swap (merged);
+            }
+          }
+
+          // Merge the pairs remaining in all buffers, and convert the accumulated counts
+          //   into a symmetric matrix; must only be called once all tracks have been processed
+          void finalise (ConnectivityMatrix& matrix)
+          {
+            for (std::vector<std::shared_ptr<std::vector<uint64_t> > >::iterator b = buffers.begin(); b != buffers.end(); ++b)
+              add (**b);
+            buffers.clear();
+            while (blocks.size() > 1) {
+              std::vector<Entry> merged = merge (blocks[blocks.size()-2], blocks.back());
+              blocks.pop_back();
+              blocks.back().swap (merged);
+            }
+            const std::vector<Entry> empty;
+            const std::vector<Entry>& entries (blocks.size() ? blocks.front() : empty);
+
+            matrix.quantised = false;
+            matrix.scale = 1.0;
+            std::vector<uint16_t>().swap (matrix.quantised_weights);
+            matrix.offsets.assign (num_fixels + 1, 0);
+            for (std::vector<Entry>::const_iterator e = entries.begin(); e != entries.end(); ++e) {
+              const uint32_t a = e->first >> 32, b = e->first & 0xFFFFFFFF;
+              ++matrix.offsets[a+1];
+              if (a != b)
+                ++matrix.offsets[b+1];
+            }
+            for (size_t f = 1; f != matrix.offsets.size(); ++f)
+              matrix.offsets[f] += matrix.offsets[f-1];
+            matrix.columns.resize (matrix.offsets.back());
+            matrix.weights.resize (matrix.offsets.back());
+            // Since entries are sorted by (smaller index, larger index), filling in this order
+            //   results in the columns of each row being sorted
+            std::vector<uint64_t> fill (matrix.offsets.begin(), matrix.offsets.end() - 1);
+            for (std::vector<Entry>::const_iterator e = entries.begin(); e != entries.end(); ++e) {
+              const uint32_t a = e->first >> 32, b = e->first & 0xFFFFFFFF;
+              if (a == b) {
+                // Pairs within the same fixel contribute in both directions
+                matrix.columns[fill[a]] = a;
+                matrix.weights[fill[a]++] = 2.0 * e->second;
+              } else {
+                matrix.columns[fill[a]] = b;
+                matrix.weights[fill[a]++] = e->second;
+                matrix.columns[fill[b]] = a;
+                matrix.weights[fill[b]++] = e->second;
+              }
+            }
+            blocks.clear();
+          }
+
+          static uint64_t key (const uint32_t a, const uint32_t b)
+          {
+            return (a < b) ? ((uint64_t (a) << 32) | b) : ((uint64_t (b) << 32) | a);
+          }
+
+        private:
+          const size_t num_fixels;
+          std::vector<std::vector<Entry> > blocks;
+          std::vector<std::shared_ptr<std::vector<uint64_t> > > buffers;
+          std::mutex mutex;
+
+          static std::vector<Entry> merge (const std::vector<Entry>& a, const std::vector<Entry>& b)
+          {
+            std::vector<Entry> out;
+            out.reserve (a.size() + b.size());
+            std::vector<Entry>::const_iterator i = a.begin(), j = b.begin();
+            while (i != a.end() && j != b.end()) {
+              if (i->first < j->first) {
+                out.push_back (*i++);
+              } else if (j->first < i->first) {
+                out.push_back (*j++);
+              } else {
+                out.push_back (Entry (i->first, i->second + j->second));
+                ++i; ++j;
+              }
+            }
+            out.insert (out.end(), i, a.end());
+            out.insert (out.end(), j, b.end());
+            return out;
+          }
+      };
+
+
+
+
+      /**
+       * Process each track by converting each streamline to a set of voxel tangents, and map these to fixels.
+       * Fixel pairs are buffered in storage owned by the ConnectivityBuilder; the owner must call
+       * ConnectivityBuilder::finalise() once all tracks have been processed.
        */
       class TrackProcessor {
 
@@ -57,21 +374,30 @@ namespace MR
           TrackProcessor (Image::BufferScratch<int32_t>& fixel_indexer,
                           const std::vector<Point<value_type> >& fixel_directions,
                           std::vector<uint16_t>& fixel_TDI,
-                          std::vector<std::map<int32_t, connectivity> >& connectivity_matrix,
+                          ConnectivityBuilder& connectivity_builder,
                           value_type angular_threshold):
                           fixel_indexer (fixel_indexer) ,
                           fixel_directions (fixel_directions),
                           fixel_TDI (fixel_TDI),
-                          connectivity_matrix (connectivity_matrix) {
+                          connectivity_builder (connectivity_builder),
+                          pairs (connectivity_builder.buffer()) {
             angular_threshold_dp = cos (angular_threshold * (M_PI/180.0));
           }
 
+          TrackProcessor (const TrackProcessor& that) :
+                          fixel_indexer (that.fixel_indexer),
+                          fixel_directions (that.fixel_directions),
+                          fixel_TDI (that.fixel_TDI),
+                          connectivity_builder (that.connectivity_builder),
+                          angular_threshold_dp (that.angular_threshold_dp),
+                          pairs (connectivity_builder.buffer()) { }
+
           bool operator () (SetVoxelDir& in)
           {
             // For each voxel tract tangent, assign to a fixel
             std::vector<int32_t> tract_fixel_indices;
             for (SetVoxelDir::const_iterator i = in.begin(); i != in.end(); ++i) {
-              Image::Nav::set_pos (fixel_indexer, *i);
+              Image::Nav::set_pos (fixel_indexer, *i, 0, 3);
               fixel_indexer[3] = 0;
               int32_t first_index = fixel_indexer.value();
               if (first_index >= 0) {
@@ -82,7 +408,7 @@ namespace MR
                 Point<value_type> dir (i->get_dir());
                 dir.normalise();
                 for (int32_t j = first_index; j < last_index; ++j) {
-                  value_type dp = Math::abs (dir.dot (fixel_directions[j]));
+                  value_type dp = std::abs (dir.dot (fixel_directions[j]));
                   if (dp > largest_dp) {
                     largest_dp = dp;
                     closest_fixel_index = j;
@@ -96,12 +422,11 @@ namespace MR
             }
 
             for (size_t i = 0; i < tract_fixel_indices.size(); i++) {
-              for (size_t j = i + 1; j < tract_fixel_indices.size(); j++) {
-                connectivity_matrix[tract_fixel_indices[i]][tract_fixel_indices[j]].value++;
-                connectivity_matrix[tract_fixel_indices[j]][tract_fixel_indices[i]].value++;
-              }
-           }
-
+              for (size_t j = i + 1; j < tract_fixel_indices.size(); j++)
+                pairs->push_back (ConnectivityBuilder::key (tract_fixel_indices[i], tract_fixel_indices[j]));
+            }
+            if (pairs->size() >= CFE_PAIR_BUFFER_SIZE)
+              connectivity_builder.add (*pairs);
 
             return true;
           }
@@ -110,44 +435,121 @@ namespace MR
           Image::BufferScratch<int32_t>::voxel_type fixel_indexer;
           const std::vector<Point<value_type> >& fixel_directions;
           std::vector<uint16_t>& fixel_TDI;
-          std::vector<std::map<int32_t, connectivity> >& connectivity_matrix;
+          ConnectivityBuilder& connectivity_builder;
           value_type angular_threshold_dp;
+          std::shared_ptr<std::vector<uint64_t> > pairs;
       };
 
 
 
 
+      /**
+       * Connectivity-based fixel enhancement.
+       *
+       * For each fixel, the neighbouring fixels whose statistic exceeds the lowest
+       * threshold are sorted by statistic, and the connectivity weights accumulated
+       * from the highest statistic downwards. The extent at each successive threshold
+       * is then read from this cumulative sum, advancing through the sorted
+       * neighbours as the threshold increases, rather than rescanning the full
+       * neighbour list at every threshold. Fixels are processed in blocks, optionally
+       * using multiple threads within each call; use a single thread (the default)
+       * when the enhancer is already being run across permutations in parallel.
+       */
       class Enhancer {
         public:
-          Enhancer (const std::vector<std::map<int32_t, connectivity> >& connectivity_map,
-                    const value_type dh, const value_type E, const value_type H) :
-                    connectivity_map (connectivity_map), dh (dh), E (E), H (H) { }
+          Enhancer (const ConnectivityMatrix& connectivity_matrix,
+                    const value_type dh, const value_type E, const value_type H,
+                    const size_t num_threads = 1) :
+                    connectivity_matrix (connectivity_matrix), dh (dh), E (E), H (H), num_threads (num_threads) { }
 
           value_type operator() (const value_type max_stat, const std::vector<value_type>& stats,
                                  std::vector<value_type>& enhanced_stats) const
           {
             enhanced_stats.resize (stats.size());
             std::fill (enhanced_stats.begin(), enhanced_stats.end(), 0.0);
-            value_type max_enhanced_stat = 0.0;
-            for (size_t fixel = 0; fixel < connectivity_map.size(); ++fixel) {
-              std::map<int32_t, connectivity>::const_iterator connected_fixel;
-              for (value_type h = this->dh; h < stats[fixel]; h +=  this->dh) {
-                value_type extent = 0.0;
-                for (connected_fixel = connectivity_map[fixel].begin(); connected_fixel != connectivity_map[fixel].end(); ++connected_fixel)
-                  if (stats[connected_fixel->first] > h)
-                    extent += connected_fixel->second.value;
-                enhanced_stats[fixel] += Math::pow (extent, E) * Math::pow (h, H);
-              }
-              if (enhanced_stats[fixel] > max_enhanced_stat)
-                max_enhanced_stat = enhanced_stats[fixel];
-            }
-
-            return max_enhanced_stat;
+            if (connectivity_matrix.is_quantised())
+              run (Kernel<uint16_t> (*this, connectivity_matrix.quantised_weight_data(), connectivity_matrix.get_scale(), stats, enhanced_stats));
+            else
+              run (Kernel<value_type> (*this, connectivity_matrix.weight_data(), value_type (1.0), stats, enhanced_stats));
+            return enhanced_stats.size() ? *std::max_element (enhanced_stats.begin(), enhanced_stats.end()) : value_type (0.0);
           }
 
         protected:
-          const std::vector<std::map<int32_t, connectivity> >& connectivity_map;
+          const ConnectivityMatrix& connectivity_matrix;
           const value_type dh, E, H;
+          const size_t num_threads;
+
+
+          template <typename WeightType>
+          class Kernel {
+            public:
+              Kernel (const Enhancer& master, const WeightType* weights, const value_type scale,
+                      const std::vector<value_type>& stats, std::vector<value_type>& enhanced_stats) :
+                        master (master), weights (weights), scale (scale), stats (stats), enhanced_stats (enhanced_stats),
+                        next_fixel (std::make_shared<std::atomic<size_t> > (0)) { }
+
+              Kernel (const Kernel& that) :
+                        master (that.master), weights (that.weights), scale (that.scale), stats (that.stats),
+                        enhanced_stats (that.enhanced_stats), next_fixel (that.next_fixel) { }
+
+              void execute ()
+              {
+                const size_t num_fixels = master.connectivity_matrix.size();
+                size_t start;
+                while ((start = next_fixel->fetch_add (CFE_FIXEL_BLOCK_SIZE)) < num_fixels) {
+                  const size_t end = std::min (start + CFE_FIXEL_BLOCK_SIZE, num_fixels);
+                  for (size_t fixel = start; fixel != end; ++fixel)
+                    enhanced_stats[fixel] = enhance (fixel);
+                }
+              }
+
+            private:
+              typedef std::pair<value_type, value_type> Neighbour;
+
+              const Enhancer& master;
+              const WeightType* weights;
+              const value_type scale;
+              const std::vector<value_type>& stats;
+              std::vector<value_type>& enhanced_stats;
+              std::shared_ptr<std::atomic<size_t> > next_fixel;
+              std::vector<Neighbour> neighbours;
+
+              value_type enhance (const size_t fixel)
+              {
+                if (stats[fixel] <= master.dh)
+                  return 0.0;
+                // Only neighbours exceeding the lowest threshold can ever contribute
+                const uint32_t* columns = master.connectivity_matrix.column_data();
+                neighbours.clear();
+                for (size_t k = master.connectivity_matrix.row_begin (fixel); k != master.connectivity_matrix.row_end (fixel); ++k) {
+                  if (stats[columns[k]] > master.dh)
+                    neighbours.push_back (Neighbour (stats[columns[k]], weights[k]));
+                }
+                std::sort (neighbours.begin(), neighbours.end());
+                // Convert weights to the total weight of all neighbours with the same or higher statistic
+                for (size_t n = neighbours.size(); n-- > 1;)
+                  neighbours[n-1].second += neighbours[n].second;
+                value_type enhanced = 0.0;
+                size_t n = 0;
+                for (value_type h = master.dh; h < stats[fixel]; h += master.dh) {
+                  while (n != neighbours.size() && !(neighbours[n].first > h))
+                    ++n;
+                  const value_type extent = (n == neighbours.size()) ? value_type (0.0) : neighbours[n].second;
+                  enhanced += std::pow (scale * extent, master.E) * std::pow (h, master.H);
+                }
+                return enhanced;
+              }
+          };
+
+
+          template <class KernelType>
+          void run (KernelType&& kernel) const
+          {
+            if (num_threads > 1)
+              Thread::run (Thread::multi (kernel, num_threads), "CFE enhancement");
+            else
+              kernel.execute();
+          }
       };
 
 
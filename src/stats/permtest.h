@@ -24,12 +24,17 @@
 #include <mutex>
 
 #include <gsl/gsl_linalg.h>
+#include <gsl/gsl_cdf.h>
 
 #include "math/vector.h"
 #include "math/stats/permutation.h"
 
 #include "thread_queue.h"
 
+
+// Number of permutations run between successive checks of the stopping criterion in sequential permutation testing
+#define PERMTEST_SEQUENTIAL_BLOCK_SIZE 100
+
 namespace MR
 {
   namespace Stats
@@ -41,32 +46,74 @@ namespace MR
 
 
 
+      /*! Permutations are generated on demand as they are requested, rather than all in advance.
+       * The stack may cover a sub-range of the full permutation sequence, starting at
+       * \a first_permutation; indices returned are relative to the start of that range.
+       * For a given seed, the permutations generated are identical to those at the
+       * same position in the full sequence. The permutations made available can
+       * be restricted using set_limit(), such that the sequence can be processed
+       * in stages. */
       class PermutationStack {
         public:
-          PermutationStack (size_t num_permutations, size_t num_samples, std::string msg, bool include_default = true) :
+          PermutationStack (size_t num_permutations, size_t num_samples, std::string msg, bool include_default = true,
+                            size_t first_permutation = 0, uint64_t seed = Math::RNG::get_seed()) :
             num_permutations (num_permutations),
+            first_permutation (first_permutation),
             current_permutation (0),
-            progress (msg, num_permutations) {
-              Math::Stats::generate_permutations (num_permutations, num_samples, permutations, include_default);
+            limit (num_permutations),
+            progress (msg, num_permutations),
+            generator (num_samples, seed, include_default) {
+              generator.skip (first_permutation);
             }
 
-          size_t next () {
+          //! retrieve the next permutation; returns its index (>= num_permutations if none remain)
+          size_t next (std::vector<size_t>& labelling) {
+            std::lock_guard<std::mutex> lock (permutation_mutex);
+            if (current_permutation >= limit)
+              return num_permutations;
+            generator.next (labelling);
+            ++progress;
+            return current_permutation++;
+          }
+          //! retrieve up to \a count permutations and their indices; returns the number retrieved
+          size_t next (const size_t count, std::vector<size_t>& indices, std::vector<std::vector<size_t> >& labellings) {
             std::lock_guard<std::mutex> lock (permutation_mutex);
-            size_t index = current_permutation++;
-            if (index < permutations.size())
+            indices.clear();
+            labellings.resize (count);
+            while (indices.size() < count && current_permutation < limit) {
+              generator.next (labellings[indices.size()]);
+              indices.push_back (current_permutation++);
               ++progress;
-            return index;
+            }
+            labellings.resize (indices.size());
+            return indices.size();
           }
-          const std::vector<size_t>& permutation (size_t index) const {
-            return permutations[index];
+          //! regenerate a permutation that has already been retrieved
+          void permutation (size_t index, std::vector<size_t>& labelling) {
+            std::lock_guard<std::mutex> lock (permutation_mutex);
+            generator.get (first_permutation + index, labelling);
+          }
+          //! only make permutations up to (but not including) index \a count available
+          void set_limit (size_t count) {
+            std::lock_guard<std::mutex> lock (permutation_mutex);
+            limit = std::min (count, num_permutations);
+          }
+          //! complete the progress display if processing stops before all permutations have been retrieved
+          void finish () {
+            std::lock_guard<std::mutex> lock (permutation_mutex);
+            if (current_permutation < num_permutations)
+              progress.set_text ("stopped after " + str(current_permutation) + " of " + str(num_permutations) + " permutations");
+            for (size_t n = current_permutation; n < num_permutations; ++n)
+              ++progress;
+            progress.done();
           }
 
-          const size_t num_permutations;
+          const size_t num_permutations, first_permutation;
 
         protected:
-          size_t current_permutation;
+          size_t current_permutation, limit;
           ProgressBar progress;
-          std::vector <std::vector<size_t> > permutations;
+          Math::Stats::PermutationGenerator generator;
           std::mutex permutation_mutex;
       };
 
@@ -96,17 +143,16 @@ namespace MR
 
             void execute ()
             {
-              size_t index;
-              while (( index = perm_stack.next() ) < perm_stack.num_permutations)
-                process_permutation (index);
+              while (perm_stack.next (labelling) < perm_stack.num_permutations)
+                process_permutation ();
             }
 
           protected:
 
-            void process_permutation (size_t index)
+            void process_permutation ()
             {
               value_type max_stat = 0.0, min_stat = 0.0;
-              stats_calculator (perm_stack.permutation (index), stats, max_stat, min_stat);
+              stats_calculator (labelling, stats, max_stat, min_stat);
               enhancer (max_stat, stats, enhanced_stats);
               for (size_t i = 0; i < enhanced_stats.size(); ++i) {
                 if (enhanced_stats[i] > 0.0) {
@@ -125,6 +171,7 @@ namespace MR
             std::vector<size_t> enhanced_count;
             std::vector<value_type> stats;
             std::vector<value_type> enhanced_stats;
+            std::vector<size_t> labelling;
         };
 
 
@@ -138,8 +185,9 @@ namespace MR
                          const EnhancementType& enhancer, const std::shared_ptr<std::vector<double> >& empirical_enhanced_statistics,
                          const std::vector<value_type>& default_enhanced_statistics, const std::shared_ptr<std::vector<value_type> >& default_enhanced_statistics_neg,
                          Math::Vector<value_type>& perm_dist_pos, std::shared_ptr<Math::Vector<value_type> >& perm_dist_neg,
-                         std::vector<size_t>& global_uncorrected_pvalue_counter, std::shared_ptr<std::vector<size_t> >& global_uncorrected_pvalue_counter_neg) :
-                           perm_stack (permutation_stack), stats_calculator (stats_calculator),
+                         std::vector<size_t>& global_uncorrected_pvalue_counter, std::shared_ptr<std::vector<size_t> >& global_uncorrected_pvalue_counter_neg,
+                         const size_t batch_size = 1) :
+                           perm_stack (permutation_stack), batch_size (batch_size), stats_calculator (stats_calculator),
                            enhancer (enhancer), empirical_enhanced_statistics (empirical_enhanced_statistics),
                            default_enhanced_statistics (default_enhanced_statistics), default_enhanced_statistics_neg (default_enhanced_statistics_neg),
                            statistics (stats_calculator.num_elements()), enhanced_statistics (stats_calculator.num_elements()),
@@ -156,15 +204,21 @@ namespace MR
                 for (size_t i = 0; i < stats_calculator.num_elements(); ++i) {
                   global_uncorrected_pvalue_counter[i] += uncorrected_pvalue_counter[i];
                   if (global_uncorrected_pvalue_counter_neg)
-                    (*global_uncorrected_pvalue_counter_neg)[i] = (*uncorrected_pvalue_counter_neg)[i];
+                    (*global_uncorrected_pvalue_counter_neg)[i] += (*uncorrected_pvalue_counter_neg)[i];
                 }
               }
 
               void execute ()
               {
-                size_t index;
-                while (( index = perm_stack.next() ) < perm_stack.num_permutations)
-                    process_permutation (index);
+                if (batch_size > 1) {
+                  std::vector<size_t> indices;
+                  while (perm_stack.next (batch_size, indices, batch_labellings))
+                    process_permutations (indices);
+                } else {
+                  size_t index;
+                  while (( index = perm_stack.next (labelling) ) < perm_stack.num_permutations)
+                      process_permutation (index);
+                }
               }
 
 
@@ -173,7 +227,23 @@ namespace MR
               void process_permutation (size_t index)
               {
                 value_type max_stat = 0.0, min_stat = 0.0;
-                stats_calculator (perm_stack.permutation (index), statistics, max_stat, min_stat);
+                stats_calculator (labelling, statistics, max_stat, min_stat);
+                process_statistics (index, max_stat, min_stat);
+              }
+
+              // Compute the statistics for a block of permutations with a single call to the stats calculator
+              void process_permutations (const std::vector<size_t>& indices)
+              {
+                stats_calculator (batch_labellings, batch_statistics, batch_max_stats, batch_min_stats);
+                for (size_t p = 0; p < indices.size(); ++p) {
+                  std::swap (statistics, batch_statistics[p]);
+                  process_statistics (indices[p], batch_max_stats[p], batch_min_stats[p]);
+                  std::swap (statistics, batch_statistics[p]);
+                }
+              }
+
+              void process_statistics (size_t index, const value_type max_stat, const value_type min_stat)
+              {
                 perm_dist_pos[index] = enhancer (max_stat, statistics, enhanced_statistics);
 
                 if (empirical_enhanced_statistics) {
@@ -215,6 +285,7 @@ namespace MR
 
 
               PermutationStack& perm_stack;
+              const size_t batch_size;
               StatsType stats_calculator;
               EnhancementType enhancer;
               std::shared_ptr<std::vector<double> > empirical_enhanced_statistics;
@@ -228,6 +299,10 @@ namespace MR
               std::shared_ptr<Math::Vector<value_type> > perm_dist_neg;
               std::vector<size_t>& global_uncorrected_pvalue_counter;
               std::shared_ptr<std::vector<size_t> > global_uncorrected_pvalue_counter_neg;
+              std::vector<size_t> labelling;
+              std::vector<std::vector<size_t> > batch_labellings;
+              std::vector<std::vector<value_type> > batch_statistics;
+              std::vector<value_type> batch_max_stats, batch_min_stats;
         };
 
 
@@ -297,7 +372,8 @@ namespace MR
                                         const std::shared_ptr<std::vector<double> >& empirical_enhanced_statistic,
                                         const std::vector<value_type>& default_enhanced_statistics, const std::shared_ptr<std::vector<value_type> >& default_enhanced_statistics_neg,
                                         Math::Vector<value_type>& perm_dist_pos, std::shared_ptr<Math::Vector<value_type> >& perm_dist_neg,
-                                        std::vector<value_type>& uncorrected_pvalues, std::shared_ptr<std::vector<value_type> >& uncorrected_pvalues_neg)
+                                        std::vector<value_type>& uncorrected_pvalues, std::shared_ptr<std::vector<value_type> >& uncorrected_pvalues_neg,
+                                        const size_t batch_size = 1)
           {
 
             std::vector<size_t> global_uncorrected_pvalue_count (stats_calculator.num_elements(), 0);
@@ -314,7 +390,8 @@ namespace MR
                                                                empirical_enhanced_statistic,
                                                                default_enhanced_statistics, default_enhanced_statistics_neg,
                                                                perm_dist_pos, perm_dist_neg,
-                                                               global_uncorrected_pvalue_count, global_uncorrected_pvalue_count_neg);
+                                                               global_uncorrected_pvalue_count, global_uncorrected_pvalue_count_neg,
+                                                               batch_size);
               auto threads = Thread::run (Thread::multi (processor), "permutation threads");
             }
 
@@ -325,6 +402,130 @@ namespace MR
             }
 
           }
+
+
+
+        //! Determine whether a permutation p-value is resolved relative to a significance level
+        /*! The p-value estimated from \a exceedances out of \a num_permutations is considered
+         * resolved if the Wilson score interval of the true p-value (of half-width \a z standard
+         * errors) lies entirely above or below \a alpha. */
+        inline bool pvalue_resolved (size_t exceedances, size_t num_permutations, double alpha, double z)
+        {
+          const double n = num_permutations;
+          const double p = exceedances / n;
+          const double denom = 1.0 + z*z/n;
+          const double centre = (p + z*z/(2.0*n)) / denom;
+          const double half_width = z * std::sqrt (p*(1.0-p)/n + z*z/(4.0*n*n)) / denom;
+          return (centre + half_width < alpha || centre - half_width > alpha);
+        }
+
+
+
+        // Check whether the FWE-corrected decision of every element is resolved given the permutations run so far
+        inline bool sequential_resolved (const Math::Vector<value_type>& perm_dist, size_t num_permutations,
+                                         const std::vector<value_type>& default_enhanced_statistics,
+                                         double alpha, double z)
+        {
+          std::vector<value_type> sorted (num_permutations);
+          for (size_t p = 0; p < num_permutations; ++p)
+            sorted[p] = perm_dist[p];
+          std::sort (sorted.begin(), sorted.end());
+          for (size_t i = 0; i < default_enhanced_statistics.size(); ++i) {
+            // elements with a non-positive statistic are never significant after FWE correction
+            if (default_enhanced_statistics[i] > 0.0) {
+              const size_t below = std::upper_bound (sorted.begin(), sorted.end(), default_enhanced_statistics[i]) - sorted.begin();
+              if (!pvalue_resolved (num_permutations - below, num_permutations, alpha, z))
+                return false;
+            }
+          }
+          return true;
+        }
+
+
+
+        //! Run permutations sequentially until all FWE-corrected inferences are resolved
+        /*! Permutations are run in blocks of PERMTEST_SEQUENTIAL_BLOCK_SIZE. After each block,
+         * testing stops if the FWE-corrected p-value of every element is determined to lie
+         * above or below \a alpha with the requested \a confidence (see pvalue_resolved()).
+         * This follows Besag & Clifford (1991): sampling of the null distribution stops once
+         * it can no longer change the decision. Elements far from the critical value are
+         * resolved after few permutations, so only elements close to it extend testing.
+         * The stopping rule does not consider the uncorrected p-values. These are estimated
+         * from the permutations actually run, so their precision is limited by that number;
+         * a warning is issued whenever testing stops early.
+         * At most \a max_permutations are run. The permutation distributions are resized to
+         * the number of permutations actually run, which is also returned. */
+        template <class StatsType, class EnhancementType>
+          inline size_t run_permutations_sequential (const StatsType& stats_calculator, const EnhancementType& enhancer,
+                                                     size_t max_permutations, value_type alpha, value_type confidence,
+                                                     const std::shared_ptr<std::vector<double> >& empirical_enhanced_statistic,
+                                                     const std::vector<value_type>& default_enhanced_statistics, const std::shared_ptr<std::vector<value_type> >& default_enhanced_statistics_neg,
+                                                     Math::Vector<value_type>& perm_dist_pos, std::shared_ptr<Math::Vector<value_type> >& perm_dist_neg,
+                                                     std::vector<value_type>& uncorrected_pvalues, std::shared_ptr<std::vector<value_type> >& uncorrected_pvalues_neg,
+                                                     const size_t batch_size = 1)
+          {
+            if (alpha <= 0.0 || alpha >= 1.0)
+              throw Exception ("significance level for sequential permutation testing must lie between 0 and 1");
+            if (confidence <= 0.0 || confidence >= 1.0)
+              throw Exception ("confidence for sequential permutation testing must lie between 0 and 1");
+            const double z = gsl_cdf_ugaussian_Qinv (0.5 * (1.0 - confidence));
+
+            perm_dist_pos.allocate (max_permutations);
+            if (perm_dist_neg)
+              perm_dist_neg->allocate (max_permutations);
+
+            std::vector<size_t> global_uncorrected_pvalue_count (stats_calculator.num_elements(), 0);
+            std::shared_ptr<std::vector<size_t> > global_uncorrected_pvalue_count_neg;
+            if (perm_dist_neg)
+              global_uncorrected_pvalue_count_neg.reset (new std::vector<size_t>  (stats_calculator.num_elements(), 0));
+
+            size_t num_permutations = 0;
+            {
+              PermutationStack permutations (max_permutations,
+                                             stats_calculator.num_subjects(),
+                                             "running up to " + str(max_permutations) + " permutations...");
+
+              while (num_permutations < max_permutations) {
+                num_permutations = std::min (num_permutations + PERMTEST_SEQUENTIAL_BLOCK_SIZE, max_permutations);
+                permutations.set_limit (num_permutations);
+                {
+                  Processor<StatsType, EnhancementType> processor (permutations, stats_calculator, enhancer,
+                                                                   empirical_enhanced_statistic,
+                                                                   default_enhanced_statistics, default_enhanced_statistics_neg,
+                                                                   perm_dist_pos, perm_dist_neg,
+                                                                   global_uncorrected_pvalue_count, global_uncorrected_pvalue_count_neg,
+                                                                   batch_size);
+                  auto threads = Thread::run (Thread::multi (processor), "permutation threads");
+                }
+                if (sequential_resolved (perm_dist_pos, num_permutations, default_enhanced_statistics, alpha, z) &&
+                    (!perm_dist_neg || sequential_resolved (*perm_dist_neg, num_permutations, *default_enhanced_statistics_neg, alpha, z)))
+                  break;
+              }
+              permutations.finish();
+            }
+
+            if (num_permutations < max_permutations) {
+              INFO ("all inferences resolved after " + str(num_permutations) + " permutations");
+              WARN ("permutation testing stopped early after " + str(num_permutations) + " of " + str(max_permutations) + " permutations; "
+                    "the stopping rule only considers FWE-corrected inference, so the uncorrected p-values"
+                    + std::string (empirical_enhanced_statistic ? " (including those of the non-stationarity adjusted statistic)" : "")
+                    + " are estimated from these " + str(num_permutations) + " permutations only");
+            } else {
+              INFO ("not all inferences resolved after the maximum of " + str(max_permutations) + " permutations");
+            }
+
+            perm_dist_pos.resize (num_permutations);
+            if (perm_dist_neg)
+              perm_dist_neg->resize (num_permutations);
+
+            for (size_t i = 0; i < stats_calculator.num_elements(); ++i) {
+              uncorrected_pvalues[i] = static_cast<value_type> (global_uncorrected_pvalue_count[i]) / static_cast<value_type> (num_permutations);
+              if (perm_dist_neg)
+                (*uncorrected_pvalues_neg)[i] = static_cast<value_type> ((*global_uncorrected_pvalue_count_neg)[i]) / static_cast<value_type> (num_permutations);
+            }
+
+            return num_permutations;
+          }
           //! @}
 
     }
@@ -0,0 +1,359 @@
+/*
+    Copyright 2011 Brain Research Institute, Melbourne, Australia
+
+    This file is part of MRtrix.
+
+    MRtrix is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    MRtrix is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with MRtrix.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __stats_shard_h__
+#define __stats_shard_h__
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#include "math/matrix.h"
+#include "math/vector.h"
+#include "stats/permtest.h"
+
+
+// Number of permutations processed between successive checkpoints of a shard file
+#define PERMTEST_SHARD_CHECKPOINT_SIZE 1000
+
+
+namespace MR
+{
+  namespace Stats
+  {
+    namespace PermTest
+    {
+
+
+      /** \addtogroup Statistics
+      @{ */
+
+      //! a hash identifying the inputs to an analysis, such that results from different analyses are not combined
+      /*! This uses the 64-bit FNV-1a hash of the values provided, in the order provided. */
+      class AnalysisHash
+      {
+        public:
+          AnalysisHash () : hash (14695981039346656037ULL) { }
+
+          void add (const value_type value) { add_bytes (&value, sizeof (value_type)); }
+
+          void add (const std::vector<value_type>& values)
+          {
+            const uint64_t size = values.size();
+            add_bytes (&size, sizeof (uint64_t));
+            add_bytes (values.data(), values.size() * sizeof (value_type));
+          }
+
+          void add (const Math::Matrix<value_type>& M)
+          {
+            const uint64_t size[] = { M.rows(), M.columns() };
+            add_bytes (size, sizeof (size));
+            for (size_t i = 0; i != M.rows(); ++i)
+              for (size_t j = 0; j != M.columns(); ++j)
+                add (M (i,j));
+          }
+
+          uint64_t value () const { return hash; }
+
+        private:
+          uint64_t hash;
+
+          void add_bytes (const void* data, const size_t size)
+          {
+            const uint8_t* bytes = reinterpret_cast<const uint8_t*> (data);
+            for (size_t n = 0; n != size; ++n)
+              hash = (hash ^ bytes[n]) * 1099511628211ULL;
+          }
+      };
+
+
+
+      /*! The partial results of permutation testing over a contiguous range of permutation indices.
+       *
+       * This stores, for permutations [first, last) of the full permutation sequence, the
+       * maximum enhanced statistic of each permutation, and the number of permutations for
+       * which the default enhanced statistic of each element exceeded its permuted value
+       * (from which the uncorrected p-values are computed). The number of permutations
+       * completed so far is also stored, such that an interrupted run can be resumed
+       * from the last checkpoint. Shards covering the full range of permutations can be
+       * merged to produce the final null distribution and uncorrected p-values. Each shard
+       * also records the seed of the permutation sequence, and the AnalysisHash of the
+       * analysis inputs (design, contrast, enhancement parameters, and default enhanced
+       * statistics), such that a shard is neither resumed nor merged as part of a
+       * different analysis or permutation sequence. */
+      class Shard
+      {
+        public:
+          Shard (const size_t num_elements, const size_t first, const size_t last, const uint64_t seed, const uint64_t analysis, const bool negative) :
+            num_elements (num_elements),
+            first (first),
+            last (last),
+            completed (0),
+            seed (seed),
+            analysis (analysis),
+            negative (negative),
+            perm_dist (last - first, 0.0),
+            uncorrected_count (num_elements, 0)
+          {
+            if (last <= first)
+              throw Exception ("invalid permutation range for shard: " + str(first) + " to " + str(last));
+            if (negative) {
+              perm_dist_neg.assign (last - first, 0.0);
+              uncorrected_count_neg.assign (num_elements, 0);
+            }
+          }
+
+          Shard (const std::string& path) { load (path); }
+
+
+          size_t size () const { return last - first; }
+          bool is_complete () const { return completed == size(); }
+
+          bool matches (const size_t num_elements, const size_t first, const size_t last, const uint64_t seed, const uint64_t analysis, const bool negative) const
+          {
+            return (this->num_elements == num_elements && this->first == first && this->last == last &&
+                    this->seed == seed && this->analysis == analysis && this->negative == negative);
+          }
+
+
+          //! write the shard to file; the file is replaced atomically to provide a consistent checkpoint
+          void save (const std::string& path) const
+          {
+            const std::string temp_path (path + ".tmp");
+            {
+              std::ofstream out (temp_path.c_str(), std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+              if (!out)
+                throw Exception ("error creating permutation shard file \"" + temp_path + "\"");
+              out << "mrtrix permutation shard\n";
+              out << "elements: " << num_elements << "\n";
+              out << "first: " << first << "\n";
+              out << "last: " << last << "\n";
+              out << "completed: " << completed << "\n";
+              out << "seed: " << seed << "\n";
+              out << "analysis: " << analysis << "\n";
+              out << "negative: " << (negative ? 1 : 0) << "\n";
+              out << "END\n";
+              out.write (reinterpret_cast<const char*> (perm_dist.data()), perm_dist.size() * sizeof (value_type));
+              out.write (reinterpret_cast<const char*> (uncorrected_count.data()), uncorrected_count.size() * sizeof (uint64_t));
+              if (negative) {
+                out.write (reinterpret_cast<const char*> (perm_dist_neg.data()), perm_dist_neg.size() * sizeof (value_type));
+                out.write (reinterpret_cast<const char*> (uncorrected_count_neg.data()), uncorrected_count_neg.size() * sizeof (uint64_t));
+              }
+              if (!out.good())
+                throw Exception ("error writing permutation shard file \"" + temp_path + "\"");
+            }
+            if (std::rename (temp_path.c_str(), path.c_str()))
+              throw Exception ("error renaming permutation shard file \"" + temp_path + "\" to \"" + path + "\": " + std::strerror (errno));
+          }
+
+
+          void load (const std::string& path)
+          {
+            std::ifstream in (path.c_str(), std::ios_base::in | std::ios_base::binary);
+            if (!in)
+              throw Exception ("failed to open permutation shard file \"" + path + "\"");
+            std::string line;
+            std::getline (in, line);
+            if (line != "mrtrix permutation shard")
+              throw Exception ("file \"" + path + "\" is not a permutation shard file");
+            num_elements = first = last = completed = 0;
+            seed = analysis = 0;
+            negative = false;
+            while (std::getline (in, line) && line != "END") {
+              const size_t colon = line.find (": ");
+              if (colon == std::string::npos)
+                throw Exception ("malformed header in permutation shard file \"" + path + "\"");
+              const std::string key = line.substr (0, colon), value = line.substr (colon + 2);
+              if (key == "elements")
+                num_elements = to<size_t> (value);
+              else if (key == "first")
+                first = to<size_t> (value);
+              else if (key == "last")
+                last = to<size_t> (value);
+              else if (key == "completed")
+                completed = to<size_t> (value);
+              else if (key == "seed")
+                seed = to<uint64_t> (value);
+              else if (key == "analysis")
+                analysis = to<uint64_t> (value);
+              else if (key == "negative")
+                negative = to<int> (value);
+            }
+            if (line != "END" || last <= first || completed > last - first)
+              throw Exception ("malformed header in permutation shard file \"" + path + "\"");
+            perm_dist.resize (last - first);
+            uncorrected_count.resize (num_elements);
+            in.read (reinterpret_cast<char*> (perm_dist.data()), perm_dist.size() * sizeof (value_type));
+            in.read (reinterpret_cast<char*> (uncorrected_count.data()), uncorrected_count.size() * sizeof (uint64_t));
+            if (negative) {
+              perm_dist_neg.resize (last - first);
+              uncorrected_count_neg.resize (num_elements);
+              in.read (reinterpret_cast<char*> (perm_dist_neg.data()), perm_dist_neg.size() * sizeof (value_type));
+              in.read (reinterpret_cast<char*> (uncorrected_count_neg.data()), uncorrected_count_neg.size() * sizeof (uint64_t));
+            } else {
+              perm_dist_neg.clear();
+              uncorrected_count_neg.clear();
+            }
+            if (!in)
+              throw Exception ("error reading permutation shard file \"" + path + "\"");
+          }
+
+
+          size_t num_elements, first, last, completed;
+          uint64_t seed, analysis;
+          bool negative;
+          std::vector<value_type> perm_dist, perm_dist_neg;
+          std::vector<uint64_t> uncorrected_count, uncorrected_count_neg;
+      };
+
+
+
+      //! run the outstanding permutations of a shard, saving a checkpoint to \a path at regular intervals
+      /*! A single PermutationStack covers all outstanding permutations of the shard; these
+       * are made available in stages of PERMTEST_SHARD_CHECKPOINT_SIZE, with a checkpoint
+       * saved at the end of each stage. */
+      template <class StatsType, class EnhancementType>
+        inline void run_shard (const StatsType& stats_calculator, const EnhancementType& enhancer, Shard& shard, const std::string& path,
+                               const std::shared_ptr<std::vector<double> >& empirical_enhanced_statistic,
+                               const std::vector<value_type>& default_enhanced_statistics, const std::shared_ptr<std::vector<value_type> >& default_enhanced_statistics_neg,
+                               const size_t batch_size = 1)
+        {
+          if (shard.is_complete())
+            return;
+          if (shard.completed)
+            INFO ("resuming permutation shard \"" + path + "\" from permutation " + str(shard.first + shard.completed));
+
+          const size_t start = shard.completed, remaining = shard.size() - shard.completed;
+          Math::Vector<value_type> perm_dist (remaining);
+          std::shared_ptr<Math::Vector<value_type> > perm_dist_neg;
+          if (shard.negative)
+            perm_dist_neg.reset (new Math::Vector<value_type> (remaining));
+
+          PermutationStack permutations (remaining,
+                                         stats_calculator.num_subjects(),
+                                         "running permutations " + str(shard.first + start) + " to " + str(shard.last - 1) + "...",
+                                         true, shard.first + start, shard.seed);
+
+          size_t num_run = 0;
+          while (num_run < remaining) {
+            const size_t stage_end = std::min (num_run + PERMTEST_SHARD_CHECKPOINT_SIZE, remaining);
+            permutations.set_limit (stage_end);
+            std::vector<size_t> uncorrected_count (shard.num_elements, 0);
+            std::shared_ptr<std::vector<size_t> > uncorrected_count_neg;
+            if (shard.negative)
+              uncorrected_count_neg.reset (new std::vector<size_t> (shard.num_elements, 0));
+            {
+              Processor<StatsType, EnhancementType> processor (permutations, stats_calculator, enhancer,
+                                                               empirical_enhanced_statistic,
+                                                               default_enhanced_statistics, default_enhanced_statistics_neg,
+                                                               perm_dist, perm_dist_neg,
+                                                               uncorrected_count, uncorrected_count_neg,
+                                                               batch_size);
+              auto threads = Thread::run (Thread::multi (processor), "permutation threads");
+            }
+
+            for (size_t p = num_run; p < stage_end; ++p) {
+              shard.perm_dist[start + p] = perm_dist[p];
+              if (shard.negative)
+                shard.perm_dist_neg[start + p] = (*perm_dist_neg)[p];
+            }
+            for (size_t i = 0; i < shard.num_elements; ++i) {
+              shard.uncorrected_count[i] += uncorrected_count[i];
+              if (shard.negative)
+                shard.uncorrected_count_neg[i] += (*uncorrected_count_neg)[i];
+            }
+            num_run = stage_end;
+            shard.completed = start + num_run;
+            shard.save (path);
+          }
+        }
+
+
+
+      //! combine a set of complete shards into the null distribution(s) and uncorrected p-values
+      /*! The shards must have been generated for the analysis identified by \a analysis, and must
+       * together cover permutations [0, \a num_permutations) exactly once. */
+      inline void merge_shards (const std::vector<std::string>& paths, const size_t num_elements, const size_t num_permutations,
+                                const uint64_t analysis, const bool negative,
+                                Math::Vector<value_type>& perm_dist, std::shared_ptr<Math::Vector<value_type> >& perm_dist_neg,
+                                std::vector<value_type>& uncorrected_pvalues, std::shared_ptr<std::vector<value_type> >& uncorrected_pvalues_neg)
+      {
+        std::vector<Shard> shards;
+        for (size_t n = 0; n != paths.size(); ++n) {
+          shards.push_back (Shard (paths[n]));
+          const Shard& shard (shards.back());
+          if (!shard.is_complete())
+            throw Exception ("permutation shard \"" + paths[n] + "\" is incomplete (" + str(shard.completed) + " of " + str(shard.size()) + " permutations)");
+          if (shard.num_elements != num_elements)
+            throw Exception ("permutation shard \"" + paths[n] + "\" does not match the number of elements in the analysis");
+          if (negative && !shard.negative)
+            throw Exception ("permutation shard \"" + paths[n] + "\" does not contain results for the negative contrast");
+          if (shard.analysis != analysis)
+            throw Exception ("permutation shard \"" + paths[n] + "\" was generated from a different analysis (design, contrast, "
+                             "enhancement parameters or input data differ)");
+        }
+        if (shards.empty())
+          throw Exception ("no permutation shards provided");
+        std::sort (shards.begin(), shards.end(), [] (const Shard& a, const Shard& b) { return a.first < b.first; });
+        size_t covered = 0;
+        for (size_t n = 0; n != shards.size(); ++n) {
+          if (shards[n].first != covered)
+            throw Exception ("permutation shards do not cover a contiguous range of permutations (expected shard starting at " + str(covered) + ")");
+          if (shards[n].seed != shards.front().seed)
+            throw Exception ("permutation shards were generated using different random seeds (" + str(shards.front().seed) + " and "
+                             + str(shards[n].seed) + "), and therefore do not form a single permutation sequence");
+          covered = shards[n].last;
+        }
+        if (covered != num_permutations)
+          throw Exception ("permutation shards cover permutations 0 to " + str(covered - 1) + ", but " + str(num_permutations) + " permutations were requested");
+
+        perm_dist.allocate (num_permutations);
+        if (negative)
+          perm_dist_neg.reset (new Math::Vector<value_type> (num_permutations));
+        std::vector<uint64_t> count (num_elements, 0), count_neg (negative ? num_elements : 0, 0);
+        for (std::vector<Shard>::const_iterator shard = shards.begin(); shard != shards.end(); ++shard) {
+          for (size_t p = 0; p != shard->size(); ++p) {
+            perm_dist[shard->first + p] = shard->perm_dist[p];
+            if (negative)
+              (*perm_dist_neg)[shard->first + p] = shard->perm_dist_neg[p];
+          }
+          for (size_t i = 0; i != num_elements; ++i) {
+            count[i] += shard->uncorrected_count[i];
+            if (negative)
+              count_neg[i] += shard->uncorrected_count_neg[i];
+          }
+        }
+
+        uncorrected_pvalues.resize (num_elements);
+        if (negative)
+          uncorrected_pvalues_neg.reset (new std::vector<value_type> (num_elements));
+        for (size_t i = 0; i != num_elements; ++i) {
+          uncorrected_pvalues[i] = static_cast<value_type> (count[i]) / static_cast<value_type> (num_permutations);
+          if (negative)
+            (*uncorrected_pvalues_neg)[i] = static_cast<value_type> (count_neg[i]) / static_cast<value_type> (num_permutations);
+        }
+      }
+      //! @}
+
+
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,336 @@
+/*
+    Copyright 2011 Brain Research Institute, Melbourne, Australia
+
+    This file is part of MRtrix.
+
+    MRtrix is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    MRtrix is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with MRtrix.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __stats_subject_data_h__
+#define __stats_subject_data_h__
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <sys/stat.h>
+
+#include "memory.h"
+#include "progressbar.h"
+#include "thread.h"
+#include "file/entry.h"
+#include "file/mmap.h"
+#include "file/path.h"
+#include "file/utils.h"
+#include "math/matrix.h"
+
+
+// Number of values held in RAM at a time when reordering subject data into a data file
+#define SUBJECT_DATA_BLOCK_SIZE 16777216
+
+// Alignment (in bytes) of the start of the data within a subject data file
+#define SUBJECT_DATA_ALIGNMENT 4096
+
+
+namespace MR
+{
+  namespace Stats
+  {
+
+    /** \addtogroup Statistics
+    @{ */
+
+    /*! The measurements of all subjects, with one row per element and one column per subject.
+     *
+     * The data are either held in RAM, or stored in a data file that is memory-mapped
+     * read-only, such that the matrix need not fit in RAM. In the data file, the
+     * values of all subjects for each element are stored contiguously, so that each
+     * block of elements processed by the GLM occupies a contiguous region of the file.
+     * The file header records the subject images along with the size and modification
+     * time of each, and a hash of the element layout (e.g. the mask voxel positions);
+     * an existing file that matches these is reused rather than reloading the subject
+     * images, irrespective of the design and contrast matrices. A subject image that
+     * has been modified or replaced since the file was written, or that cannot be
+     * queried (e.g. a multi-file image specifier), causes the contents to be regenerated.
+     *
+     * Subjects are loaded in parallel using the \a LoaderType functor, which must provide
+     * the method <tt>void operator() (size_t subject, std::vector<value_type>& values)</tt>,
+     * filling \a values with the measurement of each element for that subject. */
+    template <typename ValueType>
+      class SubjectData
+      {
+        public:
+          typedef ValueType value_type;
+
+          //! hold the data in RAM
+          SubjectData (const size_t num_elements, const std::vector<std::string>& subjects) :
+            num_elements (num_elements),
+            subjects (subjects),
+            layout_hash (0),
+            data (new Math::Matrix<value_type> (num_elements, subjects.size())),
+            loaded (false) { }
+
+          //! store the data in the file at \a path, reusing its contents if it already matches
+          SubjectData (const size_t num_elements, const std::vector<std::string>& subjects,
+                       const std::string& path, const uint64_t layout_hash) :
+            num_elements (num_elements),
+            subjects (subjects),
+            path (path),
+            layout_hash (layout_hash),
+            signatures (get_signatures (subjects)),
+            loaded (false)
+          {
+            if (Path::exists (path)) {
+              const size_t offset = read_header();
+              if (offset) {
+                INFO ("reusing subject data stored in file \"" + path + "\"");
+                map (offset);
+              } else {
+                WARN ("existing subject data file \"" + path + "\" does not match the current analysis; its contents will be regenerated");
+              }
+            }
+          }
+
+
+          //! whether the data are available (either loaded, or reused from an existing data file)
+          bool is_loaded () const { return loaded; }
+
+          const Math::Matrix<value_type>& matrix () const { assert (loaded); return *data; }
+
+
+          template <class LoaderType>
+            void load (const LoaderType& loader)
+            {
+              if (loaded)
+                return;
+              std::unique_ptr<std::fstream> staging;
+              std::string staging_path;
+              size_t offset = 0;
+              if (path.size()) {
+                // Subjects are first written contiguously to a temporary file, then reordered
+                staging_path = File::create_tempfile (int64_t (num_elements) * subjects.size() * sizeof (value_type), "dat");
+                staging.reset (new std::fstream (staging_path.c_str(), std::ios_base::in | std::ios_base::out | std::ios_base::binary));
+                if (!*staging)
+                  throw Exception ("error opening temporary file \"" + staging_path + "\"");
+              }
+
+              try {
+                {
+                  ProgressBar progress ("loading images...", subjects.size());
+                  // Subjects are loaded concurrently, so the log level is lowered once here rather than within each loader
+                  LogLevelLatch log_level (0);
+                  Loader<LoaderType> thread_loader (*this, loader, staging.get(), progress);
+                  Thread::run (Thread::multi (thread_loader), "subject loading threads").wait();
+                }
+                if (staging) {
+                  staging.reset();
+                  offset = write_file (staging_path);
+                  File::unlink (staging_path);
+                }
+              }
+              catch (...) {
+                if (staging_path.size()) {
+                  staging.reset();
+                  File::unlink (staging_path);
+                }
+                throw;
+              }
+              if (path.size())
+                map (offset);
+              loaded = true;
+            }
+
+
+        protected:
+          const size_t num_elements;
+          const std::vector<std::string> subjects;
+          const std::string path;
+          const uint64_t layout_hash;
+          const std::vector<std::string> signatures;
+          std::unique_ptr<File::MMap> mmap;
+          std::unique_ptr<Math::Matrix<value_type> > data;
+          bool loaded;
+
+
+          template <class LoaderType>
+            class Loader {
+              public:
+                Loader (SubjectData& master, const LoaderType& loader, std::fstream* staging, ProgressBar& progress) :
+                  master (master), loader (loader), staging (staging), progress (progress),
+                  next_subject (std::make_shared<std::atomic<size_t> > (0)),
+                  mutex (std::make_shared<std::mutex>()) { }
+
+                void execute () {
+                  size_t subject;
+                  while ((subject = (*next_subject)++) < master.subjects.size()) {
+                    values.assign (master.num_elements, value_type (0));
+                    loader (subject, values);
+                    if (staging) {
+                      std::lock_guard<std::mutex> lock (*mutex);
+                      staging->seekp (int64_t (subject) * master.num_elements * sizeof (value_type));
+                      staging->write (reinterpret_cast<const char*> (values.data()), values.size() * sizeof (value_type));
+                      if (!staging->good())
+                        throw Exception ("error writing subject data to temporary file");
+                      ++progress;
+                    } else {
+                      for (size_t i = 0; i < master.num_elements; ++i)
+                        (*master.data) (i, subject) = values[i];
+                      std::lock_guard<std::mutex> lock (*mutex);
+                      ++progress;
+                    }
+                  }
+                }
+
+              private:
+                SubjectData& master;
+                LoaderType loader;
+                std::fstream* staging;
+                ProgressBar& progress;
+                std::shared_ptr<std::atomic<size_t> > next_subject;
+                std::shared_ptr<std::mutex> mutex;
+                std::vector<value_type> values;
+            };
+
+
+          // Size and modification time of each subject image, recorded before the images are loaded;
+          //   empty where the image cannot be queried as a single file
+          static std::vector<std::string> get_signatures (const std::vector<std::string>& subjects)
+          {
+            std::vector<std::string> result;
+            for (const auto& subject : subjects) {
+              struct stat buf;
+              if (stat (subject.c_str(), &buf))
+                result.push_back (std::string());
+              else
+                result.push_back (str (int64_t (buf.st_size)) + " " + str (int64_t (buf.st_mtime)));
+            }
+            return result;
+          }
+
+
+          // Parse the header of the data file; returns the offset of the data, or zero if the file does not match
+          size_t read_header () const
+          {
+            std::ifstream in (path.c_str(), std::ios_base::in | std::ios_base::binary);
+            if (!in)
+              throw Exception ("failed to open subject data file \"" + path + "\"");
+            std::string line;
+            std::getline (in, line);
+            if (line != "mrtrix subject data")
+              throw Exception ("file \"" + path + "\" is not a subject data file");
+            size_t file_elements = 0, file_subjects = 0, offset = 0;
+            uint64_t file_hash = 0;
+            std::vector<std::string> file_subject_paths, file_signatures;
+            while (std::getline (in, line) && line != "END") {
+              const size_t colon = line.find (": ");
+              if (colon == std::string::npos)
+                throw Exception ("malformed header in subject data file \"" + path + "\"");
+              const std::string key = line.substr (0, colon), value = line.substr (colon + 2);
+              if (key == "elements")
+                file_elements = to<size_t> (value);
+              else if (key == "subjects")
+                file_subjects = to<size_t> (value);
+              else if (key == "layout")
+                file_hash = to<uint64_t> (value);
+              else if (key == "subject")
+                file_subject_paths.push_back (value);
+              else if (key == "signature")
+                file_signatures.push_back (value);
+              else if (key == "offset")
+                offset = to<size_t> (value);
+            }
+            if (line != "END" || !offset)
+              throw Exception ("malformed header in subject data file \"" + path + "\"");
+            if (file_elements != num_elements || file_subjects != subjects.size() || file_hash != layout_hash || file_subject_paths != subjects)
+              return 0;
+            // Subject images that cannot be queried are never trusted to be unchanged
+            if (file_signatures != signatures || std::find (signatures.begin(), signatures.end(), std::string()) != signatures.end())
+              return 0;
+            in.seekg (0, std::ios_base::end);
+            if (int64_t (in.tellg()) < int64_t (offset + num_elements * subjects.size() * sizeof (value_type)))
+              return 0;
+            return offset;
+          }
+
+
+          // Write the data file, reordering the contents of the staging file from subject-major to element-major;
+          //   returns the offset of the data
+          size_t write_file (const std::string& staging_path) const
+          {
+            std::ostringstream header;
+            header << "mrtrix subject data\n";
+            header << "elements: " << num_elements << "\n";
+            header << "subjects: " << subjects.size() << "\n";
+            header << "layout: " << layout_hash << "\n";
+            for (size_t s = 0; s != subjects.size(); ++s) {
+              header << "subject: " << subjects[s] << "\n";
+              header << "signature: " << signatures[s] << "\n";
+            }
+            // Reserve space for the offset entry, then round up to the alignment boundary
+            const size_t header_size = header.str().size() + std::string ("offset: \nEND\n").size() + 20;
+            const size_t offset = SUBJECT_DATA_ALIGNMENT * ((header_size + SUBJECT_DATA_ALIGNMENT - 1) / SUBJECT_DATA_ALIGNMENT);
+            header << "offset: " << offset << "\nEND\n";
+
+            const std::string temp_path (path + ".tmp");
+            {
+              std::ofstream out (temp_path.c_str(), std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+              if (!out)
+                throw Exception ("error creating subject data file \"" + temp_path + "\"");
+              const std::string header_string (header.str());
+              out.write (header_string.c_str(), header_string.size());
+              const std::vector<char> padding (offset - header_string.size(), '\n');
+              out.write (padding.data(), padding.size());
+
+              File::MMap staging ((File::Entry (staging_path)));
+              const value_type* source = reinterpret_cast<const value_type*> (staging.address());
+              const size_t num_subjects = subjects.size();
+              const size_t block_elements = std::max (size_t (1), size_t (SUBJECT_DATA_BLOCK_SIZE) / num_subjects);
+              std::vector<value_type> block;
+              ProgressBar progress ("writing subject data file...", (num_elements + block_elements - 1) / block_elements);
+              for (size_t first = 0; first < num_elements; first += block_elements) {
+                const size_t count = std::min (block_elements, num_elements - first);
+                block.resize (count * num_subjects);
+                for (size_t s = 0; s != num_subjects; ++s) {
+                  const value_type* column = source + s * num_elements + first;
+                  for (size_t i = 0; i != count; ++i)
+                    block[i*num_subjects + s] = column[i];
+                }
+                out.write (reinterpret_cast<const char*> (block.data()), block.size() * sizeof (value_type));
+                ++progress;
+              }
+              if (!out.good())
+                throw Exception ("error writing subject data file \"" + temp_path + "\"");
+            }
+            if (std::rename (temp_path.c_str(), path.c_str()))
+              throw Exception ("error renaming subject data file \"" + temp_path + "\" to \"" + path + "\": " + std::strerror (errno));
+            return offset;
+          }
+
+
+          void map (const size_t offset)
+          {
+            mmap.reset (new File::MMap (File::Entry (path, offset), false, false, int64_t (num_elements) * subjects.size() * sizeof (value_type)));
+            // The mapping is read-only; the matrix is only ever read by the GLM
+            data.reset (new Math::Matrix<value_type> (reinterpret_cast<value_type*> (const_cast<uint8_t*> (mmap->address())), num_elements, subjects.size()));
+            loaded = true;
+          }
+      };
+    //! @}
+
+  }
+}
+
+#endif
@@ -41,6 +41,15 @@ namespace MR
       /** \addtogroup Statistics
       @{ */
 
+      /*! Threshold-free cluster enhancement
+       *
+       * Rather than performing a full connected component labelling at every
+       * threshold, elements are sorted by statistic once, and thresholds are
+       * swept from high to low. As each threshold is passed, the newly
+       * supra-threshold elements are merged into the existing clusters using a
+       * union-find structure; the cluster-extent contribution at that threshold
+       * is then added lazily to the root of each cluster, and propagated down
+       * to the individual elements only once all thresholds have been processed. */
       class Enhancer {
         public:
           Enhancer (const Image::Filter::Connector& connector, const value_type dh, const value_type E, const value_type H) :
@@ -52,13 +61,49 @@ namespace MR
             enhanced_stats.resize(stats.size());
             std::fill (enhanced_stats.begin(), enhanced_stats.end(), 0.0);
 
-            for (value_type h = this->dh; h < max_stat; h += this->dh) {
-              std::vector<Image::Filter::cluster> clusters;
-              std::vector<uint32_t> labels (enhanced_stats.size(), 0);
-              connector.run (clusters, labels, stats, h);
-              for (size_t i = 0; i < enhanced_stats.size(); ++i)
-                if (labels[i])
-                  enhanced_stats[i] += pow (clusters[labels[i]-1].size, this->E) * pow (h, this->H);
+            std::vector<value_type> thresholds;
+            for (value_type h = this->dh; h < max_stat; h += this->dh)
+              thresholds.push_back (h);
+
+            std::vector<uint32_t> order (stats.size());
+            for (uint32_t i = 0; i < order.size(); ++i)
+              order[i] = i;
+            std::sort (order.begin(), order.end(), [&] (const uint32_t a, const uint32_t b) { return stats[a] > stats[b]; });
+
+            // parent == not_added indicates an element that is not yet above threshold
+            // The enhanced statistic of an element is the sum of 'offset' along the path to its root
+            const uint32_t not_added = std::numeric_limits<uint32_t>::max();
+            std::vector<uint32_t> parent (stats.size(), not_added), size (stats.size(), 0), roots, path;
+            std::vector<double> offset (stats.size(), 0.0);
+
+            size_t next = 0;
+            for (size_t t = thresholds.size(); t--;) {
+              const value_type h = thresholds[t];
+              for (; next < order.size() && stats[order[next]] > h; ++next) {
+                const uint32_t i = order[next];
+                parent[i] = i;
+                size[i] = 1;
+                roots.push_back (i);
+                for (const uint32_t* n = connector.neighbours_begin (i); n != connector.neighbours_end (i); ++n) {
+                  if (parent[*n] != not_added)
+                    merge (i, *n, parent, size, offset, path);
+                }
+              }
+              const double h_term = pow (h, this->H);
+              size_t num_roots = 0;
+              for (std::vector<uint32_t>::const_iterator r = roots.begin(); r != roots.end(); ++r) {
+                if (parent[*r] == *r) {
+                  offset[*r] += pow (size[*r], this->E) * h_term;
+                  roots[num_roots++] = *r;
+                }
+              }
+              roots.resize (num_roots);
+            }
+
+            for (size_t n = 0; n != next; ++n) {
+              const uint32_t i = order[n];
+              const uint32_t root = find (i, parent, offset, path);
+              enhanced_stats[i] = (i == root) ? offset[i] : (offset[i] + offset[root]);
             }
 
             return *std::max_element (enhanced_stats.begin(), enhanced_stats.end());
@@ -67,6 +112,40 @@ namespace MR
         protected:
           const Image::Filter::Connector& connector;
           const value_type dh, E, H;
+
+          // Find the root of the tree containing element i, compressing the path to the root
+          //   while preserving the cumulative offset of each element along the way
+          static uint32_t find (const uint32_t i, std::vector<uint32_t>& parent, std::vector<double>& offset, std::vector<uint32_t>& path)
+          {
+            uint32_t root = i;
+            path.clear();
+            while (parent[root] != root) {
+              path.push_back (root);
+              root = parent[root];
+            }
+            // Process from the element nearest the root outwards, so that the parent's offset
+            //   is already relative to the root when it is accumulated
+            for (size_t p = path.size(); p-- > 1;) {
+              const uint32_t node = path[p-1];
+              if (parent[node] != root) {
+                offset[node] += offset[parent[node]];
+                parent[node] = root;
+              }
+            }
+            return root;
+          }
+
+          static void merge (const uint32_t a, const uint32_t b, std::vector<uint32_t>& parent, std::vector<uint32_t>& size, std::vector<double>& offset, std::vector<uint32_t>& path)
+          {
+            uint32_t root = find (a, parent, offset, path), child = find (b, parent, offset, path);
+            if (root == child)
+              return;
+            if (size[child] > size[root])
+              std::swap (root, child);
+            parent[child] = root;
+            offset[child] -= offset[root];
+            size[root] += size[child];
+          }
       };
 
       //! @}